@@ -0,0 +1,65 @@
+#ifndef PROTOSLANG_ARENA_H
+#define PROTOSLANG_ARENA_H
+
+#include "common.h"
+
+// Small heap blocks are carved out of pages in large mmap-backed arenas,
+// segregated by size class. Since reallocate() always knows the size of the
+// block it is resizing, blocks carry no header: the size class locates the
+// block's page, and the page its arena. Blocks larger than ARENA_MAX_BLOCK
+// come from the system allocator.
+//
+// Pages that hold no live blocks after a sweep are handed back to the OS
+// with madvise(MADV_DONTNEED), so the resident size follows the live heap.
+
+// The size of a page, the unit in which memory is returned to the OS.
+#define ARENA_PAGE_SIZE (64 * 1024)
+
+// The size and alignment of an arena. The first page holds its page table.
+#define ARENA_SIZE (64 * 1024 * 1024)
+#define ARENA_PAGES (ARENA_SIZE / ARENA_PAGE_SIZE)
+
+// The largest block served from an arena.
+#define ARENA_MAX_BLOCK 2048
+
+typedef struct {
+    // address space reserved by arenas
+    size_t reserved_bytes;
+    // the pages currently backed by memory, and the most that ever were
+    size_t resident_pages;
+    size_t peak_resident_pages;
+    // the pages given back to the OS over the life of the process
+    size_t released_pages;
+} ArenaStats;
+
+// Allocate and free a block of at most ARENA_MAX_BLOCK bytes. Returns NULL
+// when no arena can be mapped.
+void *arena_allocate(size_t size);
+void arena_free(void *block, size_t size);
+
+// Free a block from a worker of a parallel sweep. Any number of workers may
+// free concurrently, as long as nothing allocates in the meantime.
+void arena_free_concurrent(void *block, size_t size);
+
+// Whether two sizes share a size class, in which case a block can be resized in place.
+bool arena_same_class(size_t a, size_t b);
+
+// Rebuild the page lists and queue the pages without live blocks, beyond a
+// few kept for reuse, to be returned to the OS. Called once a sweep has
+// finished. Queued pages are not handed out until they have been returned.
+void arena_release_empty_pages();
+
+// Return a few of the queued pages to the OS, so that an incremental
+// collection can spread the work over its slices. Returns true once no
+// queued pages are left.
+bool arena_release_queued_pages();
+
+// Ask for transparent huge pages on arenas, to cut TLB misses on a hot heap.
+void arena_use_huge_pages(bool enabled);
+
+ArenaStats arena_stats();
+
+// Unmap every arena. Every block they held must already be dead.
+void free_arenas();
+
+#endif //PROTOSLANG_ARENA_H
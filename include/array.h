@@ -0,0 +1,33 @@
+#ifndef PROTOSLANG_ARRAY_H
+#define PROTOSLANG_ARRAY_H
+
+#include "common.h"
+#include "value.h"
+
+// Natives that make packed arrays and run the vectorized kernels over them.
+// Like the other natives, they return nil when given arguments they do not
+// take.
+
+// array(n) makes an array of n zero doubles, array(list) one of the numbers
+// in a list. int_array() does the same with integers.
+Value array_native(int arg_count, Value *args);
+Value int_array_native(int arg_count, Value *args);
+
+// sum(a), min(a) and max(a) of the elements, min and max are nil when there
+// are none. dot(a, b) of two arrays of doubles of the same length.
+Value sum_native(int arg_count, Value *args);
+Value min_native(int arg_count, Value *args);
+Value max_native(int arg_count, Value *args);
+Value dot_native(int arg_count, Value *args);
+
+// scale(a, x) multiplies every element of an array of doubles by x, and
+// add(a, b) adds b to a element by element. Both change a and return it.
+Value scale_native(int arg_count, Value *args);
+Value add_native(int arg_count, Value *args);
+
+// count_less(a, x) and count_greater(a, x) count the elements below and
+// above x.
+Value count_less_native(int arg_count, Value *args);
+Value count_greater_native(int arg_count, Value *args);
+
+#endif //PROTOSLANG_ARRAY_H
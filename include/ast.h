@@ -0,0 +1,161 @@
+#ifndef PROTOSLANG_AST_H
+#define PROTOSLANG_AST_H
+
+#include "common.h"
+#include "lexer.h"
+
+// The parser builds a tree of nodes for a whole script, the optimizer rewrites
+// it in place and the compiler emits bytecode from it. Nodes never hold heap
+// objects, so the tree is invisible to the garbage collector: string literals
+// point into the source or into the tree's arena until they are emitted.
+
+typedef enum {
+    // expressions
+    NODE_NUMBER,
+    NODE_INTEGER,
+    NODE_STRING,
+    NODE_TRUE,
+    NODE_FALSE,
+    NODE_NIL,
+    NODE_VARIABLE,
+    NODE_ASSIGN,
+    NODE_UNARY,
+    NODE_BINARY,
+    NODE_AND,
+    NODE_OR,
+    NODE_CALL,
+    NODE_LIST,
+    NODE_INDEX,
+    NODE_STORE_INDEX,
+
+    // statements
+    NODE_EXPRESSION_STATEMENT,
+    NODE_PRINTLN,
+    NODE_LET,
+    NODE_FUNCTION,
+    NODE_BLOCK,
+    NODE_IF,
+    NODE_WHILE,
+    NODE_FOR_IN,
+    NODE_RETURN,
+    NODE_IMPORT,
+    // statements the optimizer found can never run. they are compiled only to
+    // report the errors they hold, and none of their code is kept.
+    NODE_UNREACHABLE,
+
+    // the top level of a script
+    NODE_SCRIPT,
+} NodeType;
+
+typedef struct Node Node;
+
+typedef struct {
+    Node **items;
+    int count;
+    int capacity;
+} NodeList;
+
+struct Node {
+    NodeType type;
+
+    // the token the node was parsed from: the operator, name, literal or
+    // keyword. its line is the line of the emitted code, and errors found
+    // after parsing are reported at it.
+    Token token;
+
+    union {
+        double number;
+        int64_t integer;
+
+        // the characters of a string literal or of the path of an import,
+        // without the quotes
+        struct {
+            const char *chars;
+            int length;
+        } string;
+
+        // unary operators, the token holds the operator
+        Node *operand;
+
+        // binary operators, and, or. the token holds the operator
+        struct {
+            Node *left;
+            Node *right;
+        } binary;
+
+        // assignments and let declarations, the token holds the name. the
+        // value of a declaration without initializer is NULL.
+        Node *value;
+
+        struct {
+            Node *callee;
+            NodeList arguments;
+        } call;
+
+        // list literals, blocks, scripts and unreachable statements
+        NodeList items;
+
+        // list indexing, the value is NULL unless the item is stored
+        struct {
+            Node *list;
+            Node *index;
+            Node *value;
+        } subscript;
+
+        // expression statements, println and return. the expression of a
+        // return without a value is NULL.
+        Node *expression;
+
+        // function declarations, the token holds the name and each parameter
+        // is a variable node. the body of a deferred function is not parsed:
+        // the source from its parameter list to its closing brace is kept
+        // instead, it is NULL for a function compiled with the script.
+        struct {
+            NodeList parameters;
+            NodeList body;
+            const char *source;
+            int source_length;
+            int source_line;
+        } function;
+
+        // if and while. the else branch is NULL when absent, and always for while loops
+        struct {
+            Node *condition;
+            Node *then_branch;
+            Node *else_branch;
+        } branch;
+
+        // for-in loops, the token holds the loop variable
+        struct {
+            Node *iterable;
+            Node *body;
+            // whether the iterable is a range rather than a list
+            bool range;
+        } for_in;
+    } as;
+};
+
+// Nodes are bump allocated from chunks and freed all at once.
+typedef struct AstChunk AstChunk;
+
+typedef struct {
+    AstChunk *chunks;
+    // whether the chunks are allocated off the VM heap, for a tree parsed on
+    // a compile thread, where the collector and the heap limits cannot run.
+    bool unmanaged;
+} AstArena;
+
+void initialize_ast_arena(AstArena *arena, bool unmanaged);
+
+// Allocate zeroed memory that lives as long as the arena.
+void *ast_allocate(AstArena *arena, size_t size);
+
+// Allocate a node of the given type, parsed from token.
+Node *new_node(AstArena *arena, NodeType type, Token token);
+
+// Append a node to a list, growing it within the arena.
+void append_node(AstArena *arena, NodeList *list, Node *node);
+
+void free_ast_arena(AstArena *arena);
+
+#endif //PROTOSLANG_AST_H
@@ -4,6 +4,19 @@
 #include "object.h"
 #include "vm.h"
 
-ObjFunction *compile(const char *source);
+// Compile a script. Its errors name the path, which may be NULL, and which
+// must outlive the functions compiled from the script.
+ObjFunction *compile(const char *source, const char *path);
+
+// Compile the scripts of a program into one script that runs them in order,
+// parsing up to threads of them at once. paths may be NULL.
+ObjFunction *compile_program(const char **sources, const char **paths, int count, int threads);
+
+// Compile the body of a function whose compilation was deferred to its first
+// call. Returns false, leaving the function deferred, if the body has errors.
+bool compile_deferred_function(ObjFunction *function);
+
+// mark the functions that are still being compiled as garbage collector roots
+void mark_compiler_roots();
 
 #endif //PROTOSLANG_COMPILER_H
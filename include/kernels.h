@@ -0,0 +1,38 @@
+#ifndef PROTOSLANG_KERNELS_H
+#define PROTOSLANG_KERNELS_H
+
+#include "common.h"
+
+// Loops over packed doubles, run by the array natives. Each kernel has a
+// plain version and, on x86, an SSE2 and an AVX2 version; the widest one the
+// CPU supports is chosen at startup. Sums and dot products add the elements
+// in eight interleaved lanes that every version combines in the same order,
+// so a result does not depend on the version that computed it, although its
+// rounding may differ from a loop that adds the elements one by one. NaNs are
+// skipped by min and max, and never compare below or above a bound.
+
+typedef struct {
+    const char *name;
+    double (*sum)(const double *values, size_t count);
+    double (*dot)(const double *a, const double *b, size_t count);
+    // the least and greatest element, +inf and -inf if there is none
+    double (*min)(const double *values, size_t count);
+    double (*max)(const double *values, size_t count);
+    // multiply each element by factor, and add b to a element by element
+    void (*scale)(double *values, size_t count, double factor);
+    void (*add)(double *a, const double *b, size_t count);
+    // the number of elements below and above a bound
+    size_t (*count_less)(const double *values, size_t count, double bound);
+    size_t (*count_greater)(const double *values, size_t count, double bound);
+} Kernels;
+
+extern Kernels kernels;
+
+// Choose the widest kernels the CPU supports.
+void initialize_kernels();
+
+// Choose the kernels of a version by name, "plain", "sse2" or "avx2", if the
+// CPU supports it. Returns false otherwise.
+bool select_kernels(const char *name);
+
+#endif //PROTOSLANG_KERNELS_H
@@ -1,9 +1,9 @@
 #ifndef PROTOSLANG_MEMORY_H
 #define PROTOSLANG_MEMORY_H
 
+#include "arena.h"
 #include "common.h"
 #include "object.h"
-#include "object.h"
 
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
@@ -23,7 +23,98 @@
 #define GROW_ARRAY(previous, type, old_capacity, new_capacity) \
     (type*)reallocate(previous, sizeof(type) * (old_capacity), sizeof(type) * (new_capacity))
 
+// The heap size that triggers the first collection, and the factor by which
+// the threshold grows relative to the live heap after each collection.
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+
+// The default pause budget of a single incremental slice, in microseconds.
+#define GC_DEFAULT_MAX_PAUSE_US 500
+
+// Pauses are bucketed by powers of two microseconds: bucket 0 holds pauses
+// under 1us, bucket i holds pauses in [2^(i-1), 2^i) us, and the last bucket
+// holds everything longer.
+#define GC_PAUSE_BUCKETS 20
+
+typedef enum {
+    // No collection is in progress, the mutator runs freely.
+    GC_PHASE_IDLE,
+    // Roots have been grayed and gray objects are being traced in slices.
+    // Write barriers are active in this phase only.
+    GC_PHASE_MARK,
+    // Marking is complete and unreached objects are being freed in slices.
+    GC_PHASE_SWEEP,
+    // The sweep is done and emptied pages are being returned to the OS in slices.
+    GC_PHASE_RELEASE,
+} GCPhase;
+
+typedef struct {
+    // The number of completed collection cycles.
+    uint64_t cycles;
+    // The number of pauses recorded, and their total and longest duration.
+    uint64_t pauses;
+    uint64_t total_pause_ns;
+    uint64_t max_pause_ns;
+    // The longest pause in CPU time, which leaves out time the thread was preempted.
+    uint64_t max_pause_cpu_ns;
+    // The pause duration histogram, see GC_PAUSE_BUCKETS.
+    uint64_t histogram[GC_PAUSE_BUCKETS];
+} GCStats;
+
+// The number of live objects and bytes of each type.
+typedef struct {
+    size_t objects[OBJ_TYPE_COUNT];
+    size_t bytes[OBJ_TYPE_COUNT];
+} HeapCensus;
+
+typedef struct {
+    // The bytes currently allocated by the VM, and the most it ever held.
+    size_t bytes_allocated;
+    size_t peak_bytes_allocated;
+    // The configured limits, zero when unlimited. Crossing the soft limit
+    // forces a collection, crossing the hard limit is an out-of-memory error.
+    size_t soft_limit;
+    size_t hard_limit;
+    // The number of out-of-memory errors raised.
+    uint64_t out_of_memory_errors;
+    // The number of completed collections, and the live heap by type, counted
+    // by walking the heap when the stats are taken.
+    uint64_t collections;
+    HeapCensus live;
+    // The pages of the arenas that small blocks are allocated from.
+    ArenaStats arenas;
+} MemoryStats;
+
 void* reallocate(void* previous, size_t old_size, size_t new_size);
 void free_objects();
 
+// Gray a value or object so that it is traced in the current collection.
+void mark_value(Value value);
+void mark_object(Obj* object);
+
+// Run a complete collection, finishing any incremental cycle in progress.
+void collect_garbage();
+
+// Perform one bounded slice of incremental collection work.
+void gc_step();
+
+// Finish an incremental sweep in progress, which frees objects that other
+// unreached objects may still refer to.
+void finish_sweep();
+
+// Print the collector's pause histogram to stderr.
+void print_gc_stats();
+
+// Snapshot the heap accounting counters, or print them to stderr.
+MemoryStats get_memory_stats();
+void print_memory_stats();
+
+// Preserve the tri-color invariant when a reference is stored into the heap
+// or a root while marking is in progress: the stored value is grayed so that
+// a black object never points at a white one.
+#define WRITE_BARRIER(value) \
+    do { \
+        if (vm.gc_phase == GC_PHASE_MARK) mark_value(value); \
+    } while (false)
+
 #endif //PROTOSLANG_MEMORY_H
@@ -35,6 +35,7 @@ typedef enum {
     OP_INDEX_LIST,
     OP_STORE_LIST,
     OP_GET_LIST_LENGTH,
+    OP_SLICE_LIST,
 
     // range operations
     OP_BUILD_RANGE,
@@ -68,9 +69,64 @@ typedef enum {
     OP_GREATER,
     OP_LESS,
     OP_LESS_EQUAL,
-    // TODO: implement !=, <=, and >=
+
+    // emitted by the peephole optimizer in place of instruction sequences
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_POPN,
+
+    // inlined calls: jump to the inlined body if the global a function was
+    // declared as still holds it, read values below the top of the stack, and
+    // drop values from under the result. OP_JUMP_IF_CALLEE takes the index of
+    // the function's constant followed by a jump offset.
+    OP_JUMP_IF_CALLEE,
+    OP_PEEK,
+    OP_POP_UNDER,
+
+    // arithmetic and comparisons on operands the compiler proved are numbers,
+    // which skip the type checks
+    OP_ADD_NN,
+    OP_SUBTRACT_NN,
+    OP_MULTIPLY_NN,
+    OP_DIVIDE_NN,
+    OP_GREATER_NN,
+    OP_LESS_NN,
+    OP_LESS_EQUAL_NN,
+    OP_GREATER_EQUAL_NN,
+
+    // add a number to, or subtract it from, a local known to hold a number,
+    // in place: the update of a loop counter in one instruction
+    OP_ADD_LOCAL_NN,
+    OP_SUBTRACT_LOCAL_NN,
+
+    // run a module's script, the first time it is imported
+    OP_IMPORT,
+
+    // a prefix that widens the operand of the next instruction: a one byte
+    // index or count becomes three bytes, and a two byte jump offset four
+    OP_WIDE,
 } OpCode;
 
+// The number of values a wide index or count operand can address.
+#define WIDE_OPERAND_COUNT (1 << 24)
+
+// A run of code that comes from the same source line: the code from offset
+// up to the offset of the next run.
+typedef struct {
+    uint32_t offset;
+    int line;
+} LineRun;
+
+// A run of code inlined from the body of another function: the code from start
+// up to end comes from line of the function named name. The name is kept alive
+// by the function's constant, which the inlined call checks against.
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    int line;
+    ObjString* name;
+} InlineRun;
+
 // A module is a collection of instructions.
 // The VM will execute these instructions in order.
 typedef struct {
@@ -81,19 +137,23 @@ typedef struct {
     // The array of instructions.
     uint8_t* code;
     // The line number of each instruction for debugging. Note that this is
-    // not interleaved with each instruction because it would require a byte
-    // per instruction, which would take up extra cache space and potentially
-    // result in more cache misses. Instead, the line number is stored in a
-    // separate array and only used when debugging.
-    // TODO: This could be optimized by using a run-length encoding scheme.
-    //  Compress this data by using the aforementioned scheme.
-    int* lines;
-    // The array of values in the module.
-    // TODO: Add support for a LONG_CONSTANT instruction. The current implementation
-    //  only supports 256 constants, which is not enough for a real program. However,
-    //  most modules will not use more than 256 constants, so supporting both 8-bit addressed
-    //  and 24-bit addressed constants will result in greater locality and thus greater performance
-    //  in the typical scenario.
+    // not interleaved with each instruction because it would take up extra
+    // cache space and potentially result in more cache misses. Instead, the
+    // line numbers are stored in a separate table that is only used when
+    // debugging. The table is run-length encoded: a run starts wherever the
+    // line changes, so it holds one entry per line of source rather than one
+    // per byte of code.
+    LineRun* lines;
+    int line_count;
+    int line_capacity;
+    // The runs of inlined code, in order, so that a runtime error inside one
+    // is reported in the function it was inlined from.
+    InlineRun* inlines;
+    int inline_count;
+    int inline_capacity;
+    // The array of values in the module. The first 256 are addressed by a
+    // single byte, the rest by the three byte operand of an OP_WIDE instruction,
+    // so the common case keeps the compact encoding.
     ValueArray constants;
 } Module;
 
@@ -103,6 +163,20 @@ void initialize_module(Module* module);
 // Write a byte to the end of a module.
 void write_module(Module* module, uint8_t byte, int line);
 
+// Record that the code from offset on comes from line. Offsets must be
+// marked in increasing order.
+void mark_line(Module* module, uint32_t offset, int line);
+
+// Get the line of the instruction at offset, by binary search over the runs.
+int get_line(Module* module, uint32_t offset);
+
+// Record that the code from start up to end was inlined from line of the
+// function named name. Runs must be marked in increasing order.
+void mark_inlined(Module* module, uint32_t start, uint32_t end, int line, ObjString* name);
+
+// Get the run of inlined code that holds the instruction at offset, or NULL.
+InlineRun* get_inlined(Module* module, uint32_t offset);
+
 // Add a constant value to a module.
 uint32_t add_constant(Module* module, Value value);
 
@@ -0,0 +1,46 @@
+#ifndef PROTOSLANG_NUMBER_H
+#define PROTOSLANG_NUMBER_H
+
+#include "common.h"
+
+// Conversions between numbers and their decimal text, used to print
+// numbers, to parse number literals and by the str() and num() natives.
+
+// The size of a buffer that holds any formatted number and its terminator.
+#define NUMBER_BUFFER_SIZE 32
+
+// Write the shortest text that parses back to the same number, the closest
+// to it if there are several, and return its length. Integers up to 1e21 are
+// written out in full, other numbers like 0.1 or 1.5e-7: fixed notation from
+// 1e-6 up to 1e21, scientific notation beyond.
+int format_number(double value, char *buffer);
+
+// Write an integer in full, and return its length.
+int format_integer(int64_t value, char *buffer);
+
+// Parse digits with an optional sign, fraction and exponent, such as
+// "-12.5e3", exactly. Returns false if the characters are not a number.
+bool parse_number(const char *chars, int length, double *value);
+
+// Parse digits with an optional sign and nothing else, such as "-12".
+// Returns false if the characters are not an integer or it does not fit in
+// 64 bits.
+bool parse_integer(const char *chars, int length, int64_t *value);
+
+// Whether a double holds an integer that fits in 64 bits, which is stored
+// in integer if so.
+bool number_to_integer(double value, int64_t *integer);
+
+// How an integer compares with a double. NaN is unordered with everything.
+typedef enum {
+    ORDER_LESS,
+    ORDER_EQUAL,
+    ORDER_GREATER,
+    ORDER_UNORDERED,
+} NumberOrder;
+
+// Compare an integer with a double exactly, without rounding the integer to
+// a double first: 2^53 + 1 is greater than the double 2^53.
+NumberOrder compare_integer_to_double(int64_t integer, double number);
+
+#endif //PROTOSLANG_NUMBER_H
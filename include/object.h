@@ -11,22 +11,34 @@
 #define IS_LIST(value) is_obj_type(value, OBJ_LIST)
 #define IS_RANGE(value) is_obj_type(value, OBJ_RANGE)
 #define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNCTION)
+#define IS_NATIVE(value) is_obj_type(value, OBJ_NATIVE)
+#define IS_ARRAY(value) is_obj_type(value, OBJ_ARRAY)
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 #define AS_LIST(value) ((ObjList*)AS_OBJ(value))
 #define AS_RANGE(value) ((ObjRange*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
+#define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
+#define AS_ARRAY(value) ((ObjArray*)AS_OBJ(value))
 
 typedef enum {
     OBJ_FUNCTION,
     OBJ_STRING,
     OBJ_LIST,
     OBJ_RANGE,
+    OBJ_NATIVE,
+    OBJ_ARRAY,
 } ObjType;
 
+// the number of object types, used to size per-type tables
+#define OBJ_TYPE_COUNT (OBJ_ARRAY + 1)
+
 struct Obj {
     ObjType type;
+    // the mark epoch this object was last reached in. an object is black or gray
+    // when this equals vm.mark_epoch during a collection, and white otherwise.
+    uint8_t mark;
     // pointer to the next object in the linked list.
     // this is used to keep track of all objects in the heap.
     struct Obj *next;
@@ -39,33 +51,80 @@ struct ObjString {
     uint32_t hash;
 };
 
-typedef struct {
+// A list either owns its items, or is a view of a slice of them. A view has
+// no capacity and points into the items of its base, a list that nothing
+// changes; the view copies its items before it is changed itself.
+typedef struct ObjList {
     Obj obj;
     int count;
     int capacity;
     Value* items;
+    struct ObjList *base;
 } ObjList;
 
 typedef struct {
     Obj obj;
-    double start; // Start of the range
-    double end; // End of the range
+    // The bounds are numbers, integers unless the range was built from a double.
+    Value start; // Start of the range
+    Value end; // End of the range
 } ObjRange;
 
 typedef struct {
     Obj obj;
     int arity;
+    // the most stack slots a call uses, the function and its arguments included
+    int max_slots;
     Module module;
     ObjString *name;
+    // the source of a function whose compilation is deferred until it is first
+    // called, from its parameter list to its closing brace. NULL once compiled.
+    char *source;
+    int source_length;
+    int source_line;
+    // the path of the script the function was declared in, named in the
+    // errors compiling it reports, or NULL
+    const char *path;
 } ObjFunction;
 
+// a function implemented in C. it receives its arguments as a slice of the stack.
+typedef Value (*NativeFn)(int arg_count, Value *args);
+
+typedef struct {
+    Obj obj;
+    NativeFn function;
+} ObjNative;
+
+typedef enum {
+    ARRAY_DOUBLE,
+    ARRAY_INT,
+} ArrayKind;
+
+// A fixed number of numbers stored unboxed and packed, eight bytes each: all
+// doubles or all integers, as the kind says. Arrays are indexed like lists,
+// and the natives in array.c run vectorized loops over them.
+typedef struct {
+    Obj obj;
+    ArrayKind kind;
+    int count;
+    union {
+        double *doubles;
+        int64_t *integers;
+    } as;
+} ObjArray;
+
 ObjFunction *new_function();
-ObjString *take_string(char *chars, int length);
+ObjNative *new_native(NativeFn function);
+ObjString *concatenate_strings(ObjString *a, ObjString *b);
 ObjString *copy_string(const char *chars, int length);
 void print_object(Value value);
 void print_list(ObjList* list);
 void print_range(ObjRange* range);
 void print_function(ObjFunction* function);
+void print_array(ObjArray *array);
+
+// the name of an object type, and the bytes an object and the buffers it owns occupy
+const char *obj_type_name(ObjType type);
+size_t object_size(Obj *object);
 
 // list operations
 ObjList *allocate_list();
@@ -74,9 +133,18 @@ void store_list(ObjList *list, int index, Value value);
 Value read_list(ObjList *list, int index);
 void delete_from_list(ObjList *list, int index);
 bool is_valid_index(ObjList *list, int index);
+// A view of the items of a list from start up to, not including, end. The
+// list keeps sharing its items with the view until either is changed.
+ObjList *slice_list(ObjList *list, int start, int end);
 
 // range operations
-ObjRange *allocate_range(double start, double end);
+ObjRange *allocate_range(Value start, Value end);
+
+// array operations. an array holds zeros when allocated. storing fails for a
+// value that is not a number, or not an integer in an array of integers.
+ObjArray *allocate_array(ArrayKind kind, int count);
+Value read_array(ObjArray *array, int index);
+bool store_array(ObjArray *array, int index, Value value);
 
 static inline bool is_obj_type(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
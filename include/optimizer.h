@@ -0,0 +1,12 @@
+#ifndef PROTOSLANG_OPTIMIZER_H
+#define PROTOSLANG_OPTIMIZER_H
+
+#include "ast.h"
+
+// Rewrite the tree of a script in place: fold constant expressions, replace
+// branches on constant conditions by the branch taken, and set apart the
+// statements that can never run, which are checked but not compiled. Strings
+// produced by folding are allocated in the arena.
+void optimize(Node *script, AstArena *arena);
+
+#endif //PROTOSLANG_OPTIMIZER_H
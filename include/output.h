@@ -0,0 +1,33 @@
+#ifndef PROTOSLANG_OUTPUT_H
+#define PROTOSLANG_OUTPUT_H
+
+#include "common.h"
+
+// What a script prints is gathered in a buffer owned by the VM, and written
+// to stdout with write(2) in large blocks: when the buffer fills up, before
+// a runtime error is reported, at the REPL prompt and on exit. When stdout
+// is a terminal, each line is written as soon as it ends instead.
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+    char chars[OUTPUT_BUFFER_SIZE];
+    size_t length;
+    bool line_buffered;
+} OutputBuffer;
+
+// Empty the VM's buffer, and make it line buffered if stdout is a terminal.
+void initialize_output();
+
+void write_output(const char *chars, size_t length);
+
+// Format into the buffer like printf().
+void print_output(const char *format, ...);
+
+// End a line, which is written right away in line buffered mode.
+void end_output_line();
+
+// Write whatever the buffer holds.
+void flush_output();
+
+#endif //PROTOSLANG_OUTPUT_H
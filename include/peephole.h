@@ -0,0 +1,25 @@
+#ifndef PROTOSLANG_PEEPHOLE_H
+#define PROTOSLANG_PEEPHOLE_H
+
+#include "module.h"
+
+// A jump whose distance did not fit its two byte operand when the compiler
+// patched it. The operand is left as a placeholder, and the jump is relaxed to
+// its wide form when the code is finished.
+typedef struct {
+    // the offset of the jump instruction, and of the instruction it lands on
+    uint32_t offset;
+    uint32_t target;
+} FarJump;
+
+// Lay out the code of a compiled function again. Jumps are relaxed: each one
+// takes its compact form unless its distance needs the wide one. When optimize
+// is set, jumps that land on other jumps are sent to the final target,
+// comparisons followed by OP_NOT are fused into the negated comparison and
+// runs of OP_POP become OP_POPN.
+//
+// Returns the most stack slots the code uses, counting the entry_depth slots
+// its frame starts out with.
+int finish_code(Module *module, FarJump *far_jumps, int far_jump_count, int entry_depth, bool optimize);
+
+#endif //PROTOSLANG_PEEPHOLE_H
@@ -0,0 +1,46 @@
+#ifndef PROTOSLANG_SNAPSHOT_H
+#define PROTOSLANG_SNAPSHOT_H
+
+#include "common.h"
+
+// A heap snapshot records every object in the heap, the references between
+// them, the roots, and for each object the retainer through which it was
+// first reached from the roots. All integers are unsigned LEB128 varints.
+//
+//   "SLHEAP1\n"
+//   object count
+//   for each object:
+//     type (one byte), size in bytes,
+//     retainer: 0 when unreachable, 1 when held by a root, or the index of the retaining object + 2,
+//     label length and bytes (function names and string contents, truncated),
+//     reference count, and the index of each referenced object
+//   root count
+//   for each root:
+//     kind (one byte, see SnapshotRootKind), object index,
+//     label length and bytes (the name of a global)
+//
+// Writing a snapshot is linear in the size of the heap, and nothing is done
+// on the allocation path to support it.
+
+typedef enum {
+    SNAPSHOT_ROOT_STACK,
+    SNAPSHOT_ROOT_FRAME,
+    SNAPSHOT_ROOT_GLOBAL,
+    SNAPSHOT_ROOT_REGISTER,
+    SNAPSHOT_ROOT_MODULE,
+} SnapshotRootKind;
+
+// Write a snapshot of the VM's heap to a file. Returns false on I/O errors.
+bool write_heap_snapshot(const char *path);
+
+// Request a snapshot from a signal handler. It is written at the next safepoint.
+void request_heap_snapshot();
+
+// Write the snapshot requested by a signal, if there is one.
+void write_requested_heap_snapshot();
+
+// Read a snapshot and print the heap by type and its largest dominators.
+// Returns false if the file cannot be read.
+bool summarize_heap_snapshot(const char *path);
+
+#endif //PROTOSLANG_SNAPSHOT_H
@@ -0,0 +1,30 @@
+#ifndef PROTOSLANG_SOURCE_H
+#define PROTOSLANG_SOURCE_H
+
+#include "common.h"
+
+// The source of a script, loaded from a file. Regular files are mapped
+// read-only rather than copied into a buffer, so a large script costs no
+// more than the page cache holds for it, and pages are only read in as the
+// lexer reaches them. Either way, the characters are followed by at least
+// one zero byte, which the lexer stops at.
+typedef struct {
+    const char *chars;
+    size_t length;
+    // the size of the mapping, 0 if the characters were read into a buffer
+    size_t mapping_size;
+} Source;
+
+typedef enum {
+    SOURCE_OK,
+    SOURCE_NOT_FOUND,
+    SOURCE_UNREADABLE,
+} SourceStatus;
+
+// Load the file at path. The file should not be truncated while it is
+// loaded, as the pages past its new end can no longer be read.
+SourceStatus load_source(const char *path, Source *source);
+
+void unload_source(Source *source);
+
+#endif //PROTOSLANG_SOURCE_H
@@ -26,4 +26,10 @@ bool table_get(Table *table, ObjString *key, Value *value);
 void table_add_all(Table *from, Table *to);
 ObjString *table_find_string(Table *table, const char *chars, int length, uint32_t hash);
 
+// used by the garbage collector to trace a table, and to drop the weakly
+// held keys of a table that were not reached. keys are dropped from count
+// entries starting at from, and the index after the last one is returned.
+void mark_table(Table *table);
+int table_remove_white(Table *table, int from, int count);
+
 #endif //PROTOSLANG_TABLE_H
@@ -16,6 +16,7 @@ typedef enum {
     TYPE_BOOL,
     TYPE_NIL,
     TYPE_NUMBER,
+    TYPE_INT,
     VAL_OBJ,
     VAL_ARRAY,
 } ValueType;
@@ -28,22 +29,31 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        int64_t integer;
         Obj *obj;
     } as;
 } Value;
 
 #define IS_BOOL(value) ((value).type == TYPE_BOOL)
 #define IS_NIL(value) ((value).type == TYPE_NIL)
-#define IS_NUMBER(value) ((value).type == TYPE_NUMBER)
+// Numbers are either integers or doubles. An integer stays one through
+// + - * and % as long as the result fits in 64 bits, and becomes a double
+// otherwise, or when it meets a double. AS_NUMBER reads either as a double.
+#define IS_INT(value) ((value).type == TYPE_INT)
+#define IS_DOUBLE(value) ((value).type == TYPE_NUMBER)
+#define IS_NUMBER(value) (IS_DOUBLE(value) || IS_INT(value))
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
+#define AS_DOUBLE(value) ((value).as.number)
+#define AS_NUMBER(value) (IS_INT(value) ? (double) AS_INT(value) : AS_DOUBLE(value))
 #define AS_OBJ(value) ((value).as.obj)
 
 #define BOOL_VAL(value) ((Value){TYPE_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){TYPE_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){TYPE_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value){TYPE_INT, {.integer = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 #define ARRAY_VAL(array) ((Value){VAL_ARRAY, {.array = array}})
 
@@ -1,18 +1,35 @@
 // TODO: Break this file up into smaller files
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "lexer.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The scans over runs of whitespace, comments, identifiers and strings read
+// the source 16 bytes at a time where SSE2 is available. The loads are from
+// aligned blocks, which may extend past the terminator of the source, but
+// never into another page: the sanitizer is told not to look.
+#if defined(__GNUC__)
+#define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#define NO_SANITIZE_ADDRESS
+#endif
+
 typedef struct {
     const char *start;
     const char *current;
     int line;
 } Lexer;
 
-Lexer lexer;
+// each compile thread lexes a script of its own
+_Thread_local Lexer lexer;
 
 void initialize_lexer(const char *source) {
     // Set the start and current pointers to the beginning of the source
@@ -21,6 +38,11 @@ void initialize_lexer(const char *source) {
     lexer.line = 1;
 }
 
+void initialize_lexer_at(const char *source, int line) {
+    initialize_lexer(source);
+    lexer.line = line;
+}
+
 static bool is_alpha(char c) {
     // TODO: perhaps this function would be better named is_valid_identifier
     return (c >= 'a' && c <= 'z') ||
@@ -77,6 +99,112 @@ static Token error_token(const char *message) {
     return token;
 }
 
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+#ifdef __SSE2__
+
+// The bytes of the aligned block at p that equal c, as a bit mask.
+#define BYTES_EQUAL(bytes, c) ((unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c))))
+
+// The bytes of the aligned block at p that lie in the range [low, high], as a
+// bit mask. Bytes above 0x7f compare as negative, so they are never in range.
+#define BYTES_IN(bytes, low, high) \
+    ((unsigned) _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8((char) ((low) - 1))), \
+                                                _mm_cmplt_epi8(bytes, _mm_set1_epi8((char) ((high) + 1))))))
+
+// The aligned block that holds p, and the bits of the bytes in it before p.
+#define BLOCK_OF(p) ((const char *) ((uintptr_t) (p) & ~(uintptr_t) 15))
+#define BYTES_BEFORE(p) ((1u << ((uintptr_t) (p) & 15)) - 1)
+
+// Skip a run of whitespace, counting the newlines in it.
+NO_SANITIZE_ADDRESS static const char *skip_blanks(const char *p, int *line) {
+    const char *block = BLOCK_OF(p);
+    unsigned before = BYTES_BEFORE(p);
+    for (;; block += 16, before = 0) {
+        __m128i bytes = _mm_load_si128((const __m128i *) block);
+        unsigned newlines = BYTES_EQUAL(bytes, '\n') & ~before;
+        unsigned stops = ~(BYTES_EQUAL(bytes, ' ') | BYTES_EQUAL(bytes, '\t') | BYTES_EQUAL(bytes, '\r') |
+                           newlines | before) & 0xffff;
+        if (stops != 0) {
+            int end = __builtin_ctz(stops);
+            *line += __builtin_popcount(newlines & ((1u << end) - 1));
+            return block + end;
+        }
+        *line += __builtin_popcount(newlines);
+    }
+}
+
+// Find the end of a comment, the newline or terminator after it.
+NO_SANITIZE_ADDRESS static const char *skip_comment(const char *p) {
+    const char *block = BLOCK_OF(p);
+    unsigned before = BYTES_BEFORE(p);
+    for (;; block += 16, before = 0) {
+        __m128i bytes = _mm_load_si128((const __m128i *) block);
+        unsigned stops = (BYTES_EQUAL(bytes, '\n') | BYTES_EQUAL(bytes, '\0')) & ~before;
+        if (stops != 0) return block + __builtin_ctz(stops);
+    }
+}
+
+// Skip the letters, digits and underscores of an identifier.
+NO_SANITIZE_ADDRESS static const char *skip_identifier(const char *p) {
+    const char *block = BLOCK_OF(p);
+    unsigned before = BYTES_BEFORE(p);
+    for (;; block += 16, before = 0) {
+        __m128i bytes = _mm_load_si128((const __m128i *) block);
+        // setting bit 5 maps upper case letters to lower case ones
+        unsigned letters = BYTES_IN(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), 'a', 'z');
+        unsigned stops = ~(letters | BYTES_IN(bytes, '0', '9') | BYTES_EQUAL(bytes, '_') | before) & 0xffff;
+        if (stops != 0) return block + __builtin_ctz(stops);
+    }
+}
+
+// Find the closing quote of a string, or the terminator, counting the newlines before it.
+NO_SANITIZE_ADDRESS static const char *skip_string(const char *p, int *line) {
+    const char *block = BLOCK_OF(p);
+    unsigned before = BYTES_BEFORE(p);
+    for (;; block += 16, before = 0) {
+        __m128i bytes = _mm_load_si128((const __m128i *) block);
+        unsigned newlines = BYTES_EQUAL(bytes, '\n') & ~before;
+        unsigned stops = (BYTES_EQUAL(bytes, '"') | BYTES_EQUAL(bytes, '\0')) & ~before;
+        if (stops != 0) {
+            int end = __builtin_ctz(stops);
+            *line += __builtin_popcount(newlines & ((1u << end) - 1));
+            return block + end;
+        }
+        *line += __builtin_popcount(newlines);
+    }
+}
+
+#else
+
+static const char *skip_blanks(const char *p, int *line) {
+    for (; is_blank(*p); p++) {
+        if (*p == '\n') (*line)++;
+    }
+    return p;
+}
+
+static const char *skip_comment(const char *p) {
+    while (*p != '\n' && *p != '\0') p++;
+    return p;
+}
+
+static const char *skip_identifier(const char *p) {
+    while (is_alpha(*p) || is_digit(*p)) p++;
+    return p;
+}
+
+static const char *skip_string(const char *p, int *line) {
+    for (; *p != '"' && *p != '\0'; p++) {
+        if (*p == '\n') (*line)++;
+    }
+    return p;
+}
+
+#endif
+
 static void skip_whitespace() {
     for (;;) {
         char c = *lexer.current;
@@ -84,16 +212,18 @@ static void skip_whitespace() {
             case ' ':
             case '\r':
             case '\t':
-                advance();
-                break;
             case '\n':
-                lexer.line++;
-                advance();
+                // most runs are a single space between two tokens
+                if (c == ' ' && !is_blank(lexer.current[1])) {
+                    advance();
+                } else {
+                    lexer.current = skip_blanks(lexer.current, &lexer.line);
+                }
                 break;
             case '/':
                 if (peek_next() == '/') {
                     // a comment goes until the end of the line
-                    while (peek() != '\n' && !is_at_end()) advance();
+                    lexer.current = skip_comment(lexer.current);
                 } else {
                     return;
                 }
@@ -104,79 +234,49 @@ static void skip_whitespace() {
     }
 }
 
-static TokenType check_keyword(
-        int start,
-        int length,
-        const char *rest,
-        TokenType type
-) {
-    if (lexer.current - lexer.start == start + length &&
-        memcmp(lexer.start + start, rest, length) == 0) {
-        return type;
-    }
+// Keywords are found by a perfect hash of the first two and the last
+// characters of an identifier: the multipliers are picked so that no two
+// keywords share a slot, and a new keyword needs them picked again.
+#define KEYWORD_SLOTS 32
+#define KEYWORD_HASH(first, second, last) \
+    (((unsigned) (unsigned char) (first) * 3 + (unsigned) (unsigned char) (second) * 12 + \
+      (unsigned) (unsigned char) (last)) & (KEYWORD_SLOTS - 1))
 
-    return TK_IDENTIFIER;
-}
+typedef struct {
+    const char *name;
+    int length;
+    TokenType type;
+} Keyword;
+
+static const Keyword keywords[KEYWORD_SLOTS] = {
+    [0] = {"return", 6, TK_RETURN},
+    [3] = {"false", 5, TK_FALSE},
+    [4] = {"else", 4, TK_ELSE},
+    [7] = {"super", 5, TK_SUPER},
+    [8] = {"fn", 2, TK_FN},
+    [9] = {"if", 2, TK_IF},
+    [10] = {"while", 5, TK_WHILE},
+    [11] = {"import", 6, TK_IMPORT},
+    [12] = {"class", 5, TK_CLASS},
+    [15] = {"and", 3, TK_AND},
+    [17] = {"in", 2, TK_IN},
+    [18] = {"null", 4, TK_NIL},
+    [20] = {"let", 3, TK_LET},
+    [22] = {"println", 7, TK_PRINTLN},
+    [23] = {"or", 2, TK_OR},
+    [24] = {"for", 3, TK_FOR},
+    [25] = {"true", 4, TK_TRUE},
+    [27] = {"self", 4, TK_SELF},
+};
 
 static TokenType identifier_type() {
-    // This is a bit unorthodox in manner of appearance, bit it's a simple DFA
-    // that determines the type of identifier present.
-
-    // check if the identifier is a keyword
-    switch (lexer.start[0]) {
-        case 'a':
-            return check_keyword(1, 2, "nd", TK_AND);
-        case 'c':
-            return check_keyword(1, 4, "lass", TK_CLASS);
-        case 'e':
-            return check_keyword(1, 3, "lse", TK_ELSE);
-        case 'f':
-            if (lexer.current - lexer.start > 1) {
-                switch (lexer.start[1]) {
-                    case 'n':
-                        return TK_FN;
-                    case 'o':
-                        return check_keyword(2, 1, "r", TK_FOR);
-                    case 'a':
-                        return check_keyword(2, 3, "lse", TK_FALSE);
-                }
-            }
-            break;
-        case 'i': {
-            if (lexer.current - lexer.start > 1) {
-                switch (lexer.start[1]) {
-                    case 'f':
-                        return TK_IF;
-                    case 'n':
-                        return TK_IN;
-                }
-            }
-        }
-        case 'l':
-            return check_keyword(1, 2, "et", TK_LET);
-        case 'n':
-            return check_keyword(1, 3, "ull", TK_NIL);
-        case 'o':
-            return check_keyword(1, 1, "r", TK_OR);
-        case 'p':
-            return check_keyword(1, 6, "rintln", TK_PRINTLN);
-        case 'r':
-            return check_keyword(1, 5, "eturn", TK_RETURN);
-        case 's':
-            if (lexer.current - lexer.start > 1) {
-                switch (lexer.start[1]) {
-                    case 'e':
-                        return check_keyword(2, 2, "lf", TK_SELF);
-                    case 'u':
-                        return check_keyword(2, 3, "per", TK_SUPER);
-//                    case 't': return check_keyword(2, 4, "ring", TK_TYPE_STRING);
-                }
-            }
-            break;
-        case 't':
-            return check_keyword(1, 3, "rue", TK_TRUE);
-        case 'w':
-            return check_keyword(1, 4, "hile", TK_WHILE);
+    int length = (int) (lexer.current - lexer.start);
+    if (length < 2) return TK_IDENTIFIER;
+
+    // empty slots have length 0, which no identifier of two or more characters matches
+    const Keyword *keyword = &keywords[KEYWORD_HASH(lexer.start[0], lexer.start[1], lexer.start[length - 1])];
+    if (keyword->length == length && memcmp(lexer.start, keyword->name, length) == 0) {
+        return keyword->type;
     }
 
     return TK_IDENTIFIER;
@@ -186,7 +286,7 @@ static Token identifier() {
     // lex an identifier from the source code,
     // and return a token representing the identifier.
 
-    while (is_alpha(peek()) || is_digit(peek())) advance();
+    lexer.current = skip_identifier(lexer.current);
 
     return make_token(identifier_type());
 }
@@ -210,10 +310,7 @@ static Token number() {
 }
 
 static Token string() {
-    while (peek() != '"' && !is_at_end()) {
-        if (peek() == '\n') lexer.line++;
-        advance();
-    }
+    lexer.current = skip_string(lexer.current, &lexer.line);
 
     if (is_at_end()) return error_token("Unterminated string.");
 
@@ -313,4 +410,72 @@ Token lex_token() {
     }
 
     return error_token("Unexpected character.");
-}
\ No newline at end of file
+}
+
+void initialize_token_buffer(TokenBuffer *buffer) {
+    buffer->source = NULL;
+    buffer->types = NULL;
+    buffer->offsets = NULL;
+    buffer->lengths = NULL;
+    buffer->lines = NULL;
+    buffer->count = 0;
+    buffer->capacity = 0;
+    buffer->errors = NULL;
+    buffer->error_count = 0;
+}
+
+// The buffer is filled on compile threads, so it lives off the VM heap.
+static void *grow(void *array, size_t size) {
+    void *result = realloc(array, size);
+    if (result == NULL) exit(1);
+    return result;
+}
+
+static void reserve_tokens(TokenBuffer *buffer, int capacity) {
+    buffer->types = (uint8_t*)grow(buffer->types, sizeof(uint8_t) * capacity);
+    buffer->offsets = (uint32_t*)grow(buffer->offsets, sizeof(uint32_t) * capacity);
+    buffer->lengths = (uint32_t*)grow(buffer->lengths, sizeof(uint32_t) * capacity);
+    buffer->lines = (int*)grow(buffer->lines, sizeof(int) * capacity);
+    buffer->capacity = capacity;
+}
+
+void lex_tokens(TokenBuffer *buffer, const char *source, int line) {
+    initialize_lexer_at(source, line);
+    buffer->source = source;
+    buffer->count = 0;
+    buffer->error_count = 0;
+
+    // scripts average a token every three to four bytes. the arrays are
+    // sized for the denser end, so they are rarely grown while lexing: the
+    // part of a large allocation that is never written is never paged in.
+    size_t estimate = strlen(source) / 3 + 16;
+    if (estimate > (size_t) buffer->capacity) reserve_tokens(buffer, estimate < INT32_MAX / 2 ? (int) estimate : INT32_MAX / 2);
+
+    for (;;) {
+        Token token = lex_token();
+        if (buffer->count == buffer->capacity) reserve_tokens(buffer, buffer->capacity * 2);
+
+        int index = buffer->count++;
+        buffer->types[index] = (uint8_t) token.type;
+        buffer->lengths[index] = (uint32_t) token.length;
+        buffer->lines[index] = token.line;
+        if (token.type == TK_ERROR) {
+            buffer->errors = (const char**)grow(buffer->errors, sizeof(const char*) * (buffer->error_count + 1));
+            buffer->errors[buffer->error_count] = token.start;
+            buffer->offsets[index] = (uint32_t) buffer->error_count++;
+        } else {
+            buffer->offsets[index] = (uint32_t) (token.start - source);
+        }
+
+        if (token.type == TK_EOF) return;
+    }
+}
+
+void free_token_buffer(TokenBuffer *buffer) {
+    free(buffer->types);
+    free(buffer->offsets);
+    free(buffer->lengths);
+    free(buffer->lines);
+    free(buffer->errors);
+    initialize_token_buffer(buffer);
+}
@@ -1,6 +1,8 @@
 #ifndef PROTOSLANG_LEXER_H
 #define PROTOSLANG_LEXER_H
 
+#include <stdint.h>
+
 typedef enum {
     // 1-char tokens
     TK_LPAREN, TK_RPAREN,
@@ -34,6 +36,7 @@ typedef enum {
     TK_FN, TK_FOR, TK_IF, TK_NIL, TK_OR,
     TK_PRINTLN, TK_RETURN, TK_SUPER, TK_SELF,
     TK_TRUE, TK_LET, TK_WHILE, TK_IN,
+    TK_IMPORT,
 
     // error and end of file
     TK_ERROR, TK_EOF
@@ -56,7 +59,49 @@ typedef struct {
 // initialize the lexer with the source code
 void initialize_lexer(const char* source);
 
+// initialize the lexer with a piece of source code that starts on the given line
+void initialize_lexer_at(const char* source, int line);
+
 // scan the next token from the source code and return a Token object
 Token lex_token();
 
+// The tokens of a whole piece of source, lexed up front and stored as
+// parallel arrays: a parser walks through them by index, and can go back to
+// an earlier token without lexing again.
+typedef struct {
+    // the source the offsets are relative to
+    const char *source;
+
+    uint8_t *types;
+    uint32_t *offsets;
+    uint32_t *lengths;
+    int *lines;
+    int count;
+    int capacity;
+
+    // the messages of error tokens, whose offset is an index in this array
+    // rather than in the source
+    const char **errors;
+    int error_count;
+} TokenBuffer;
+
+void initialize_token_buffer(TokenBuffer *buffer);
+
+// lex a piece of source code that starts on the given line into the buffer,
+// up to and including its TK_EOF token
+void lex_tokens(TokenBuffer *buffer, const char *source, int line);
+
+void free_token_buffer(TokenBuffer *buffer);
+
+// the token at an index of the buffer
+static inline Token buffered_token(const TokenBuffer *buffer, int index) {
+    Token token;
+    token.type = (TokenType) buffer->types[index];
+    token.start = token.type == TK_ERROR ? buffer->errors[buffer->offsets[index]]
+                                         : buffer->source + buffer->offsets[index];
+    token.length = (int) buffer->lengths[index];
+    token.line = buffer->lines[index];
+    return token;
+}
+
 #endif //PROTOSLANG_LEXER_H
@@ -0,0 +1,317 @@
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+// Size classes are multiples of 16 up to 128 bytes, then four classes per
+// doubling up to ARENA_MAX_BLOCK. Every class is a multiple of 16, so blocks
+// are aligned as malloc() would align them.
+#define SIZE_CLASS_COUNT 24
+#define NO_SIZE_CLASS 0xff
+
+// The number of empty pages kept resident after a sweep, so that a steady
+// allocation rate does not fault the same pages in and out every cycle.
+#define ARENA_RETAINED_PAGES 16
+
+// The most pages returned to the OS in one call of arena_release_queued_pages().
+#define ARENA_RELEASE_BATCH 8
+
+// The bookkeeping of one page. Page tables live in the first page of their
+// arena, so a page table entry is found from a block by masking its address.
+typedef struct PageInfo {
+    // the next page in a size class's list of pages with room, or in the free page list
+    struct PageInfo *next;
+    // freed blocks of the page, linked through their first word
+    void *free_list;
+    // the number of allocated blocks
+    uint32_t live;
+    // the offset of the part of the page that has never been handed out
+    uint32_t bump;
+    // the size class of the page, NO_SIZE_CLASS while it is free
+    uint8_t size_class;
+    // whether the page is on its size class's list
+    bool listed;
+    // whether the page has been given back to the OS (or never touched)
+    bool released;
+    // whether the page is queued to be given back, and on no list meanwhile
+    bool queued;
+} PageInfo;
+
+typedef struct Arena {
+    struct Arena *next;
+    PageInfo pages[ARENA_PAGES];
+} Arena;
+
+_Static_assert(sizeof(Arena) <= ARENA_PAGE_SIZE, "an arena's page table must fit in its first page");
+
+static struct {
+    Arena *arenas;
+    size_t arena_count;
+    // for each size class, the pages that may have room
+    PageInfo *classes[SIZE_CLASS_COUNT];
+    // the pages not assigned to a size class
+    PageInfo *free_pages;
+    // the pages queued to be given back to the OS, linked through next in
+    // address order, so that neighbours are released in a single call
+    PageInfo *queued_pages;
+    bool huge_pages;
+    size_t resident_pages;
+    size_t peak_resident_pages;
+    size_t released_pages;
+} heap;
+
+static int size_class(size_t size) {
+    if (size <= 128) return (int) ((size + 15) / 16) - 1;
+
+    int shift = 63 - __builtin_clzll((unsigned long long) (size - 1));
+    return 8 + (shift - 7) * 4 + (int) (((size - 1) >> (shift - 2)) & 3);
+}
+
+static size_t class_size(int class) {
+    if (class < 8) return (size_t) (class + 1) * 16;
+
+    size_t base = (size_t) 128 << ((class - 8) / 4);
+    return base + (size_t) ((class - 8) % 4 + 1) * (base / 4);
+}
+
+static Arena *arena_of(const void *address) {
+    return (Arena*) ((uintptr_t) address & ~((uintptr_t) ARENA_SIZE - 1));
+}
+
+static PageInfo *page_of(const void *block) {
+    Arena *arena = arena_of(block);
+    return &arena->pages[((uintptr_t) block - (uintptr_t) arena) / ARENA_PAGE_SIZE];
+}
+
+static char *page_address(PageInfo *page) {
+    Arena *arena = arena_of(page);
+    return (char*) arena + (size_t) (page - arena->pages) * ARENA_PAGE_SIZE;
+}
+
+// Reserve a new arena aligned to its size. Its pages are only backed by
+// memory once they are first written.
+static Arena *map_arena() {
+    size_t length = 2 * (size_t) ARENA_SIZE;
+    char *mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) return NULL;
+
+    // trim the mapping down to an aligned arena
+    char *start = (char*) (((uintptr_t) mapping + ARENA_SIZE - 1) & ~((uintptr_t) ARENA_SIZE - 1));
+    if (start > mapping) munmap(mapping, (size_t) (start - mapping));
+    char *end = start + ARENA_SIZE;
+    if (end < mapping + length) munmap(end, (size_t) (mapping + length - end));
+
+#ifdef MADV_HUGEPAGE
+    if (heap.huge_pages) madvise(start, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+
+    Arena *arena = (Arena*) start;
+    arena->next = heap.arenas;
+    heap.arenas = arena;
+    heap.arena_count++;
+
+    // the first page is the page table itself, hand out the rest lowest first
+    for (int i = ARENA_PAGES - 1; i > 0; i--) {
+        PageInfo *page = &arena->pages[i];
+        page->size_class = NO_SIZE_CLASS;
+        page->released = true;
+        page->next = heap.free_pages;
+        heap.free_pages = page;
+    }
+
+    heap.resident_pages++;
+    if (heap.resident_pages > heap.peak_resident_pages) heap.peak_resident_pages = heap.resident_pages;
+    return arena;
+}
+
+static PageInfo *take_free_page() {
+    if (heap.free_pages == NULL && map_arena() == NULL) return NULL;
+
+    PageInfo *page = heap.free_pages;
+    heap.free_pages = page->next;
+
+    if (page->released) {
+        page->released = false;
+        heap.resident_pages++;
+        if (heap.resident_pages > heap.peak_resident_pages) heap.peak_resident_pages = heap.resident_pages;
+    }
+    return page;
+}
+
+void *arena_allocate(size_t size) {
+    int class = size_class(size);
+    size_t block_size = class_size(class);
+
+    PageInfo *page = heap.classes[class];
+    while (page != NULL) {
+        if (page->free_list != NULL) {
+            void *block = page->free_list;
+            page->free_list = *(void**) block;
+            page->live++;
+            return block;
+        }
+
+        if (page->bump + block_size <= ARENA_PAGE_SIZE) {
+            void *block = page_address(page) + page->bump;
+            page->bump += (uint32_t) block_size;
+            page->live++;
+            return block;
+        }
+
+        // the page is full, it is listed again once one of its blocks is freed
+        page->listed = false;
+        heap.classes[class] = page->next;
+        page = page->next;
+    }
+
+    page = take_free_page();
+    if (page == NULL) return NULL;
+
+    page->size_class = (uint8_t) class;
+    page->free_list = NULL;
+    page->bump = (uint32_t) block_size;
+    page->live = 1;
+    page->listed = true;
+    page->next = NULL;
+    heap.classes[class] = page;
+    return page_address(page);
+}
+
+void arena_free(void *block, size_t size) {
+    (void) size;
+    if (block == NULL) return;
+
+    PageInfo *page = page_of(block);
+    *(void**) block = page->free_list;
+    page->free_list = block;
+    page->live--;
+
+    if (!page->listed) {
+        page->listed = true;
+        page->next = heap.classes[page->size_class];
+        heap.classes[page->size_class] = page;
+    }
+}
+
+void arena_free_concurrent(void *block, size_t size) {
+    (void) size;
+    if (block == NULL) return;
+
+    // workers only push, so there is no ABA problem. the page is relisted
+    // when the sweep is done, by arena_release_empty_pages().
+    PageInfo *page = page_of(block);
+    void *head = __atomic_load_n(&page->free_list, __ATOMIC_RELAXED);
+    do {
+        *(void**) block = head;
+    } while (!__atomic_compare_exchange_n(&page->free_list, &head, block, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_fetch_sub(&page->live, 1, __ATOMIC_RELAXED);
+}
+
+bool arena_same_class(size_t a, size_t b) {
+    return size_class(a) == size_class(b);
+}
+
+void arena_release_empty_pages() {
+    for (int class = 0; class < SIZE_CLASS_COUNT; class++) heap.classes[class] = NULL;
+    heap.free_pages = NULL;
+
+    // count the resident pages without live blocks, all but a few are released.
+    // pages still queued from the last sweep stay queued.
+    size_t empty = 0;
+    for (Arena *arena = heap.arenas; arena != NULL; arena = arena->next) {
+        for (int i = 1; i < ARENA_PAGES; i++) {
+            PageInfo *page = &arena->pages[i];
+            if (!page->released && !page->queued && page->live == 0) empty++;
+        }
+    }
+    size_t excess = empty > ARENA_RETAINED_PAGES ? empty - ARENA_RETAINED_PAGES : 0;
+
+    // walk the pages from the top down so that the highest empty pages are the
+    // ones released, and every list ends up lowest address first, which keeps
+    // the live heap packed at the bottom.
+    for (Arena *arena = heap.arenas; arena != NULL; arena = arena->next) {
+        for (int i = ARENA_PAGES - 1; i > 0; i--) {
+            PageInfo *page = &arena->pages[i];
+            page->listed = false;
+            if (page->queued) continue;
+
+            if (page->live == 0) {
+                page->size_class = NO_SIZE_CLASS;
+                page->free_list = NULL;
+                page->bump = 0;
+            }
+
+            if (!page->released && page->live == 0 && excess > 0) {
+                excess--;
+                page->queued = true;
+                page->next = heap.queued_pages;
+                heap.queued_pages = page;
+            } else if (page->size_class == NO_SIZE_CLASS) {
+                page->next = heap.free_pages;
+                heap.free_pages = page;
+            } else if (page->free_list != NULL || page->bump + class_size(page->size_class) <= ARENA_PAGE_SIZE) {
+                page->listed = true;
+                page->next = heap.classes[page->size_class];
+                heap.classes[page->size_class] = page;
+            }
+        }
+    }
+}
+
+bool arena_release_queued_pages() {
+    // adjacent queued pages are given back in a single call
+    PageInfo *first = heap.queued_pages;
+    if (first == NULL) return true;
+
+    PageInfo *last = first;
+    size_t count = 1;
+    while (count < ARENA_RELEASE_BATCH && last->next == last + 1) {
+        last = last->next;
+        count++;
+    }
+    heap.queued_pages = last->next;
+
+    madvise(page_address(first), count * ARENA_PAGE_SIZE, MADV_DONTNEED);
+    heap.resident_pages -= count;
+    heap.released_pages += count;
+
+    // the pages can be handed out again, faulted back in when first written
+    for (PageInfo *page = first, *next; count > 0; page = next, count--) {
+        next = page->next;
+        page->queued = false;
+        page->released = true;
+        page->next = heap.free_pages;
+        heap.free_pages = page;
+    }
+
+    return heap.queued_pages == NULL;
+}
+
+void arena_use_huge_pages(bool enabled) {
+    heap.huge_pages = enabled;
+}
+
+ArenaStats arena_stats() {
+    ArenaStats stats;
+    stats.reserved_bytes = heap.arena_count * (size_t) ARENA_SIZE;
+    stats.resident_pages = heap.resident_pages;
+    stats.peak_resident_pages = heap.peak_resident_pages;
+    stats.released_pages = heap.released_pages;
+    return stats;
+}
+
+void free_arenas() {
+    Arena *arena = heap.arenas;
+    while (arena != NULL) {
+        Arena *next = arena->next;
+        munmap(arena, ARENA_SIZE);
+        arena = next;
+    }
+
+    heap.arenas = NULL;
+    heap.arena_count = 0;
+    heap.free_pages = NULL;
+    heap.queued_pages = NULL;
+    for (int class = 0; class < SIZE_CLASS_COUNT; class++) heap.classes[class] = NULL;
+    heap.resident_pages = 0;
+}
@@ -0,0 +1,195 @@
+#include <limits.h>
+#include <math.h>
+
+#include "array.h"
+#include "kernels.h"
+#include "number.h"
+#include "object.h"
+
+// The length an array is made with: an integer, or a double that holds one,
+// that fits in an int.
+static bool array_length(Value value, int *length) {
+    int64_t integer;
+    if (IS_INT(value)) {
+        integer = AS_INT(value);
+    } else if (!IS_DOUBLE(value) || !number_to_integer(AS_DOUBLE(value), &integer)) {
+        return false;
+    }
+
+    if (integer < 0 || integer > INT_MAX) return false;
+    *length = (int) integer;
+    return true;
+}
+
+static Value make_array(ArrayKind kind, int arg_count, Value *args) {
+    if (arg_count != 1) return NIL_VAL;
+
+    int length;
+    if (array_length(args[0], &length)) return OBJ_VAL(allocate_array(kind, length));
+    if (!IS_LIST(args[0])) return NIL_VAL;
+
+    // every item is checked before the array is allocated, the list stays
+    // reachable through the arguments meanwhile
+    ObjList *list = AS_LIST(args[0]);
+    for (int i = 0; i < list->count; i++) {
+        Value item = list->items[i];
+        int64_t integer;
+        if (!IS_NUMBER(item)) return NIL_VAL;
+        if (kind == ARRAY_INT && IS_DOUBLE(item) && !number_to_integer(AS_DOUBLE(item), &integer)) return NIL_VAL;
+    }
+
+    ObjArray *array = allocate_array(kind, list->count);
+    for (int i = 0; i < list->count; i++) store_array(array, i, list->items[i]);
+    return OBJ_VAL(array);
+}
+
+Value array_native(int arg_count, Value *args) {
+    return make_array(ARRAY_DOUBLE, arg_count, args);
+}
+
+Value int_array_native(int arg_count, Value *args) {
+    return make_array(ARRAY_INT, arg_count, args);
+}
+
+// Whether the arguments are arrays, the first count of them, and the values
+// that follow are numbers.
+static bool array_arguments(int arg_count, Value *args, int arrays, int numbers) {
+    if (arg_count != arrays + numbers) return false;
+    for (int i = 0; i < arrays; i++) {
+        if (!IS_ARRAY(args[i])) return false;
+    }
+    for (int i = arrays; i < arg_count; i++) {
+        if (!IS_NUMBER(args[i])) return false;
+    }
+    return true;
+}
+
+// Whether the arguments are arrays of doubles of the same length, followed
+// by numbers.
+static bool double_arguments(int arg_count, Value *args, int arrays, int numbers) {
+    if (!array_arguments(arg_count, args, arrays, numbers)) return false;
+    for (int i = 0; i < arrays; i++) {
+        if (AS_ARRAY(args[i])->kind != ARRAY_DOUBLE || AS_ARRAY(args[i])->count != AS_ARRAY(args[0])->count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Integers are summed as a loop over them would: exactly, until the sum no
+// longer fits in 64 bits, and as a double from there on.
+static Value sum_integers(ObjArray *array) {
+    int64_t sum = 0;
+    for (int i = 0; i < array->count; i++) {
+        int64_t next;
+        if (__builtin_add_overflow(sum, array->as.integers[i], &next)) {
+            double total = (double) sum;
+            for (; i < array->count; i++) total += (double) array->as.integers[i];
+            return NUMBER_VAL(total);
+        }
+        sum = next;
+    }
+    return INT_VAL(sum);
+}
+
+Value sum_native(int arg_count, Value *args) {
+    if (!array_arguments(arg_count, args, 1, 0)) return NIL_VAL;
+
+    ObjArray *array = AS_ARRAY(args[0]);
+    if (array->kind == ARRAY_INT) return sum_integers(array);
+    return NUMBER_VAL(kernels.sum(array->as.doubles, (size_t) array->count));
+}
+
+Value min_native(int arg_count, Value *args) {
+    if (!array_arguments(arg_count, args, 1, 0) || AS_ARRAY(args[0])->count == 0) return NIL_VAL;
+
+    ObjArray *array = AS_ARRAY(args[0]);
+    if (array->kind == ARRAY_DOUBLE) return NUMBER_VAL(kernels.min(array->as.doubles, (size_t) array->count));
+
+    int64_t least = array->as.integers[0];
+    for (int i = 1; i < array->count; i++) {
+        if (array->as.integers[i] < least) least = array->as.integers[i];
+    }
+    return INT_VAL(least);
+}
+
+Value max_native(int arg_count, Value *args) {
+    if (!array_arguments(arg_count, args, 1, 0) || AS_ARRAY(args[0])->count == 0) return NIL_VAL;
+
+    ObjArray *array = AS_ARRAY(args[0]);
+    if (array->kind == ARRAY_DOUBLE) return NUMBER_VAL(kernels.max(array->as.doubles, (size_t) array->count));
+
+    int64_t greatest = array->as.integers[0];
+    for (int i = 1; i < array->count; i++) {
+        if (array->as.integers[i] > greatest) greatest = array->as.integers[i];
+    }
+    return INT_VAL(greatest);
+}
+
+Value dot_native(int arg_count, Value *args) {
+    if (!double_arguments(arg_count, args, 2, 0)) return NIL_VAL;
+
+    ObjArray *a = AS_ARRAY(args[0]);
+    return NUMBER_VAL(kernels.dot(a->as.doubles, AS_ARRAY(args[1])->as.doubles, (size_t) a->count));
+}
+
+Value scale_native(int arg_count, Value *args) {
+    if (!double_arguments(arg_count, args, 1, 1)) return NIL_VAL;
+
+    ObjArray *array = AS_ARRAY(args[0]);
+    kernels.scale(array->as.doubles, (size_t) array->count, AS_NUMBER(args[1]));
+    return args[0];
+}
+
+Value add_native(int arg_count, Value *args) {
+    if (!double_arguments(arg_count, args, 2, 0)) return NIL_VAL;
+
+    ObjArray *a = AS_ARRAY(args[0]);
+    kernels.add(a->as.doubles, AS_ARRAY(args[1])->as.doubles, (size_t) a->count);
+    return args[0];
+}
+
+// The elements of an array of integers below, or above, a bound, compared
+// the way < and > compare an integer with a number.
+static int64_t count_integers(ObjArray *array, Value bound, bool below) {
+    int64_t count = 0;
+    for (int i = 0; i < array->count; i++) {
+        int64_t element = array->as.integers[i];
+        if (IS_INT(bound)) {
+            count += below ? element < AS_INT(bound) : element > AS_INT(bound);
+        } else {
+            count += compare_integer_to_double(element, AS_DOUBLE(bound)) == (below ? ORDER_LESS : ORDER_GREATER);
+        }
+    }
+    return count;
+}
+
+// The double the elements of an array of doubles are compared with in place
+// of a bound, so that an integer bound compares exactly. No double lies
+// between an integer and the double nearest to it, so only a bound rounded
+// towards the elements counted moves, to the next double.
+static double double_bound(Value bound, bool below) {
+    if (!IS_INT(bound)) return AS_DOUBLE(bound);
+
+    double rounded = (double) AS_INT(bound);
+    NumberOrder order = compare_integer_to_double(AS_INT(bound), rounded);
+    if (below && order == ORDER_GREATER) return nextafter(rounded, INFINITY);
+    if (!below && order == ORDER_LESS) return nextafter(rounded, -INFINITY);
+    return rounded;
+}
+
+Value count_less_native(int arg_count, Value *args) {
+    if (!array_arguments(arg_count, args, 1, 1)) return NIL_VAL;
+
+    ObjArray *array = AS_ARRAY(args[0]);
+    if (array->kind == ARRAY_INT) return INT_VAL(count_integers(array, args[1], true));
+    return INT_VAL((int64_t) kernels.count_less(array->as.doubles, (size_t) array->count, double_bound(args[1], true)));
+}
+
+Value count_greater_native(int arg_count, Value *args) {
+    if (!array_arguments(arg_count, args, 1, 1)) return NIL_VAL;
+
+    ObjArray *array = AS_ARRAY(args[0]);
+    if (array->kind == ARRAY_INT) return INT_VAL(count_integers(array, args[1], false));
+    return INT_VAL((int64_t) kernels.count_greater(array->as.doubles, (size_t) array->count, double_bound(args[1], false)));
+}
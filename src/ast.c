@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ast.h"
+#include "memory.h"
+
+// The size of a chunk, larger requests get a chunk of their own.
+#define AST_CHUNK_SIZE (64 * 1024)
+
+struct AstChunk {
+    AstChunk *next;
+    size_t size;
+    size_t used;
+    // 16 byte aligned, like the blocks handed out
+    _Alignas(16) char data[];
+};
+
+void initialize_ast_arena(AstArena *arena, bool unmanaged) {
+    arena->chunks = NULL;
+    arena->unmanaged = unmanaged;
+}
+
+void *ast_allocate(AstArena *arena, size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+
+    AstChunk *chunk = arena->chunks;
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        size_t capacity = size > AST_CHUNK_SIZE ? size : AST_CHUNK_SIZE;
+        // chunks come from the VM heap where possible, so that the heap limits cover compilation too
+        if (arena->unmanaged) {
+            chunk = (AstChunk*) malloc(sizeof(AstChunk) + capacity);
+            if (chunk == NULL) {
+                fprintf(stderr, "Out of memory allocating %zu bytes.\n", sizeof(AstChunk) + capacity);
+                exit(1);
+            }
+        } else {
+            chunk = (AstChunk*) ALLOCATE(char, sizeof(AstChunk) + capacity);
+        }
+        chunk->size = capacity;
+        chunk->used = 0;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+
+    void *block = chunk->data + chunk->used;
+    chunk->used += size;
+    memset(block, 0, size);
+    return block;
+}
+
+Node *new_node(AstArena *arena, NodeType type, Token token) {
+    Node *node = ast_allocate(arena, sizeof(Node));
+    node->type = type;
+    node->token = token;
+    return node;
+}
+
+void append_node(AstArena *arena, NodeList *list, Node *node) {
+    if (list->capacity < list->count + 1) {
+        // the old items are abandoned to the arena
+        int capacity = GROW_CAPACITY(list->capacity);
+        Node **items = ast_allocate(arena, sizeof(Node*) * capacity);
+        if (list->count > 0) memcpy(items, list->items, sizeof(Node*) * list->count);
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    list->items[list->count++] = node;
+}
+
+void free_ast_arena(AstArena *arena) {
+    AstChunk *chunk = arena->chunks;
+    while (chunk != NULL) {
+        AstChunk *next = chunk->next;
+        if (arena->unmanaged) {
+            free(chunk);
+        } else {
+            FREE_ARRAY(char, chunk, sizeof(AstChunk) + chunk->size);
+        }
+        chunk = next;
+    }
+
+    arena->chunks = NULL;
+}
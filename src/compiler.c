@@ -1,22 +1,41 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "ast.h"
 #include "common.h"
 #include "compiler.h"
-#include "lexer.h"
-
-#ifdef DEBUG_PRINT_CODE
-
 #include "debug.h"
-
-#endif
+#include "lexer.h"
+#include "memory.h"
+#include "number.h"
+#include "optimizer.h"
+#include "output.h"
+#include "peephole.h"
+#include "table.h"
+
+// Compilation runs in two passes over a script: the parser builds a tree for
+// the whole script, then, once the optimizer has rewritten it, bytecode is
+// generated from the tree. The first pass never touches the VM heap, so the
+// scripts of a program are parsed on several threads, each with a parser
+// and lexer of its own. Code is generated on the VM's thread.
 
 typedef struct {
     Token current;
     Token previous;
     bool had_error;
     bool panic_mode;
+    // the tokens of the source being parsed, when they are lexed up front,
+    // and the index of the current one. tokens are lexed as they are needed
+    // when it is NULL.
+    TokenBuffer *tokens;
+    int index;
+    // the number of tokens advanced past, by which function bodies are measured
+    int token_count;
+    // the path of the script being compiled, named in its errors. NULL for
+    // input typed at the REPL.
+    const char *path;
 } Parser;
 
 typedef enum {
@@ -26,27 +45,41 @@ typedef enum {
     PREC_AND,         // and
     PREC_EQUALITY,    // == !=
     PREC_COMPARISON,  // < > <= >=
+    PREC_RANGE,       // ..
     PREC_TERM,        // + -
     PREC_FACTOR,      // * /
     PREC_UNARY,       // ! -
     PREC_SUBSCRIPT,   // []
-    PREC_RANGE,       // ..
     PREC_CALL,        // . ()
     PREC_PRIMARY
 } Precedence;
 
-// a simple zero argument function pointer type for parsing
-typedef void (*ParseFn)(bool can_assign);
+// parse functions for tokens that start an expression, and for tokens that
+// continue the expression parsed so far
+typedef Node *(*PrefixFn)(bool can_assign);
+typedef Node *(*InfixFn)(Node *left, bool can_assign);
 
 typedef struct {
-    ParseFn prefix;
-    ParseFn infix;
+    PrefixFn prefix;
+    InfixFn infix;
     Precedence precedence;
 } ParseRule;
 
+// the longest function body, in tokens, that is parsed with the script when
+// function bodies are deferred
+#define SHORT_BODY_TOKENS 32
+
+// the most instructions a function may have, its return included, for its
+// body to be inlined at the calls to it, and the most nodes the arguments of
+// such a call may have
+#define MAX_INLINE_INSTRUCTIONS 16
+#define MAX_INLINE_ARGUMENT_NODES 16
+
 typedef struct {
     Token name;
     int depth;
+    // whether the slot is known to hold a number where code is being generated
+    bool number;
 } Local;
 
 typedef enum {
@@ -54,18 +87,79 @@ typedef enum {
     TYPE_SCRIPT
 } FunctionType;
 
+// An index of a function's constant pool by identity, so that each distinct
+// constant is added once however often it is referenced. The slots hold
+// positions in the pool plus one, zero marks an empty slot.
+typedef struct {
+    uint32_t *slots;
+    int count;
+    int capacity;
+} ConstantIndex;
+
 typedef struct Compiler {
     struct Compiler *enclosing;
     ObjFunction *function;
     FunctionType type;
-    Local locals[UINT8_COUNT];
+    Local *locals;
     int local_count;
+    int local_capacity;
     int scope_depth;
+    ConstantIndex constants;
+    // the jumps that need their wide form, relaxed when the function is finished
+    FarJump *far_jumps;
+    int far_jump_count;
+    int far_jump_capacity;
 } Compiler;
 
-Parser parser;
+_Thread_local Parser parser;
 Compiler *current = NULL;
-Module *compiling_module;
+
+// the tree of the script being compiled
+static _Thread_local AstArena ast;
+
+// the tokens of the script being parsed, reused from one script to the next
+static _Thread_local TokenBuffer tokens;
+
+// whether this thread is one of the threads started to parse a program
+static _Thread_local bool parse_thread = false;
+
+// A script of a program, with the arena its tree was parsed into.
+typedef struct {
+    const char *source;
+    const char *path;
+    Node *tree;
+    AstArena ast;
+} ProgramScript;
+
+// the scripts of the program being compiled
+static ProgramScript *program = NULL;
+static int program_count = 0;
+
+// The scripts parse threads take their next script from.
+typedef struct {
+    int next;
+    bool unmanaged;
+} ParseQueue;
+
+// the functions the script being compiled declares as globals, by name. calls
+// to them can be inlined before the script has run and defined them.
+static Table script_functions;
+
+// the globals the script being compiled declares at its top level, by name.
+// code that follows a declaration, or runs in a function declared after it,
+// only runs once the global is defined.
+static Table script_globals;
+
+// the token of the node code is being generated for. it gives the line of the
+// emitted code, and the place errors are reported at.
+static Token *location = NULL;
+
+// whether the expression just generated is known to leave a number
+static bool number_result = false;
+
+// how many unreachable statements enclose the code being generated. their
+// code is only generated for the errors it reports, and is then dropped.
+static int unreachable_depth = 0;
 
 static Module *current_module() {
     return &current->function->module;
@@ -74,17 +168,22 @@ static Module *current_module() {
 static void error_at(Token *token, const char *message) {
     if (parser.panic_mode) return;
     parser.panic_mode = true;
-    fprintf(stderr, "[line %d] Error", token->line);
 
+    // what the script printed comes before the error, when it is compiled
+    // while running. parse threads only run before the script does.
+    if (!parse_thread) flush_output();
+
+    // written at once, scripts parsed on other threads may report errors too
+    const char *path = parser.path != NULL ? parser.path : "";
+    const char *separator = parser.path != NULL ? ", " : "";
     if (token->type == TK_EOF) {
-        fprintf(stderr, " at end");
+        fprintf(stderr, "[%s%sline %d] Error at end: %s\n", path, separator, token->line, message);
     } else if (token->type == TK_ERROR) {
-        // Nothing.
+        fprintf(stderr, "[%s%sline %d] Error: %s\n", path, separator, token->line, message);
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(stderr, "[%s%sline %d] Error at '%.*s': %s\n", path, separator, token->line,
+                token->length, token->start, message);
     }
-
-    fprintf(stderr, ": %s\n", message);
     parser.had_error = true;
 }
 
@@ -98,15 +197,41 @@ static void error(const char *message) {
 
 static void advance() {
     parser.previous = parser.current;
+    parser.token_count++;
 
     for (;;) {
-        parser.current = lex_token();
+        if (parser.tokens == NULL) {
+            parser.current = lex_token();
+        } else {
+            // like the lexer, the buffer keeps returning TK_EOF at the end
+            if (parser.index < parser.tokens->count - 1) parser.index++;
+            parser.current = buffered_token(parser.tokens, parser.index);
+        }
         if (parser.current.type != TK_ERROR) break;
 
         error_at_current(parser.current.start);
     }
 }
 
+// Start parsing a piece of source code from the script at path, where it
+// starts on the given line.
+static void begin_parse(const char *source, const char *path, int line) {
+    parser.had_error = false;
+    parser.panic_mode = false;
+    parser.path = path;
+
+    if (vm.prelex_tokens) {
+        lex_tokens(&tokens, source, line);
+        parser.tokens = &tokens;
+        parser.index = -1;
+    } else {
+        initialize_lexer_at(source, line);
+        parser.tokens = NULL;
+    }
+
+    advance();
+}
+
 static void consume(TokenType type, const char *message) {
     if (parser.current.type == type) {
         advance();
@@ -129,491 +254,1618 @@ static bool match(TokenType type) {
     return true;
 }
 
-static void emit_byte(uint8_t byte) {
-    write_module(current_module(), byte, parser.previous.line);
-}
-
-static void emit_byte_pair(uint8_t byte1, uint8_t byte2) {
-    emit_byte(byte1);
-    emit_byte(byte2);
-}
-
-static uint8_t make_constant(Value value) {
-    int constant = add_constant(current_module(), value);
-
-    // TODO: dynamically resize the constant pool
-    if (constant > UINT8_MAX) {
-        error("Too many constants in one module.");
-        return 0;
-    }
-
-    return (uint8_t) constant;
-}
-
-static void emit_constant(Value value) {
-    emit_byte_pair(OP_CONSTANT, make_constant(value));
-}
-
-static void emit_loop(int loop_start) {
-    emit_byte(OP_LOOP);
-
-    int offset = (int) current_module()->count - loop_start + 2;
-    if (offset > UINT16_MAX) {
-        error("Loop body too large.");
-    }
-
-    emit_byte((offset >> 8) & 0xff);
-    emit_byte(offset & 0xff);
-}
-
-static int emit_jump(uint8_t instruction) {
-    // emit specified jump instruction
-    emit_byte(instruction);
-
-    // set placeholder bytes for the jump offset
-    emit_byte(0xff);
-    emit_byte(0xff);
-
-    // return the offset of the placeholder bytes
-    return (int) current_module()->count - 2;
+static Node *node(NodeType type, Token token) {
+    return new_node(&ast, type, token);
 }
 
-static void emit_return() {
-    emit_byte(OP_RETURN);
-}
+static Node *expression();
 
-static void expression();
+static Node *statement();
 
-static void statement();
+static Node *declaration();
 
-static void declaration();
+static bool identifiers_equal(Token *a, Token *b);
 
 static ParseRule *get_rule(TokenType type);
 
-static void parse_precedence(Precedence precedence);
-
-static ObjFunction *end_compiler() {
-    emit_return();
-    ObjFunction *function = current->function;
-#ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error) {
-        disassemble_module(current_module(), function->name != NULL
-            ? function->name->chars : "<script>");
-    }
-#endif
-
-    current = current->enclosing;
-    return function;
-}
-
-static void begin_scope() {
-    current->scope_depth++;
-}
-
-static void end_scope() {
-    current->scope_depth--;
-
-    // remove the local variables that are no longer in scope
-    while (current->local_count > 0 &&
-           current->locals[current->local_count - 1].depth > current->scope_depth) {
-        // TODO: This can be further optimized through the use of an instruction
-        //  that takes a number of locals to pop off the stack.
-        emit_byte(OP_POP);
-        current->local_count--;
-    }
-}
+static Node *parse_precedence(Precedence precedence);
 
-static void binary(bool can_assign) {
-    TokenType operator_type = parser.previous.type;
-    ParseRule *rule = get_rule(operator_type);
-    parse_precedence((Precedence) (rule->precedence + 1));
+static Node *binary(Node *left, bool can_assign) {
+    Token operator = parser.previous;
+    ParseRule *rule = get_rule(operator.type);
 
-    switch (operator_type) {
-        case TK_BANG_EQUAL:
-            emit_byte_pair(OP_EQUAL, OP_NOT);
-            break;
-        case TK_EQUAL_EQUAL:
-            emit_byte(OP_EQUAL);
-            break;
-        case TK_GREATER:
-            emit_byte(OP_GREATER);
-            break;
-        case TK_GREATER_EQUAL:
-            emit_byte_pair(OP_LESS, OP_NOT);
-            break;
-        case TK_LESS:
-            emit_byte(OP_LESS);
-            break;
-        case TK_LESS_EQUAL:
-            emit_byte_pair(OP_GREATER, OP_NOT);
-            break;
-        case TK_PLUS:
-            emit_byte(OP_ADD);
-            break;
-        case TK_MINUS:
-            emit_byte(OP_SUBTRACT);
-            break;
-        case TK_STAR:
-            emit_byte(OP_MULTIPLY);
-            break;
-        case TK_SLASH:
-            emit_byte(OP_DIVIDE);
-            break;
-        case TK_PERCENT:
-            emit_byte(OP_MODULO);
-            break;
-        case TK_RANGE:
-            emit_byte(OP_BUILD_RANGE);
-            break;
-        default:
-            return; // unreachable
-    }
+    Node *binary = node(NODE_BINARY, operator);
+    binary->as.binary.left = left;
+    binary->as.binary.right = parse_precedence((Precedence) (rule->precedence + 1));
+    return binary;
 }
 
-static uint8_t argument_list() {
-    uint8_t arg_count = 0;
+static void argument_list(NodeList *arguments) {
+    int arg_count = 0;
     if (!check(TK_RPAREN)) {
         do {
-            expression();
-            if (arg_count == UINT8_COUNT) {
-                error("Cannot have more than 255 arguments.");
+            append_node(&ast, arguments, expression());
+            if (arg_count == WIDE_OPERAND_COUNT - 1) {
+                error("Cannot have more than 16777215 arguments.");
             }
             arg_count++;
         } while (match(TK_COMMA));
     }
     consume(TK_RPAREN, "Expected ')' after arguments.");
-    return arg_count;
 }
 
-static void call(bool can_assign) {
-    uint8_t arg_count = argument_list();
-    emit_byte_pair(OP_CALL, arg_count);
+static Node *call(Node *left, bool can_assign) {
+    Node *call = node(NODE_CALL, parser.previous);
+    call->as.call.callee = left;
+    argument_list(&call->as.call.arguments);
+    return call;
 }
 
-static void literal(bool can_assign) {
+static Node *literal(bool can_assign) {
     switch (parser.previous.type) {
         case TK_FALSE:
-            emit_byte(OP_FALSE);
-            break;
+            return node(NODE_FALSE, parser.previous);
         case TK_TRUE:
-            emit_byte(OP_TRUE);
-            break;
+            return node(NODE_TRUE, parser.previous);
         case TK_NIL:
-            emit_byte(OP_NIL);
-            break;
+            return node(NODE_NIL, parser.previous);
         default:
-            return; // unreachable
+            return NULL; // unreachable
     }
 }
 
-static void expression() {
-    parse_precedence(PREC_ASSIGNMENT);
+static Node *expression() {
+    return parse_precedence(PREC_ASSIGNMENT);
 }
 
-static void block() {
+static void block(NodeList *statements) {
     while (!check(TK_RBRACE) && !check(TK_EOF)) {
-        declaration();
+        append_node(&ast, statements, declaration());
     }
 
     consume(TK_RBRACE, "Expected '}' after block.");
 }
 
-static void parse_precedence(Precedence precedence) {
+static Node *parse_precedence(Precedence precedence) {
     advance();
-    ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
+    PrefixFn prefix_rule = get_rule(parser.previous.type)->prefix;
     if (prefix_rule == NULL) {
         // TODO: Make this error message more informative.
         error("Expected expression.");
-        return;
+        return NULL;
     }
 
     bool can_assign = precedence <= PREC_ASSIGNMENT;
-    prefix_rule(can_assign);
+    Node *expression = prefix_rule(can_assign);
 
     while (precedence <= get_rule(parser.current.type)->precedence) {
         advance();
-        ParseFn infix_rule = get_rule(parser.previous.type)->infix;
-        infix_rule(can_assign);
+        InfixFn infix_rule = get_rule(parser.previous.type)->infix;
+        expression = infix_rule(expression, can_assign);
     }
 
     if (can_assign && match(TK_EQUAL)) {
         error("Invalid assignment target.");
     }
-}
 
-static uint8_t identifier_constant(Token *name) {
-    return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
+    return expression;
 }
 
-static bool identifiers_equal(Token *a, Token *b) {
-    if (a->length != b->length) return false;
-    return memcmp(a->start, b->start, a->length) == 0;
+static Node *and_(Node *left, bool can_assign) {
+    Node *and = node(NODE_AND, parser.previous);
+    and->as.binary.left = left;
+    and->as.binary.right = parse_precedence(PREC_AND);
+    return and;
 }
 
-static int resolve_local(Compiler *compiler, Token *name) {
-    // find the local variable in the scope chain
-    for (int i = compiler->local_count - 1; i >= 0; i--) {
-        Local *local = &compiler->locals[i];
-        if (identifiers_equal(name, &local->name)) {
-            if (local->depth == -1) {
-                error("Cannot read local variable in its own initializer.");
+// Parse a function from its parameter list on. The body of a deferred
+// function is parsed into a scratch arena, which checks its syntax, then
+// dropped. It is parsed again and compiled when the function is first called,
+// which reports any other error compiling it finds.
+//
+// Bodies of at most SHORT_BODY_TOKENS tokens are parsed again right away and
+// kept: they cost less to compile than to keep, and they are the functions
+// that can be inlined.
+static Node *function(Token name, bool deferred) {
+    Node *function = node(NODE_FUNCTION, name);
+
+    // parse the function parameters
+    consume(TK_LPAREN, "Expected '(' after function name.");
+    Token start = parser.previous;
+    if (!check(TK_RPAREN)) {
+        do {
+            if (function->as.function.parameters.count == WIDE_OPERAND_COUNT - 1) {
+                error_at_current("Cannot have more than 16777215 parameters.");
             }
-            return i;
-        }
-    }
 
-    // assumed to be a global variable.
-    return -1;
-}
+            consume(TK_IDENTIFIER, "Expected parameter name.");
+            append_node(&ast, &function->as.function.parameters, node(NODE_VARIABLE, parser.previous));
+        } while (match(TK_COMMA));
+    }
+    consume(TK_RPAREN, "Expected ')' after function parameters.");
+    consume(TK_LBRACE, "Expected '{' before function body.");
+    Token open = parser.previous;
+    int body = parser.index;
+    int first = parser.token_count;
+
+    if (!deferred) {
+        // parse the function body
+        block(&function->as.function.body);
+        return function;
+    }
 
-static void add_local(Token name) {
-    if (current->local_count == UINT8_COUNT) {
-        // TODO: FIX FIX FIX FIX FIX FIX OH MY GOD FIX FIX FIX FIX FIX FIX
-        error("Maximum number of local variables reached.");
-        return;
+    // the scratch arena is off the VM heap, so no out-of-memory error can
+    // unwind past it and leave it in place of the tree
+    AstArena tree = ast;
+    initialize_ast_arena(&ast, true);
+    bool had_error = parser.had_error;
+    parser.had_error = false;
+    block(&function->as.function.body);
+    bool body_error = parser.had_error;
+    parser.had_error = had_error || body_error;
+
+    function->as.function.body = (NodeList) {NULL, 0, 0};
+    free_ast_arena(&ast);
+    ast = tree;
+    if (body_error) return function;
+
+    // the closing brace is not part of the body
+    bool short_body = parser.token_count - first - 1 <= SHORT_BODY_TOKENS;
+
+    if (short_body) {
+        // scan the body again, into the tree this time
+        if (parser.tokens != NULL) {
+            parser.index = body - 1;
+        } else {
+            initialize_lexer_at(open.start + 1, open.line);
+        }
+        advance();
+        block(&function->as.function.body);
+        return function;
     }
 
-    Local *local = &current->locals[current->local_count++];
-    local->name = name;
-    local->depth = -1;
+    function->as.function.source = start.start;
+    function->as.function.source_length = (int) (parser.previous.start + parser.previous.length - start.start);
+    function->as.function.source_line = start.line;
+    return function;
 }
 
-static void declare_variable() {
-    // we are in global scope if the scope depth is zero.
-    if (current->scope_depth == 0) return;
+static Node *function_declaration() {
+    consume(TK_IDENTIFIER, "Expected function name.");
+    return function(parser.previous, vm.defer_functions);
+}
 
-    Token *name = &parser.previous;
-    for (int i = current->local_count - 1; i >= 0; i--) {
-        Local *local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scope_depth) {
-            break;
-        }
+static Node *variable_declaration() {
+    consume(TK_IDENTIFIER, "Expected variable name.");
+    Node *let = node(NODE_LET, parser.previous);
 
-        if (identifiers_equal(name, &local->name)) {
-            // redeclaration of a variable in the same scope is disallowed.
-            error("Variable with this name already declared in this scope.");
-        }
+    if (match(TK_EQUAL)) {
+        // variable assignment handling
+        let->as.value = expression();
     }
 
-    add_local(*name);
+    consume(TK_SEMICOLON, "Expected ';' after variable declaration.");
+    return let;
 }
 
-static uint8_t parse_variable(const char *error_message) {
-    consume(TK_IDENTIFIER, error_message);
+// TODO: Further investigate using context to determine the end of a statement or expression,
+//  as opposed to using a semicolon as a synchronizing token.
+//// check if the current token is a synchronizing token
+//static bool is_sync() {
+//    switch (parser.current.type) {
+//        case TK_CLASS:
+//        case TK_FN:
+//        case TK_LET:
+//        case TK_IF:
+//        case TK_WHILE:
+//        case TK_PRINTLN:
+//        case TK_RETURN:
+//        case TK_EOF:
+//            return true;
+//        default:
+//            return false;
+//    }
+//}
+//
+//static bool is_expr_stmt_op(TokenType type) {
+//    switch (type) {
+//        case TK_EQUAL:
+//        case TK_PLUS:
+//        case TK_MINUS:
+//        case TK_STAR:
+//        case TK_SLASH:
+//        case TK_BANG_EQUAL:
+//        case TK_EQUAL_EQUAL:
+//        case TK_GREATER:
+//        case TK_GREATER_EQUAL:
+//        case TK_LESS:
+//        case TK_LESS_EQUAL:
+//            return true;
+//        default:
+//            return false;
+//    }
+//}
 
-    declare_variable();
-    if (current->scope_depth > 0) return 0;
+static Node *expression_statement() {
+    Node *value = expression();
+    consume(TK_SEMICOLON, "Expected ';' after expression.");
 
-    return identifier_constant(&parser.previous);
+    Node *statement = node(NODE_EXPRESSION_STATEMENT, parser.previous);
+    statement->as.expression = value;
+    return statement;
 }
 
-static void mark_initialized() {
-    if (current->scope_depth == 0) return;
-    current->locals[current->local_count - 1].depth = current->scope_depth;
-}
+static Node *list(bool can_assign) {
+    Node *list = node(NODE_LIST, parser.previous);
 
-static void define_variable(uint8_t global) {
-    if (current->scope_depth > 0) {
-        mark_initialized();
-        return;
-    }
+    if (!check(TK_RBRACKET)) {
+        do {
+            if (check(TK_RBRACKET)) {
+                // trailing comma handling
+                break;
+            }
 
+            Node *item = parse_precedence(PREC_OR);
 
-    emit_byte_pair(OP_DEFINE_GLOBAL, global);
+            if (list->as.items.count == WIDE_OPERAND_COUNT - 1) {
+                error("Cannot have more than 16777215 items in a list.");
+            }
+
+            append_node(&ast, &list->as.items, item);
+        } while (match(TK_COMMA));
+    }
+
+    consume(TK_RBRACKET, "Expected ']' after list.");
+    return list;
+}
+
+static Node *for_in_statement() {
+    // TODO: CURRENTLY VARIABLE NAMES ARE IN GLOBAL SCOPE. FIX THIS.
+
+    consume(TK_LET, "Expect variable declaration in for-in loop.");
+    consume(TK_IDENTIFIER, "Expect variable name.");
+    Node *loop = node(NODE_FOR_IN, parser.previous);
+    consume(TK_IN, "Expect 'in' after variable declaration.");
+
+    // expect a range or a list to follow
+    if (check(TK_NUMBER)) {
+        loop->as.for_in.range = true;
+    } else if (!check(TK_LBRACKET) && !check(TK_IDENTIFIER)) {
+        error("Expect range or list after 'in'.");
+        return loop;
+    }
+
+    loop->as.for_in.iterable = expression();
+    loop->as.for_in.body = statement();
+    return loop;
+}
+
+
+static Node *if_statement() {
+    Node *branch = node(NODE_IF, parser.previous);
+
+    // parse expression
+    branch->as.branch.condition = expression();
+
+    // require a left brace after the expression, but don't consume it.
+    // it will be consumed later in the statement function call.
+    if (!check(TK_LBRACE)) {
+        error("Expected '{' after 'if' condition.");
+    }
+
+    // parse the then clause
+    branch->as.branch.then_branch = statement();
+
+    // handle else clause if present
+    if (match(TK_ELSE)) {
+        if (!check(TK_LBRACE)) {
+            error("Expected '{' after 'if' condition.");
+        }
+        branch->as.branch.else_branch = statement();
+    }
+
+    return branch;
+}
+
+static Node *while_statement() {
+    Node *loop = node(NODE_WHILE, parser.previous);
+
+    // parse while condition
+    loop->as.branch.condition = expression();
+
+    // require a left brace after the expression, but don't consume it.
+    if (!check(TK_LBRACE)) {
+        error("Expected '{' after 'while' condition.");
+    }
+
+    loop->as.branch.then_branch = statement();
+    return loop;
+}
+
+static Node *print_statement() {
+    Node *print = node(NODE_PRINTLN, parser.previous);
+
+    // require a left parenthesis after the 'println' keyword
+    if (check(TK_LPAREN)) {
+        advance();
+
+        // parse the expression
+        print->as.expression = expression();
+
+        // require a right parenthesis after the expression
+        consume(TK_RPAREN, "Expected ')' after expression.");
+    } else {
+        error("Expected '(' after 'println'.");
+    }
+
+    // require a semicolon after the expression
+    consume(TK_SEMICOLON, "Expected ';' after expression.");
+    return print;
+}
+
+static Node *return_statement() {
+    Node *result = node(NODE_RETURN, parser.previous);
+
+    if (!check(TK_SEMICOLON)) {
+        result->as.expression = expression();
+    }
+
+    consume(TK_SEMICOLON, "Expected ';' after return value.");
+    return result;
+}
+
+static Node *import_statement() {
+    Node *import = node(NODE_IMPORT, parser.previous);
+
+    // the path is taken directly from the lexeme, without the quotes
+    consume(TK_STRING, "Expected module path after 'import'.");
+    import->as.string.chars = parser.previous.start + 1;
+    import->as.string.length = parser.previous.length - 2;
+
+    consume(TK_SEMICOLON, "Expected ';' after module path.");
+    return import;
+}
+
+static void synchronize() {
+    parser.panic_mode = false;
+
+    while (parser.current.type != TK_EOF) {
+        // advance to the next synchronizing token
+        if (parser.previous.type == TK_SEMICOLON) return;
+
+        switch (parser.current.type) {
+            case TK_CLASS:
+            case TK_FN:
+            case TK_LET:
+            case TK_IF:
+            case TK_WHILE:
+            case TK_PRINTLN:
+            case TK_RETURN:
+            case TK_IMPORT:
+                return;
+            default:
+                // Do nothing.
+                ;
+        }
+
+        advance();
+    }
+}
+
+static Node *statement() {
+    if (match(TK_PRINTLN)) {
+        return print_statement();
+    } else if (match(TK_IF)) {
+        return if_statement();
+    } else if (match(TK_WHILE)) {
+        return while_statement();
+    } else if (match(TK_FOR)) {
+        return for_in_statement();
+    } else if (match(TK_RETURN)) {
+        return return_statement();
+    } else if (match(TK_IMPORT)) {
+        return import_statement();
+    } else if (match(TK_LBRACE)) {
+        Node *block_statement = node(NODE_BLOCK, parser.previous);
+        block(&block_statement->as.items);
+        return block_statement;
+    } else {
+        return expression_statement();
+    }
+}
+
+//static void range(bool can_assign) {
+//    // Expect a number for the start of the range
+//    parse_precedence(PREC_OR);
+//    consume(TK_RANGE, "Expected '..' after start of range.");
+//    // Expect a number for the end of the range
+//    parse_precedence(PREC_OR);
+//
+//    emit_byte(OP_BUILD_RANGE);
+//}
+
+// Whether an index is a range, which makes the subscript a slice.
+static bool is_range(Node *node) {
+    return node->type == NODE_BINARY && node->token.type == TK_RANGE;
+}
+
+static Node *subscript(Node *left, bool can_assign) {
+    Node *subscript = node(NODE_INDEX, parser.previous);
+    subscript->as.subscript.list = left;
+    subscript->as.subscript.index = parse_precedence(PREC_OR);
+    consume(TK_RBRACKET, "Expected ']' after subscript.");
+
+    if (can_assign && match(TK_EQUAL)) {
+        if (is_range(subscript->as.subscript.index)) error("Cannot assign to a slice.");
+        subscript->type = NODE_STORE_INDEX;
+        subscript->as.subscript.value = expression();
+    }
+
+    return subscript;
+}
+
+static Node *declaration() {
+    Node *declaration;
+    if (match(TK_FN)) {
+        declaration = function_declaration();
+    } else if (match(TK_LET)) {
+        // variable declaration handling
+        declaration = variable_declaration();
+    } else {
+        // statement handling
+        declaration = statement();
+    }
+
+    if (parser.panic_mode) {
+        synchronize();
+    }
+
+    return declaration;
+}
+
+static Node *grouping(bool can_assign) {
+    Node *inner = expression();
+    consume(TK_RPAREN, "Expected ')' after expression.");
+    return inner;
+}
+
+static Node *number(bool can_assign) {
+    // digits alone are an integer, unless there are too many for 64 bits
+    int64_t value;
+    if (parse_integer(parser.previous.start, parser.previous.length, &value)) {
+        Node *integer = node(NODE_INTEGER, parser.previous);
+        integer->as.integer = value;
+        return integer;
+    }
+
+    Node *number = node(NODE_NUMBER, parser.previous);
+    parse_number(parser.previous.start, parser.previous.length, &number->as.number);
+    return number;
+}
+
+static Node *or_(Node *left, bool can_assign) {
+    Node *or = node(NODE_OR, parser.previous);
+    or->as.binary.left = left;
+    or->as.binary.right = parse_precedence(PREC_OR);
+    return or;
+}
+
+static Node *string(bool can_assign) {
+    // take the characters directly from the lexeme, and eliminate the surrounding quotes.
+    Node *string = node(NODE_STRING, parser.previous);
+    string->as.string.chars = parser.previous.start + 1;
+    string->as.string.length = parser.previous.length - 2;
+    return string;
+}
+
+static Node *variable(bool can_assign) {
+    Token name = parser.previous;
+
+    if (can_assign && match(TK_EQUAL)) {
+        Node *assign = node(NODE_ASSIGN, name);
+        assign->as.value = expression();
+        return assign;
+    }
+
+    return node(NODE_VARIABLE, name);
+}
+
+static Node *unary(bool can_assign) {
+    Node *unary = node(NODE_UNARY, parser.previous);
+
+    // parse the operand
+    unary->as.operand = parse_precedence(PREC_UNARY);
+    return unary;
+}
+
+ParseRule rules[] = {
+        [TK_LPAREN]         = {grouping, call, PREC_CALL},
+        [TK_RBRACE]         = {NULL, NULL, PREC_NONE},
+        [TK_LBRACE]         = {NULL, NULL, PREC_NONE},
+        [TK_RPAREN]         = {NULL, NULL, PREC_NONE},
+        [TK_LBRACKET]       = {list, subscript, PREC_SUBSCRIPT},
+        [TK_RBRACKET]       = {NULL, NULL, PREC_NONE},
+        [TK_COMMA]          = {NULL, NULL, PREC_NONE},
+        [TK_RANGE]          = {NULL, binary, PREC_RANGE},
+        [TK_DOT]            = {NULL, NULL, PREC_NONE},
+        [TK_MINUS]          = {unary, binary, PREC_TERM},
+        [TK_PLUS]           = {NULL, binary, PREC_TERM},
+        [TK_SEMICOLON]      = {NULL, NULL, PREC_NONE},
+        [TK_SLASH]          = {NULL, binary, PREC_FACTOR},
+        [TK_STAR]           = {NULL, binary, PREC_FACTOR},
+        [TK_PERCENT]        = {NULL, binary, PREC_FACTOR},
+        [TK_BANG]           = {unary, NULL, PREC_NONE},
+        [TK_BANG_EQUAL]     = {NULL, binary, PREC_EQUALITY},
+        [TK_EQUAL]          = {NULL, NULL, PREC_NONE},
+        [TK_PLUS_EQUAL]     = {NULL, NULL, PREC_NONE},
+        [TK_MINUS_EQUAL]    = {NULL, NULL, PREC_NONE},
+        [TK_STAR_EQUAL]     = {NULL, NULL, PREC_NONE},
+        [TK_SLASH_EQUAL]    = {NULL, NULL, PREC_NONE},
+        [TK_PERCENT_EQUAL]  = {NULL, NULL, PREC_NONE},
+        [TK_EQUAL_EQUAL]    = {NULL, binary, PREC_EQUALITY},
+        [TK_GREATER]        = {NULL, binary, PREC_COMPARISON},
+        [TK_GREATER_EQUAL]  = {NULL, binary, PREC_COMPARISON},
+        [TK_LESS]           = {NULL, binary, PREC_COMPARISON},
+        [TK_LESS_EQUAL]     = {NULL, binary, PREC_COMPARISON},
+        [TK_IDENTIFIER]     = {variable, NULL, PREC_NONE},
+        [TK_STRING]         = {string, NULL, PREC_NONE},
+        [TK_NUMBER]         = {number, NULL, PREC_NONE},
+        [TK_AND]            = {NULL, and_, PREC_AND},
+        [TK_CLASS]          = {NULL, NULL, PREC_NONE},
+        [TK_ELSE]           = {NULL, NULL, PREC_NONE},
+        [TK_FALSE]          = {literal, NULL, PREC_NONE},
+        [TK_FN]             = {NULL, NULL, PREC_NONE},
+        [TK_FOR]            = {NULL, NULL, PREC_NONE},
+        [TK_IF]             = {NULL, NULL, PREC_NONE},
+        [TK_NIL]            = {literal, NULL, PREC_NONE}, // TODO: Rename to TK_NULL
+        [TK_OR]             = {NULL, or_, PREC_OR},
+        [TK_PRINTLN]        = {NULL, NULL, PREC_NONE},
+        [TK_RETURN]         = {NULL, NULL, PREC_NONE},
+        [TK_SUPER]          = {NULL, NULL, PREC_NONE},
+        [TK_SELF]           = {NULL, NULL, PREC_NONE},
+        [TK_TRUE]           = {literal, NULL, PREC_NONE},
+        [TK_LET]            = {NULL, NULL, PREC_NONE},
+        [TK_WHILE]          = {NULL, NULL, PREC_NONE},
+        [TK_ERROR]          = {NULL, NULL, PREC_NONE},
+        [TK_EOF]            = {NULL, NULL, PREC_NONE}
+};
+
+static ParseRule *get_rule(TokenType type) {
+    return &rules[type];
+}
+
+// Parse a whole script. Returns NULL if it has syntax errors.
+static Node *parse(const char *source, const char *path) {
+    begin_parse(source, path, 1);
+
+    Node *script = node(NODE_SCRIPT, parser.current);
+    while (!match(TK_EOF)) {
+        append_node(&ast, &script->as.items, declaration());
+    }
+
+    // the script returns at the end of the file
+    script->token = parser.previous;
+    return parser.had_error ? NULL : script;
+}
+
+// Code generation.
+
+static void compile_error(const char *message) {
+    error_at(location, message);
+}
+
+static void emit_byte(uint8_t byte) {
+    write_module(current_module(), byte, location->line);
+}
+
+static void emit_byte_pair(uint8_t byte1, uint8_t byte2) {
+    emit_byte(byte1);
+    emit_byte(byte2);
+}
+
+// Emit an instruction with an index or count operand, prefixed with OP_WIDE
+// when the operand does not fit a byte.
+static void emit_operand(uint8_t instruction, uint32_t operand) {
+    if (operand <= UINT8_MAX) {
+        emit_byte_pair(instruction, (uint8_t) operand);
+        return;
+    }
+
+    emit_byte_pair(OP_WIDE, instruction);
+    emit_byte((operand >> 16) & 0xff);
+    emit_byte((operand >> 8) & 0xff);
+    emit_byte(operand & 0xff);
+}
+
+// The hash of a constant's identity. Strings are interned, so a string is
+// identified by its object, and numbers by their bits. An integer and the
+// double of the same value are different constants, and may share a hash.
+static uint32_t hash_constant(Value value) {
+    uint64_t bits;
+    if (IS_INT(value)) {
+        bits = (uint64_t) AS_INT(value);
+    } else if (IS_DOUBLE(value)) {
+        memcpy(&bits, &AS_DOUBLE(value), sizeof(bits));
+    } else {
+        bits = (uint64_t) (uintptr_t) AS_OBJ(value);
+    }
+
+    // the finalizer of MurmurHash3, which spreads every input bit over the hash
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ull;
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
+}
+
+// Whether two constants are the same. Unlike values_equal(), 0 and -0 differ
+// and NaN is the same as itself, so a constant always reads back as written.
+static bool same_constant(Value a, Value b) {
+    if (a.type != b.type) return false;
+    if (IS_INT(a)) return AS_INT(a) == AS_INT(b);
+    if (IS_DOUBLE(a)) return memcmp(&AS_DOUBLE(a), &AS_DOUBLE(b), sizeof(double)) == 0;
+    return AS_OBJ(a) == AS_OBJ(b);
+}
+
+// Find the slot of a constant in the index, or the empty slot it belongs in.
+static uint32_t *find_constant_slot(uint32_t *slots, int capacity, Value value) {
+    ValueArray *constants = &current_module()->constants;
+    uint32_t index = hash_constant(value) & (capacity - 1);
+    for (;;) {
+        uint32_t *slot = &slots[index];
+        if (*slot == 0 || same_constant(constants->values[*slot - 1], value)) return slot;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+// Lay the index out again with the given capacity, leaving out the constants
+// no longer in the pool.
+static void rebuild_constant_index(ConstantIndex *index, int capacity) {
+    uint32_t *slots = ALLOCATE(uint32_t, capacity);
+    for (int i = 0; i < capacity; i++) slots[i] = 0;
+
+    ValueArray *constants = &current_module()->constants;
+    index->count = 0;
+    for (int i = 0; i < index->capacity; i++) {
+        uint32_t constant = index->slots[i];
+        if (constant != 0 && constant <= (uint32_t) constants->count) {
+            *find_constant_slot(slots, capacity, constants->values[constant - 1]) = constant;
+            index->count++;
+        }
+    }
+
+    FREE_ARRAY(uint32_t, index->slots, index->capacity);
+    index->slots = slots;
+    index->capacity = capacity;
+}
+
+static uint32_t make_constant(Value value) {
+    ConstantIndex *index = &current->constants;
+    if (index->capacity > 0) {
+        uint32_t *slot = find_constant_slot(index->slots, index->capacity, value);
+        if (*slot != 0) return *slot - 1;
+    }
+
+    uint32_t constant = add_constant(current_module(), value);
+
+    if (constant >= WIDE_OPERAND_COUNT) {
+        compile_error("Too many constants in one module.");
+        return 0;
+    }
+
+    // the value may only be reachable from the pool, so the index grows once it is there
+    if (index->count + 1 > index->capacity * 3 / 4) rebuild_constant_index(index, GROW_CAPACITY(index->capacity));
+    *find_constant_slot(index->slots, index->capacity, value) = constant + 1;
+    index->count++;
+    return constant;
+}
+
+static void emit_constant(Value value) {
+    emit_operand(OP_CONSTANT, make_constant(value));
+}
+
+// Remember a jump that is too far for its compact form. finish_code() lays
+// the function out again with the jump in its wide form.
+static void add_far_jump(uint32_t offset, uint32_t target) {
+    if (current->far_jump_capacity < current->far_jump_count + 1) {
+        int old_capacity = current->far_jump_capacity;
+        current->far_jump_capacity = GROW_CAPACITY(old_capacity);
+        current->far_jumps = GROW_ARRAY(current->far_jumps, FarJump, old_capacity, current->far_jump_capacity);
+    }
+
+    FarJump *jump = &current->far_jumps[current->far_jump_count++];
+    jump->offset = offset;
+    jump->target = target;
+}
+
+static void emit_loop(int loop_start) {
+    emit_byte(OP_LOOP);
+
+    int offset = (int) current_module()->count - loop_start + 2;
+    if (offset > UINT16_MAX) {
+        add_far_jump(current_module()->count - 1, (uint32_t) loop_start);
+        offset = UINT16_MAX;
+    }
+
+    emit_byte((offset >> 8) & 0xff);
+    emit_byte(offset & 0xff);
+}
+
+static int emit_jump(uint8_t instruction) {
+    // emit specified jump instruction
+    emit_byte(instruction);
+
+    // set placeholder bytes for the jump offset
+    emit_byte(0xff);
+    emit_byte(0xff);
+
+    // return the offset of the placeholder bytes
+    return (int) current_module()->count - 2;
+}
+
+static void emit_return() {
+    // a function that runs off its end returns nil
+    emit_byte(OP_NIL);
+    emit_byte(OP_RETURN);
+}
+
+// Patch the jump instruction at start, whose offset placeholder is at offset,
+// to land on the next instruction emitted.
+static void patch_jump_from(uint32_t start, int offset) {
+    // subtract two to account for the bytecode for the jump offset
+    int jump = (int) current_module()->count - offset - 2;
+
+    if (jump > UINT16_MAX) {
+        add_far_jump(start, current_module()->count);
+        return;
+    }
+
+    // patch the jump offset
+    current_module()->code[offset] = (jump >> 8) & 0xff;
+    current_module()->code[offset + 1] = jump & 0xff;
+}
+
+static void patch_jump(int offset) {
+    patch_jump_from((uint32_t) offset - 1, offset);
+}
+
+static void add_local(Token name);
+
+// Start compiling a function. Code is generated into the given function, or
+// into a new one when it is NULL.
+static void initialize_compiler(Compiler *compiler, FunctionType type, Token *name, ObjFunction *function) {
+    compiler->enclosing = current;
+    compiler->function = NULL;
+    compiler->type = type;
+    compiler->locals = NULL;
+    compiler->local_count = 0;
+    compiler->local_capacity = 0;
+    compiler->scope_depth = 0;
+    compiler->constants.slots = NULL;
+    compiler->constants.count = 0;
+    compiler->constants.capacity = 0;
+    compiler->far_jumps = NULL;
+    compiler->far_jump_count = 0;
+    compiler->far_jump_capacity = 0;
+    compiler->function = function != NULL ? function : new_function();
+    current = compiler;
+    if (type != TYPE_SCRIPT && current->function->name == NULL) {
+        current->function->name = copy_string(name->start, name->length);
+        WRITE_BARRIER(OBJ_VAL(current->function->name));
+    }
+
+    // the function being called takes the first slot
+    add_local((Token) {.start = "", .length = 0});
+    current->locals[0].depth = 0;
+}
+
+static ObjFunction *end_compiler() {
+    emit_return();
+    ObjFunction *function = current->function;
+    if (!parser.had_error) {
+        function->max_slots = finish_code(current_module(), current->far_jumps, current->far_jump_count,
+                                          function->arity + 1, vm.optimization_level > 0);
+    }
+
+    if (vm.print_code && !parser.had_error && unreachable_depth == 0) {
+        disassemble_module(current_module(), function->name != NULL
+            ? function->name->chars : "<script>");
+    }
+
+    FREE_ARRAY(Local, current->locals, current->local_capacity);
+    FREE_ARRAY(uint32_t, current->constants.slots, current->constants.capacity);
+    FREE_ARRAY(FarJump, current->far_jumps, current->far_jump_capacity);
+    current = current->enclosing;
+    return function;
+}
+
+static void begin_scope() {
+    current->scope_depth++;
+}
+
+static void end_scope() {
+    current->scope_depth--;
+
+    // remove the local variables that are no longer in scope
+    while (current->local_count > 0 &&
+           current->locals[current->local_count - 1].depth > current->scope_depth) {
+        // the peephole optimizer merges these into a single OP_POPN
+        emit_byte(OP_POP);
+        current->local_count--;
+    }
+}
+
+static uint32_t identifier_constant(Token *name) {
+    return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
+}
+
+static bool identifiers_equal(Token *a, Token *b) {
+    if (a->length != b->length) return false;
+    return memcmp(a->start, b->start, a->length) == 0;
+}
+
+static int resolve_local(Compiler *compiler, Token *name) {
+    // find the local variable in the scope chain
+    for (int i = compiler->local_count - 1; i >= 0; i--) {
+        Local *local = &compiler->locals[i];
+        if (identifiers_equal(name, &local->name)) {
+            if (local->depth == -1) {
+                compile_error("Cannot read local variable in its own initializer.");
+            }
+            return i;
+        }
+    }
+
+    // assumed to be a global variable.
+    return -1;
+}
+
+static void add_local(Token name) {
+    if (current->local_count == WIDE_OPERAND_COUNT) {
+        compile_error("Maximum number of local variables reached.");
+        return;
+    }
+
+    if (current->local_capacity < current->local_count + 1) {
+        int old_capacity = current->local_capacity;
+        current->local_capacity = GROW_CAPACITY(old_capacity);
+        current->locals = GROW_ARRAY(current->locals, Local, old_capacity, current->local_capacity);
+    }
+
+    Local *local = &current->locals[current->local_count++];
+    local->name = name;
+    local->depth = -1;
+    local->number = false;
+}
+
+static void declare_variable(Token *name) {
+    // we are in global scope if the scope depth is zero.
+    if (current->scope_depth == 0) return;
+
+    for (int i = current->local_count - 1; i >= 0; i--) {
+        Local *local = &current->locals[i];
+        if (local->depth != -1 && local->depth < current->scope_depth) {
+            break;
+        }
+
+        if (identifiers_equal(name, &local->name)) {
+            // redeclaration of a variable in the same scope is disallowed.
+            compile_error("Variable with this name already declared in this scope.");
+        }
+    }
+
+    add_local(*name);
+}
+
+// Declare the variable a node names. Returns the constant holding the name of a global.
+static uint32_t parse_variable(Node *node) {
+    location = &node->token;
+
+    declare_variable(&node->token);
+    if (current->scope_depth > 0) return 0;
+
+    return identifier_constant(&node->token);
+}
+
+static void mark_initialized() {
+    if (current->scope_depth == 0) return;
+    current->locals[current->local_count - 1].depth = current->scope_depth;
+}
+
+static void define_variable(uint32_t global) {
+    if (current->scope_depth > 0) {
+        mark_initialized();
+        return;
+    }
+
+
+    emit_operand(OP_DEFINE_GLOBAL, global);
+}
+
+static void generate(Node *node);
+
+// The types known for the locals in scope, saved where control flow splits
+// so that each path starts from them.
+typedef struct {
+    bool *numbers;
+    int count;
+} TypeState;
+
+static TypeState save_types() {
+    TypeState state;
+    state.count = current->local_count;
+    state.numbers = ALLOCATE(bool, state.count);
+    for (int i = 0; i < state.count; i++) state.numbers[i] = current->locals[i].number;
+    return state;
+}
+
+static void restore_types(TypeState *state) {
+    for (int i = 0; i < state->count && i < current->local_count; i++) {
+        current->locals[i].number = state->numbers[i];
+    }
+}
+
+// Keep only the types that also hold in the saved state, where paths join.
+static void merge_types(TypeState *state) {
+    for (int i = 0; i < state->count && i < current->local_count; i++) {
+        current->locals[i].number = current->locals[i].number && state->numbers[i];
+    }
+}
+
+static void free_types(TypeState *state) {
+    FREE_ARRAY(bool, state->numbers, state->count);
+}
+
+// The local a name refers to where the loop being scanned starts, or NULL.
+static Local *scanned_local(Token *name, NodeList *declared) {
+    for (int i = 0; i < declared->count; i++) {
+        // it may name a variable declared in the loop instead
+        if (identifiers_equal(name, &declared->items[i]->token)) return NULL;
+    }
+
+    int slot = -1;
+    for (int i = current->local_count - 1; i >= 0 && slot == -1; i--) {
+        if (identifiers_equal(name, &current->locals[i].name)) slot = i;
+    }
+    return slot != -1 ? &current->locals[slot] : NULL;
+}
+
+// Whether an expression in a loop leaves a number, if the locals known to be
+// numbers stay numbers throughout the loop.
+static bool scan_number(Node *node, NodeList *declared) {
+    switch (node->type) {
+        case NODE_NUMBER:
+        case NODE_INTEGER:
+            return true;
+        case NODE_VARIABLE: {
+            Local *local = scanned_local(&node->token, declared);
+            return local != NULL && local->number;
+        }
+        case NODE_ASSIGN:
+            return scan_number(node->as.value, declared);
+        case NODE_UNARY:
+            return node->token.type == TK_MINUS;
+        case NODE_BINARY:
+            switch (node->token.type) {
+                case TK_MINUS:
+                case TK_STAR:
+                case TK_SLASH:
+                case TK_PERCENT:
+                    return true;
+                case TK_PLUS:
+                    return scan_number(node->as.binary.left, declared) && scan_number(node->as.binary.right, declared);
+                default:
+                    return false;
+            }
+        default:
+            return false;
+    }
+}
+
+// What a loop writes, collected before its code is generated.
+typedef struct {
+    // the variables declared and the assignments made in the loop
+    NodeList declared;
+    NodeList assigned;
+    // whether the loop calls anything, which may change any global
+    bool calls;
+} Loop;
+
+static void scan_loop(Node *node, Loop *loop) {
+    if (node == NULL) return;
+
+    switch (node->type) {
+        case NODE_LET:
+        case NODE_FUNCTION:
+        case NODE_FOR_IN:
+            append_node(&ast, &loop->declared, node);
+            break;
+        case NODE_ASSIGN:
+            append_node(&ast, &loop->assigned, node);
+            break;
+        case NODE_CALL:
+        case NODE_IMPORT:
+            loop->calls = true;
+            break;
+        default:
+            break;
+    }
+
+    switch (node->type) {
+        case NODE_ASSIGN:
+        case NODE_LET:
+            scan_loop(node->as.value, loop);
+            break;
+        case NODE_UNARY:
+            scan_loop(node->as.operand, loop);
+            break;
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            scan_loop(node->as.binary.left, loop);
+            scan_loop(node->as.binary.right, loop);
+            break;
+        case NODE_CALL:
+            scan_loop(node->as.call.callee, loop);
+            for (int i = 0; i < node->as.call.arguments.count; i++) {
+                scan_loop(node->as.call.arguments.items[i], loop);
+            }
+            break;
+        case NODE_LIST:
+        case NODE_BLOCK:
+            for (int i = 0; i < node->as.items.count; i++) {
+                scan_loop(node->as.items.items[i], loop);
+            }
+            break;
+        case NODE_INDEX:
+        case NODE_STORE_INDEX:
+            scan_loop(node->as.subscript.list, loop);
+            scan_loop(node->as.subscript.index, loop);
+            scan_loop(node->as.subscript.value, loop);
+            break;
+        case NODE_EXPRESSION_STATEMENT:
+        case NODE_PRINTLN:
+        case NODE_RETURN:
+            scan_loop(node->as.expression, loop);
+            break;
+        case NODE_IF:
+        case NODE_WHILE:
+            scan_loop(node->as.branch.condition, loop);
+            scan_loop(node->as.branch.then_branch, loop);
+            scan_loop(node->as.branch.else_branch, loop);
+            break;
+        case NODE_FOR_IN:
+            scan_loop(node->as.for_in.iterable, loop);
+            scan_loop(node->as.for_in.body, loop);
+            break;
+        default:
+            // function bodies have locals of their own
+            break;
+    }
 }
 
-static void patch_jump(int offset) {
-    // subtract two to account for the bytecode for the jump offset
-    int jump = (int) current_module()->count - offset - 2;
+// Forget the types of the locals that do not stay numbers while a loop runs.
+// The assignments are scanned again until no more types are forgotten, as a
+// local that is forgotten can make others the loop assigns from it unknown.
+static void begin_loop_types(Loop *loop) {
+    bool changed;
+    do {
+        changed = false;
+        for (int i = 0; i < loop->assigned.count; i++) {
+            Node *assign = loop->assigned.items[i];
+            if (scan_number(assign->as.value, &loop->declared)) continue;
+
+            // a variable declared in the loop may hide the local, and the
+            // local is forgotten all the same
+            for (int j = current->local_count - 1; j >= 0; j--) {
+                Local *local = &current->locals[j];
+                if (identifiers_equal(&assign->token, &local->name)) {
+                    changed = changed || local->number;
+                    local->number = false;
+                    break;
+                }
+            }
+        }
+    } while (changed);
+}
 
-    // TODO: upgrade compiler facilities to handle larger jumps
-    if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+// Whether a loop may write a variable.
+static bool loop_writes(Loop *loop, Token *name) {
+    for (int i = 0; i < loop->declared.count; i++) {
+        if (identifiers_equal(name, &loop->declared.items[i]->token)) return true;
     }
+    for (int i = 0; i < loop->assigned.count; i++) {
+        if (identifiers_equal(name, &loop->assigned.items[i]->token)) return true;
+    }
+    return false;
+}
 
-    // patch the jump offset
-    current_module()->code[offset] = (jump >> 8) & 0xff;
-    current_module()->code[offset + 1] = jump & 0xff;
+// Whether a global is defined wherever the code being compiled runs: it was
+// defined before the script was compiled, or by a top-level declaration the
+// script made before. Globals are never removed.
+static bool global_defined(Token *name) {
+    ObjString *string = copy_string(name->start, name->length);
+    Value value;
+    return table_get(&script_globals, string, &value) || table_get(&vm.globals, string, &value);
+}
+
+// Whether an expression in a loop has the same value on every iteration and
+// can be evaluated once before it: it reads nothing the loop writes, and it
+// cannot fail. Sets number to whether the value is known to be a number.
+static bool loop_invariant(Node *node, Loop *loop, bool *number) {
+    *number = false;
+    switch (node->type) {
+        case NODE_NUMBER:
+        case NODE_INTEGER:
+            *number = true;
+            return true;
+        case NODE_STRING:
+        case NODE_TRUE:
+        case NODE_FALSE:
+        case NODE_NIL:
+            return true;
+        case NODE_VARIABLE: {
+            if (loop_writes(loop, &node->token)) return false;
+            Local *local = scanned_local(&node->token, &loop->declared);
+            if (local != NULL) {
+                *number = local->number;
+                return local->depth != -1;
+            }
+            // any call may assign a global, and reading one fails while it is undefined
+            return !loop->calls && global_defined(&node->token);
+        }
+        case NODE_UNARY: {
+            bool operand;
+            if (!loop_invariant(node->as.operand, loop, &operand)) return false;
+            if (node->token.type == TK_BANG) return true;
+            *number = true;
+            return operand;
+        }
+        case NODE_BINARY: {
+            bool left, right;
+            if (!loop_invariant(node->as.binary.left, loop, &left) ||
+                !loop_invariant(node->as.binary.right, loop, &right)) {
+                return false;
+            }
+            switch (node->token.type) {
+                case TK_EQUAL_EQUAL:
+                case TK_BANG_EQUAL:
+                    return true;
+                case TK_PLUS:
+                case TK_MINUS:
+                case TK_STAR:
+                case TK_SLASH:
+                    *number = true;
+                    return left && right;
+                case TK_LESS:
+                case TK_GREATER:
+                case TK_LESS_EQUAL:
+                case TK_GREATER_EQUAL:
+                    return left && right;
+                default:
+                    // % fails on fractions, and .. builds a new range
+                    return false;
+            }
+        }
+        default:
+            return false;
+    }
+}
+
+// Move the invariant expressions of a loop into the initializers of hidden
+// locals, collected as let nodes, and read the locals in their place. Only
+// expressions that do some work are moved: an operation, or a global lookup.
+static void hoist_invariants(Node *node, Loop *loop, NodeList *hoisted) {
+    if (node == NULL) return;
+
+    bool number;
+    bool global = node->type == NODE_VARIABLE && scanned_local(&node->token, &loop->declared) == NULL;
+    if ((global || node->type == NODE_UNARY || node->type == NODE_BINARY) && loop_invariant(node, loop, &number)) {
+        // the same global is read into a single local
+        for (int i = 0; global && i < hoisted->count; i++) {
+            Node *value = hoisted->items[i]->as.value;
+            if (value->type == NODE_VARIABLE && identifiers_equal(&node->token, &value->token)) {
+                node->token.start = hoisted->items[i]->token.start;
+                node->token.length = hoisted->items[i]->token.length;
+                return;
+            }
+        }
+
+        // named after the slot it will take, which no identifier or other
+        // hidden local in scope can clash with
+        char *name = ast_allocate(&ast, 24);
+        Token token = node->token;
+        token.start = name;
+        token.length = snprintf(name, 24, "(hoisted %d)", current->local_count + hoisted->count);
+
+        Node *value = new_node(&ast, node->type, node->token);
+        *value = *node;
+        Node *let = new_node(&ast, NODE_LET, token);
+        let->as.value = value;
+        append_node(&ast, hoisted, let);
+
+        node->type = NODE_VARIABLE;
+        node->token = token;
+        return;
+    }
+
+    switch (node->type) {
+        case NODE_ASSIGN:
+        case NODE_LET:
+            hoist_invariants(node->as.value, loop, hoisted);
+            break;
+        case NODE_UNARY:
+            hoist_invariants(node->as.operand, loop, hoisted);
+            break;
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            hoist_invariants(node->as.binary.left, loop, hoisted);
+            hoist_invariants(node->as.binary.right, loop, hoisted);
+            break;
+        case NODE_CALL:
+            hoist_invariants(node->as.call.callee, loop, hoisted);
+            for (int i = 0; i < node->as.call.arguments.count; i++) {
+                hoist_invariants(node->as.call.arguments.items[i], loop, hoisted);
+            }
+            break;
+        case NODE_LIST:
+        case NODE_BLOCK:
+            for (int i = 0; i < node->as.items.count; i++) {
+                hoist_invariants(node->as.items.items[i], loop, hoisted);
+            }
+            break;
+        case NODE_INDEX:
+        case NODE_STORE_INDEX:
+            hoist_invariants(node->as.subscript.list, loop, hoisted);
+            hoist_invariants(node->as.subscript.index, loop, hoisted);
+            hoist_invariants(node->as.subscript.value, loop, hoisted);
+            break;
+        case NODE_EXPRESSION_STATEMENT:
+        case NODE_PRINTLN:
+        case NODE_RETURN:
+            hoist_invariants(node->as.expression, loop, hoisted);
+            break;
+        case NODE_IF:
+        case NODE_WHILE:
+            hoist_invariants(node->as.branch.condition, loop, hoisted);
+            hoist_invariants(node->as.branch.then_branch, loop, hoisted);
+            hoist_invariants(node->as.branch.else_branch, loop, hoisted);
+            break;
+        case NODE_FOR_IN:
+            hoist_invariants(node->as.for_in.iterable, loop, hoisted);
+            hoist_invariants(node->as.for_in.body, loop, hoisted);
+            break;
+        default:
+            // function bodies run in frames of their own
+            break;
+    }
+}
+
+// Scan a loop, and at -O1 evaluate its invariant expressions into hidden
+// locals before it starts. The locals live in the enclosing scope, so that a
+// loop at the top level of a script still declares globals. Returns the number
+// of hidden locals, which end_loop drops.
+static int begin_loop(Loop *loop, Node *condition, Node *body) {
+    scan_loop(condition, loop);
+    scan_loop(body, loop);
+    begin_loop_types(loop);
+
+    if (vm.optimization_level == 0) return 0;
+
+    NodeList hoisted = {NULL, 0, 0};
+    hoist_invariants(condition, loop, &hoisted);
+    hoist_invariants(body, loop, &hoisted);
+
+    for (int i = 0; i < hoisted.count; i++) {
+        Node *let = hoisted.items[i];
+        generate(let->as.value);
+        location = &let->token;
+
+        add_local(let->token);
+        current->locals[current->local_count - 1].depth = current->scope_depth;
+        current->locals[current->local_count - 1].number = number_result;
+    }
+    return hoisted.count;
+}
+
+static void end_loop(int hoisted) {
+    for (int i = 0; i < hoisted; i++) {
+        emit_byte(OP_POP);
+        current->local_count--;
+    }
+}
+
+static void generate_statements(NodeList *statements) {
+    for (int i = 0; i < statements->count; i++) {
+        generate(statements->items[i]);
+
+        // report at most one error per statement
+        parser.panic_mode = false;
+    }
+}
+
+static void generate_binary(Node *node) {
+    generate(node->as.binary.left);
+    bool left_number = number_result;
+    generate(node->as.binary.right);
+    bool numbers = left_number && number_result;
+    location = &node->token;
+
+    // -, *, / and % fail on anything but numbers, so a result is always a number
+    TokenType operator = node->token.type;
+    number_result = operator == TK_MINUS || operator == TK_STAR || operator == TK_SLASH ||
+                    operator == TK_PERCENT || (operator == TK_PLUS && numbers);
+
+    if (numbers && vm.optimization_level > 0) {
+        switch (operator) {
+            case TK_PLUS: emit_byte(OP_ADD_NN); return;
+            case TK_MINUS: emit_byte(OP_SUBTRACT_NN); return;
+            case TK_STAR: emit_byte(OP_MULTIPLY_NN); return;
+            case TK_SLASH: emit_byte(OP_DIVIDE_NN); return;
+            case TK_GREATER: emit_byte(OP_GREATER_NN); return;
+            case TK_LESS: emit_byte(OP_LESS_NN); return;
+            // fused into the negated comparison by the peephole pass
+            case TK_GREATER_EQUAL: emit_byte_pair(OP_LESS_NN, OP_NOT); return;
+            case TK_LESS_EQUAL: emit_byte_pair(OP_GREATER_NN, OP_NOT); return;
+            default: break;
+        }
+    }
+
+    switch (operator) {
+        case TK_BANG_EQUAL:
+            emit_byte_pair(OP_EQUAL, OP_NOT);
+            break;
+        case TK_EQUAL_EQUAL:
+            emit_byte(OP_EQUAL);
+            break;
+        case TK_GREATER:
+            emit_byte(OP_GREATER);
+            break;
+        case TK_GREATER_EQUAL:
+            emit_byte_pair(OP_LESS, OP_NOT);
+            break;
+        case TK_LESS:
+            emit_byte(OP_LESS);
+            break;
+        case TK_LESS_EQUAL:
+            emit_byte_pair(OP_GREATER, OP_NOT);
+            break;
+        case TK_PLUS:
+            emit_byte(OP_ADD);
+            break;
+        case TK_MINUS:
+            emit_byte(OP_SUBTRACT);
+            break;
+        case TK_STAR:
+            emit_byte(OP_MULTIPLY);
+            break;
+        case TK_SLASH:
+            emit_byte(OP_DIVIDE);
+            break;
+        case TK_PERCENT:
+            emit_byte(OP_MODULO);
+            break;
+        case TK_RANGE:
+            emit_byte(OP_BUILD_RANGE);
+            break;
+        default:
+            return; // unreachable
+    }
 }
 
-static void and_(bool can_assign) {
+static void generate_and(Node *node) {
+    generate(node->as.binary.left);
+    location = &node->token;
+
     int end_jump = emit_jump(OP_JUMP_IF_FALSE);
 
+    // the right operand may not run
+    TypeState skipped = save_types();
     emit_byte(OP_POP);
-    parse_precedence(PREC_AND);
+    generate(node->as.binary.right);
+    merge_types(&skipped);
+    free_types(&skipped);
+    number_result = false;
 
     patch_jump(end_jump);
 }
 
-static void loop_declaration() {
-    // For c-style for loops, which are not currently supported
-    // and probably won't be, but this is here regardless.
-    uint8_t global = parse_variable("Expected variable name.");
+static void generate_or(Node *node) {
+    generate(node->as.binary.left);
+    location = &node->token;
 
-    if (match(TK_EQUAL)) {
-        // variable assignment handling
-        expression();
+    int else_jump = emit_jump(OP_JUMP_IF_FALSE);
+    int end_jump = emit_jump(OP_JUMP);
+
+    patch_jump(else_jump);
+    emit_byte(OP_POP);
+
+    // the right operand may not run
+    TypeState skipped = save_types();
+    generate(node->as.binary.right);
+    merge_types(&skipped);
+    free_types(&skipped);
+    number_result = false;
+
+    patch_jump(end_jump);
+}
+
+static void named_variable(Node *node) {
+    uint8_t get_op, set_op;
+    Token *name = &node->token;
+    location = name;
+    int arg = resolve_local(current, name);
+
+    // determine the appropriate get and set instructions
+    // to use based on whether the variable is local or global.
+    if (arg != -1) {
+        get_op = OP_GET_LOCAL;
+        set_op = OP_SET_LOCAL;
     } else {
-        // variable initialization handling
-        emit_byte(OP_NIL);
+        arg = identifier_constant(name);
+        get_op = OP_GET_GLOBAL;
+        set_op = OP_SET_GLOBAL;
     }
 
-    define_variable(global);
+    if (node->type == NODE_ASSIGN) {
+        generate(node->as.value);
+        location = name;
+        emit_operand(set_op, (uint32_t) arg);
+        if (set_op == OP_SET_LOCAL) current->locals[arg].number = number_result;
+    } else {
+        emit_operand(get_op, (uint32_t) arg);
+        number_result = get_op == OP_GET_LOCAL && current->locals[arg].number;
+    }
 }
 
-static void initialize_compiler(Compiler *compiler, FunctionType type) {
-    compiler->enclosing = current;
-    compiler->function = NULL;
-    compiler->type = type;
-    compiler->local_count = 0;
-    compiler->scope_depth = 0;
-    compiler->function = new_function();
-    current = compiler;
-    if (type != TYPE_SCRIPT) {
-        current->function->name = copy_string(parser.previous.start, parser.previous.length);
+// Generate an assignment whose value is not used, x = x + e or x = x - e, as
+// an update of the local in place. Both x and e must be known to be numbers,
+// and e must not assign anything, as x is read after it. Returns whether the
+// assignment was generated.
+static bool generate_local_update(Node *node) {
+    if (vm.optimization_level == 0 || node->type != NODE_ASSIGN) return false;
+
+    Node *value = node->as.value;
+    if (value->type != NODE_BINARY || (value->token.type != TK_PLUS && value->token.type != TK_MINUS)) return false;
+
+    Node *left = value->as.binary.left;
+    Node *right = value->as.binary.right;
+    if (left->type != NODE_VARIABLE || !identifiers_equal(&left->token, &node->token)) return false;
+
+    int slot = resolve_local(current, &node->token);
+    Loop loop = {{NULL, 0, 0}, {NULL, 0, 0}, false};
+    scan_loop(right, &loop);
+    if (slot == -1 || !current->locals[slot].number || loop.assigned.count > 0 ||
+        !scan_number(right, &loop.declared)) {
+        return false;
     }
 
-    Local *local = &current->locals[current->local_count++];
-    local->depth = 0;
-    local->name.start = "";
-    local->name.length = 0;
+    generate(right);
+    location = &value->token;
+    emit_operand(value->token.type == TK_PLUS ? OP_ADD_LOCAL_NN : OP_SUBTRACT_LOCAL_NN, (uint32_t) slot);
+    return true;
 }
 
-static void function(FunctionType type) {
-    // initialize a compilation context for the function
-    Compiler compiler;
+// Generate the parameters and body of a function into the current compiler's function.
+static void generate_function_body(Node *node) {
+    begin_scope();
 
-    initialize_compiler(&compiler, type);
+    // declare the function parameters
+    NodeList *parameters = &node->as.function.parameters;
+    current->function->arity = parameters->count;
+    for (int i = 0; i < parameters->count; i++) {
+        uint32_t constant = parse_variable(parameters->items[i]);
+        define_variable(constant);
+    }
 
-    begin_scope();
+    // generate the function body
+    generate_statements(&node->as.function.body);
+    location = &node->token;
+}
 
-    // parse the function parameters
-    consume(TK_LPAREN, "Expected '(' after function name.");
-    if (!check(TK_RPAREN)) {
-        do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                error("Cannot have more than 255 parameters.");
-            }
+// Emit a function whose body is compiled when it is first called. It keeps a
+// copy of its source, the script's source may be gone by then.
+static ObjFunction *generate_deferred_function(Node *node) {
+    ObjFunction *function = new_function();
+    function->arity = node->as.function.parameters.count;
+
+    // the constant pool keeps the function reachable while its name and source are copied
+    emit_constant(OBJ_VAL(function));
+    function->name = copy_string(node->token.start, node->token.length);
+    WRITE_BARRIER(OBJ_VAL(function->name));
+
+    int length = node->as.function.source_length;
+    char *source = ALLOCATE(char, length + 1);
+    memcpy(source, node->as.function.source, length);
+    source[length] = '\0';
+
+    function->source = source;
+    function->source_length = length;
+    function->source_line = node->as.function.source_line;
+    function->path = parser.path;
+    return function;
+}
 
-            uint8_t constant = parse_variable("Expected parameter name.");
-            define_variable(constant);
-        } while (match(TK_COMMA));
+static ObjFunction *generate_function(Node *node) {
+    if (node->as.function.source != NULL) {
+        return generate_deferred_function(node);
     }
-    consume(TK_RPAREN, "Expected ')' after function parameters.");
-    consume(TK_LBRACE, "Expected '{' before function body.");
 
-    // parse the function body
-    block();
+    // initialize a compilation context for the function
+    Compiler compiler;
+
+    initialize_compiler(&compiler, TYPE_FUNCTION, &node->token, NULL);
+    generate_function_body(node);
 
     // emit the function object
     ObjFunction *function = end_compiler();
-    emit_byte_pair(OP_CONSTANT, make_constant(OBJ_VAL(function)));
+    emit_constant(OBJ_VAL(function));
+    return function;
 }
 
-static void function_declaration() {
-    uint8_t global = parse_variable("Expected function name.");
+static void generate_function_declaration(Node *node) {
+    uint32_t global = parse_variable(node);
     mark_initialized();
-    function(TYPE_FUNCTION);
+    ObjFunction *function = generate_function(node);
+
+    if (current->type == TYPE_SCRIPT && current->scope_depth == 0 && unreachable_depth == 0) {
+        // both the name and the function are in the constant pool
+        ObjString *name = AS_STRING(current_module()->constants.values[global]);
+        table_set(&script_functions, name, OBJ_VAL(function));
+        table_set(&script_globals, name, BOOL_VAL(true));
+    }
+
     define_variable(global);
 }
 
-static void variable_declaration() {
-    uint8_t global = parse_variable("Expected variable name.");
+static void generate_variable_declaration(Node *node) {
+    uint32_t global = parse_variable(node);
 
-    if (match(TK_EQUAL)) {
+    number_result = false;
+    if (node->as.value != NULL) {
         // variable assignment handling
-        expression();
+        generate(node->as.value);
     } else {
         // variable initialization handling
         emit_byte(OP_NIL);
     }
 
-    consume(TK_SEMICOLON, "Expected ';' after variable declaration.");
-
+    location = &node->token;
+    if (current->scope_depth > 0) current->locals[current->local_count - 1].number = number_result;
     define_variable(global);
-}
-
-// TODO: Further investigate using context to determine the end of a statement or expression,
-//  as opposed to using a semicolon as a synchronizing token.
-//// check if the current token is a synchronizing token
-//static bool is_sync() {
-//    switch (parser.current.type) {
-//        case TK_CLASS:
-//        case TK_FN:
-//        case TK_LET:
-//        case TK_IF:
-//        case TK_WHILE:
-//        case TK_PRINTLN:
-//        case TK_RETURN:
-//        case TK_EOF:
-//            return true;
-//        default:
-//            return false;
-//    }
-//}
-//
-//static bool is_expr_stmt_op(TokenType type) {
-//    switch (type) {
-//        case TK_EQUAL:
-//        case TK_PLUS:
-//        case TK_MINUS:
-//        case TK_STAR:
-//        case TK_SLASH:
-//        case TK_BANG_EQUAL:
-//        case TK_EQUAL_EQUAL:
-//        case TK_GREATER:
-//        case TK_GREATER_EQUAL:
-//        case TK_LESS:
-//        case TK_LESS_EQUAL:
-//            return true;
-//        default:
-//            return false;
-//    }
-//}
 
-static void expression_statement() {
-    expression();
-    consume(TK_SEMICOLON, "Expected ';' after expression.");
-    emit_byte(OP_POP);
+    if (current->type == TYPE_SCRIPT && current->scope_depth == 0 && unreachable_depth == 0) {
+        table_set(&script_globals, AS_STRING(current_module()->constants.values[global]), BOOL_VAL(true));
+    }
 }
 
-static void list(bool can_assign) {
-    int item_count = 0;
-    if (!check(TK_RBRACKET)) {
-        do {
-            if (check(TK_RBRACKET)) {
-                // trailing comma handling
-                break;
-            }
-
-            parse_precedence(PREC_OR);
-
-            if (item_count == UINT8_COUNT) {
-                error("Cannot have more than 255 items in a list.");
-            }
-
-            item_count++;
-        } while (match(TK_COMMA));
+static void generate_for_in(Node *node) {
+    // the iterable is evaluated once, and the loop variable is written on every iteration
+    Loop loop = {{NULL, 0, 0}, {NULL, 0, 0}, false};
+    append_node(&ast, &loop.declared, node);
+    scan_loop(node->as.for_in.iterable, &loop);
+
+    // invariants are moved out of top-level loops only. in a function the
+    // loop variable is a local whose slot the loop never pushes, so hidden
+    // locals cannot be placed under it, and the loop is generated as is.
+    int hoisted = 0;
+    if (current->scope_depth == 0) {
+        hoisted = begin_loop(&loop, NULL, node->as.for_in.body);
+    } else {
+        scan_loop(node->as.for_in.body, &loop);
+        begin_loop_types(&loop);
     }
+    TypeState loop_types = save_types();
 
-    consume(TK_RBRACKET, "Expected ']' after list.");
-
-    emit_byte(OP_BUILD_LIST);
-    emit_byte(item_count);
-}
-
-void for_in_statement() {
     // TODO: CURRENTLY VARIABLE NAMES ARE IN GLOBAL SCOPE. FIX THIS.
+    uint32_t variableIndex = parse_variable(node);
 
-    consume(TK_LET, "Expect variable declaration in for-in loop.");
-    uint8_t variableIndex = parse_variable("Expect variable name.");
-    consume(TK_IN, "Expect 'in' after variable declaration.");
-
-    // expect a range to follow
-    if (check(TK_NUMBER)) {
+    if (node->as.for_in.range) {
         // Evaluate the range
-        expression();
+        generate(node->as.for_in.iterable);
+        location = &node->token;
 
         // Set up the loop variable with the start of the range
         emit_byte(OP_RANGE_START);
@@ -623,12 +1875,13 @@ void for_in_statement() {
         int loop_start = current_module()->count;
 
         // Loop body
-        statement();
+        generate(node->as.for_in.body);
+        location = &node->token;
 
         emit_byte(OP_RANGE_END);
 
         // Increment the loop variable within the bounds of the range
-        emit_byte_pair(OP_GET_GLOBAL, variableIndex);  // Get the range end
+        emit_operand(OP_GET_GLOBAL, variableIndex);  // Get the range end
 
         // Compare the incremented index (now below the range end on the stack) to the range end
         emit_byte(OP_LESS_EQUAL);  // Assumes true if current index < range end
@@ -639,7 +1892,7 @@ void for_in_statement() {
         // remove result of branch condition
         emit_byte(OP_POP);
 
-        emit_byte_pair(OP_GET_GLOBAL, variableIndex);  // Get the range end
+        emit_operand(OP_GET_GLOBAL, variableIndex);  // Get the range end
 
         // Increment the loop variable
         emit_byte(OP_INCREMENT_RANGE);
@@ -661,14 +1914,15 @@ void for_in_statement() {
         emit_byte(OP_POP);
         // remove range
         emit_byte(OP_POP);
-    } else if (check(TK_LBRACKET) || check(TK_IDENTIFIER)) {
+    } else {
         // Evaluate the list
-        expression();
+        generate(node->as.for_in.iterable);
+        location = &node->token;
 
         // TODO: EXTREMELY HACKY WARNING WARNING ABANDON SHIP
         //  TODO: THE CURRENT REGISTER-BASED IMPLEMENTATION CANNOT HANDLE NESTED LOOPS
         // set index to 0
-        emit_byte_pair(OP_CONSTANT, make_constant(NUMBER_VAL(0)));
+        emit_constant(INT_VAL(0));
 
         // store the index in the register
         emit_byte(OP_SET_REGISTER);
@@ -693,8 +1947,9 @@ void for_in_statement() {
         // store that value in the loop variable
         define_variable(variableIndex);
 
-        // parse the loop body
-        statement();
+        // generate the loop body
+        generate(node->as.for_in.body);
+        location = &node->token;
 
         // duplicate the list
         emit_byte(OP_DUPLICATE);
@@ -725,62 +1980,67 @@ void for_in_statement() {
 
         // Patch the exit jump to jump here if the comparison indicates the end of the range has been reached
         patch_jump(exit_jump);
-    } else {
-        error("Expect range or list after 'in'.");
-    }
-}
-
 
-static void if_statement() {
-    // parse expression
-    expression();
-
-    // require a left brace after the expression, but don't consume it.
-    // it will be consumed later in the statement function call.
-    if (!check(TK_LBRACE)) {
-        error("Expected '{' after 'if' condition.");
+        // remove result of branch condition
+        emit_byte(OP_POP);
+        // remove list
+        emit_byte(OP_POP);
     }
 
+    restore_types(&loop_types);
+    free_types(&loop_types);
+    end_loop(hoisted);
+}
+
+static void generate_if(Node *node) {
+    generate(node->as.branch.condition);
+    location = &node->token;
 
     int then_jump = emit_jump(OP_JUMP_IF_FALSE);
 
     // each statement is required to have zero stack effect
     emit_byte(OP_POP); // discard the condition value
 
-    // parse the then clause
-    statement();
+    // generate the then clause
+    TypeState entry = save_types();
+    generate(node->as.branch.then_branch);
+    location = &node->token;
 
     int else_jump = emit_jump(OP_JUMP);
 
     patch_jump(then_jump);
-
-    // handle else clause if present
-    if (match(TK_ELSE)) {
-        if (!check(TK_LBRACE)) {
-            error("Expected '{' after 'if' condition.");
-        }
-        statement();
-
-        // patch the jump over the else clause
+    emit_byte(OP_POP); // the condition is still on the stack when the then clause is skipped
+
+    // handle else clause if present, starting from the types before the then clause
+    TypeState then_types = save_types();
+    restore_types(&entry);
+    if (node->as.branch.else_branch != NULL) {
+        generate(node->as.branch.else_branch);
+        location = &node->token;
     }
+    merge_types(&then_types);
+    free_types(&then_types);
+    free_types(&entry);
 
+    // patch the jump over the else clause
     patch_jump(else_jump);
 }
 
-static void while_statement() {
+static void generate_while(Node *node) {
+    Loop loop = {{NULL, 0, 0}, {NULL, 0, 0}, false};
+    int hoisted = begin_loop(&loop, node->as.branch.condition, node->as.branch.then_branch);
+    TypeState loop_types = save_types();
+
     int loop_start = current_module()->count;
-    // parse while condition
-    expression();
-
-    // require a left brace after the expression, but don't consume it.
-    if (!check(TK_LBRACE)) {
-        error("Expected '{' after 'while' condition.");
-    }
+    // generate while condition
+    generate(node->as.branch.condition);
+    location = &node->token;
 
     // emit a jump to the loop body
     int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
-    statement();
+    generate(node->as.branch.then_branch);
+    location = &node->token;
 
     emit_loop(loop_start);
 
@@ -789,277 +2049,624 @@ static void while_statement() {
 
     // pop the condition value to maintain zero stack effect
     emit_byte(OP_POP);
-}
 
-static void print_statement() {
-    // require a left parenthesis after the 'println' keyword
-    if (check(TK_LPAREN)) {
-        advance();
+    // the loop is left once the condition fails, possibly before the body ran
+    restore_types(&loop_types);
+    free_types(&loop_types);
+    end_loop(hoisted);
+}
 
-        // compile the expression
-        expression();
+static void generate_return(Node *node) {
+    location = &node->token;
+    if (current->type == TYPE_SCRIPT) {
+        compile_error("Cannot return from top-level code.");
+    }
 
-        // require a right parenthesis after the expression
-        consume(TK_RPAREN, "Expected ')' after expression.");
+    if (node->as.expression != NULL) {
+        generate(node->as.expression);
+        location = &node->token;
     } else {
-        error("Expected '(' after 'println'.");
+        emit_byte(OP_NIL);
     }
 
-    // require a semicolon after the expression
-    consume(TK_SEMICOLON, "Expected ';' after expression.");
-
-    // emit the instruction to print the value
-    emit_byte(OP_PRINTLN);
+    emit_byte(OP_RETURN);
 }
 
-static void synchronize() {
-    parser.panic_mode = false;
-
-    while (parser.current.type != TK_EOF) {
-        // advance to the next synchronizing token
-        if (parser.previous.type == TK_SEMICOLON) return;
+// Generate unreachable statements for the errors they report, then drop their
+// code and whatever else generating it added, so that -O1 rejects the same
+// scripts as -O0 without keeping code that never runs.
+static void generate_unreachable(Node *node) {
+    Module *module = current_module();
+    uint32_t code_count = module->count;
+    int line_count = module->line_count;
+    int constant_count = module->constants.count;
+    int inline_count = module->inline_count;
+    int far_jump_count = current->far_jump_count;
+    int local_count = current->local_count;
+    TypeState types = save_types();
+
+    unreachable_depth++;
+    generate_statements(&node->as.items);
+    unreachable_depth--;
+
+    module->count = code_count;
+    module->line_count = line_count;
+    module->inline_count = inline_count;
+    current->far_jump_count = far_jump_count;
+    current->local_count = local_count;
+    if (module->constants.count != constant_count) {
+        module->constants.count = constant_count;
+        rebuild_constant_index(&current->constants, current->constants.capacity);
+    }
 
-        switch (parser.current.type) {
-            case TK_CLASS:
-            case TK_FN:
-            case TK_LET:
-            case TK_IF:
-            case TK_WHILE:
-            case TK_PRINTLN:
-            case TK_RETURN:
-                return;
-            default:
-                // Do nothing.
-                ;
-        }
+    restore_types(&types);
+    free_types(&types);
+}
 
-        advance();
+// The number of nodes in an expression, counting no further than limit.
+static int count_nodes(Node *node, int limit) {
+    int count = 1;
+    switch (node->type) {
+        case NODE_ASSIGN:
+            count += count_nodes(node->as.value, limit);
+            break;
+        case NODE_UNARY:
+            count += count_nodes(node->as.operand, limit);
+            break;
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            count += count_nodes(node->as.binary.left, limit);
+            if (count <= limit) count += count_nodes(node->as.binary.right, limit);
+            break;
+        case NODE_CALL:
+            count += count_nodes(node->as.call.callee, limit);
+            for (int i = 0; i < node->as.call.arguments.count && count <= limit; i++) {
+                count += count_nodes(node->as.call.arguments.items[i], limit);
+            }
+            break;
+        case NODE_LIST:
+            for (int i = 0; i < node->as.items.count && count <= limit; i++) {
+                count += count_nodes(node->as.items.items[i], limit);
+            }
+            break;
+        case NODE_INDEX:
+        case NODE_STORE_INDEX:
+            count += count_nodes(node->as.subscript.list, limit);
+            if (count <= limit) count += count_nodes(node->as.subscript.index, limit);
+            if (count <= limit && node->as.subscript.value != NULL) {
+                count += count_nodes(node->as.subscript.value, limit);
+            }
+            break;
+        default:
+            break;
     }
+    return count;
 }
 
-static void statement() {
-    if (match(TK_PRINTLN)) {
-        print_statement();
-    } else if (match(TK_IF)) {
-        if_statement();
-    } else if (match(TK_WHILE)) {
-        while_statement();
-    } else if (match(TK_FOR)) {
-        for_in_statement();
-    } else if (match(TK_LBRACE)) {
-        begin_scope();
-        block();
-        end_scope();
-    } else {
-        expression_statement();
+// Whether an expression assigns a variable or calls a function anywhere in it,
+// either of which can change what a local argument reads.
+static bool assigns_or_calls(Node *node) {
+    switch (node->type) {
+        case NODE_ASSIGN:
+        case NODE_CALL:
+            return true;
+        case NODE_UNARY:
+            return assigns_or_calls(node->as.operand);
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            return assigns_or_calls(node->as.binary.left) || assigns_or_calls(node->as.binary.right);
+        case NODE_LIST:
+            for (int i = 0; i < node->as.items.count; i++) {
+                if (assigns_or_calls(node->as.items.items[i])) return true;
+            }
+            return false;
+        case NODE_INDEX:
+        case NODE_STORE_INDEX:
+            return assigns_or_calls(node->as.subscript.list) || assigns_or_calls(node->as.subscript.index) ||
+                   (node->as.subscript.value != NULL && assigns_or_calls(node->as.subscript.value));
+        default:
+            return false;
     }
 }
 
-static void integer(bool can_assign) {
-    long value = strtol(parser.previous.start, NULL, 10);
-    emit_constant(NUMBER_VAL(value));
-}
+// The function a call can have inlined, or NULL. The callee must be a global
+// holding the compiled function declared under its name, in the script being
+// compiled or in a script that ran before, and the call must pass as many
+// arguments as the function takes.
+static ObjFunction *inline_candidate(Node *node) {
+    Node *callee = node->as.call.callee;
+    NodeList *arguments = &node->as.call.arguments;
+    if (vm.optimization_level == 0 || callee->type != NODE_VARIABLE ||
+        resolve_local(current, &callee->token) != -1) {
+        return NULL;
+    }
 
-//static void range(bool can_assign) {
-//    // Expect a number for the start of the range
-//    parse_precedence(PREC_OR);
-//    consume(TK_RANGE, "Expected '..' after start of range.");
-//    // Expect a number for the end of the range
-//    parse_precedence(PREC_OR);
-//
-//    emit_byte(OP_BUILD_RANGE);
-//}
+    // the arguments are generated for both the inlined body and the call it
+    // falls back on
+    int nodes = 0;
+    for (int i = 0; i < arguments->count && nodes <= MAX_INLINE_ARGUMENT_NODES; i++) {
+        nodes += count_nodes(arguments->items[i], MAX_INLINE_ARGUMENT_NODES);
+    }
+    if (nodes > MAX_INLINE_ARGUMENT_NODES) return NULL;
+
+    // the name is interned already, it was emitted with the callee
+    ObjString *name = copy_string(callee->token.start, callee->token.length);
+    Value value;
+    if (!table_get(&script_functions, name, &value) && !table_get(&vm.globals, name, &value)) return NULL;
+    if (!IS_FUNCTION(value)) return NULL;
+
+    ObjFunction *function = AS_FUNCTION(value);
+    if (function->name != name || function->source != NULL || function->arity != arguments->count) return NULL;
+
+    // the body must be short and run straight to its return, reading its
+    // slots, constants and globals, and calling nothing
+    Module *module = &function->module;
+    uint32_t offset = 0;
+    for (int instructions = 0; instructions < MAX_INLINE_INSTRUCTIONS && offset < module->count; instructions++) {
+        bool wide = module->code[offset] == OP_WIDE;
+        switch (module->code[offset + wide]) {
+            case OP_RETURN:
+                return function;
+            case OP_GET_LOCAL:
+                // the slot of the function itself is not on the stack
+                if (!wide && module->code[offset + 1] == 0) return NULL;
+                // fallthrough
+            case OP_CONSTANT:
+            case OP_GET_GLOBAL:
+                offset += wide ? 5 : 2;
+                break;
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_POP:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_MODULO:
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_LESS_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_GREATER_EQUAL:
+            case OP_ADD_NN:
+            case OP_SUBTRACT_NN:
+            case OP_MULTIPLY_NN:
+            case OP_DIVIDE_NN:
+            case OP_GREATER_NN:
+            case OP_LESS_NN:
+            case OP_LESS_EQUAL_NN:
+            case OP_GREATER_EQUAL_NN:
+            case OP_INDEX_LIST:
+                offset++;
+                break;
+            default:
+                return NULL;
+        }
+    }
 
-static void subscript(bool can_assign) {
-    parse_precedence(PREC_OR);
-    consume(TK_RBRACKET, "Expected ']' after subscript.");
+    return NULL;
+}
 
-    if (can_assign && match(TK_EQUAL)) {
-        expression();
-        emit_byte(OP_STORE_LIST);
-    } else {
-        emit_byte(OP_INDEX_LIST);
+// Whether an argument can be generated at each use of its parameter rather
+// than evaluated once: it reads the same value every time, and cannot fail.
+static bool is_trivial_argument(Node *node) {
+    switch (node->type) {
+        case NODE_NUMBER:
+        case NODE_INTEGER:
+        case NODE_STRING:
+        case NODE_TRUE:
+        case NODE_FALSE:
+        case NODE_NIL:
+            return true;
+        case NODE_VARIABLE:
+            return resolve_local(current, &node->token) != -1;
+        default:
+            return false;
     }
 }
 
-static void declaration() {
-    if (match(TK_FN)) {
-        function_declaration();
-    } else if (match(TK_LET)) {
-        // variable declaration handling
-        variable_declaration();
-    } else {
-        // statement handling
-        statement();
+// Emit a call with the body of the function it calls in place of the call.
+// The inlined body runs as long as the global the function was declared as
+// still holds it. Once it is rebound, the value it holds is called instead.
+static void generate_inlined_call(Node *node, ObjFunction *function) {
+    NodeList *arguments = &node->as.call.arguments;
+    Token *call = &node->token;
+
+    uint32_t start = current_module()->count;
+    emit_operand(OP_JUMP_IF_CALLEE, make_constant(OBJ_VAL(function)));
+    emit_byte_pair(0xff, 0xff);
+    int inline_jump = (int) current_module()->count - 2;
+
+    // the call, with the callee pushed by OP_JUMP_IF_CALLEE
+    TypeState entry = save_types();
+    for (int i = 0; i < arguments->count; i++) generate(arguments->items[i]);
+    location = call;
+    emit_operand(OP_CALL, (uint32_t) arguments->count);
+    int end_jump = emit_jump(OP_JUMP);
+    patch_jump_from(start, inline_jump);
+
+    TypeState call_types = save_types();
+    restore_types(&entry);
+
+    // trivial arguments are generated where their parameter is read, the
+    // others are evaluated in order and read from the stack. a local is read
+    // late, so it is only trivial when no argument after it can change it.
+    // positions count from the first value the inlined code pushes.
+    int positions[MAX_INLINE_ARGUMENT_NODES];
+    bool changes_later = false;
+    for (int i = arguments->count - 1; i >= 0; i--) {
+        Node *argument = arguments->items[i];
+        bool trivial = is_trivial_argument(argument) && (argument->type != NODE_VARIABLE || !changes_later);
+        positions[i] = trivial ? -1 : 0;
+        changes_later = changes_later || assigns_or_calls(argument);
     }
 
-    if (parser.panic_mode) {
-        synchronize();
+    int pushed = 0;
+    for (int i = 0; i < arguments->count; i++) {
+        if (positions[i] != -1) {
+            generate(arguments->items[i]);
+            positions[i] = pushed++;
+        }
+    }
+    location = call;
+
+    Module *module = &function->module;
+    uint32_t depth = (uint32_t) pushed;
+    for (uint32_t offset = 0;;) {
+        uint32_t at = offset;
+        uint32_t emitted = current_module()->count;
+        bool wide = module->code[offset] == OP_WIDE;
+        uint8_t instruction = module->code[offset + wide];
+        offset += wide ? 2 : 1;
+
+        switch (instruction) {
+            case OP_RETURN:
+                // leave the result in place of the values under it
+                if (depth > 1) emit_operand(OP_POP_UNDER, depth - 1);
+                break;
+            case OP_CONSTANT:
+            case OP_GET_LOCAL:
+            case OP_GET_GLOBAL: {
+                uint32_t operand = module->code[offset++];
+                if (wide) {
+                    operand = operand << 16 | module->code[offset] << 8 | module->code[offset + 1];
+                    offset += 2;
+                }
+
+                if (instruction != OP_GET_LOCAL) {
+                    emit_operand(instruction, make_constant(module->constants.values[operand]));
+                } else if (operand <= (uint32_t) function->arity && positions[operand - 1] == -1) {
+                    generate(arguments->items[operand - 1]);
+                    location = call;
+                } else {
+                    // a parameter, or a local of the body after them
+                    uint32_t position = operand <= (uint32_t) function->arity
+                                        ? (uint32_t) positions[operand - 1]
+                                        : (uint32_t) pushed + operand - function->arity - 1;
+                    emit_operand(OP_PEEK, depth - 1 - position);
+                }
+                depth++;
+                break;
+            }
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                emit_byte(instruction);
+                depth++;
+                break;
+            case OP_NOT:
+            case OP_NEGATE:
+                emit_byte(instruction);
+                break;
+            default:
+                // the binary operators and OP_POP
+                emit_byte(instruction);
+                depth--;
+                break;
+        }
+
+        // a runtime error in the code is reported at the line it was inlined from
+        mark_inlined(current_module(), emitted, current_module()->count, get_line(module, at), function->name);
+        if (instruction == OP_RETURN) break;
     }
+
+    merge_types(&call_types);
+    free_types(&call_types);
+    free_types(&entry);
+    patch_jump(end_jump);
 }
 
-static void grouping(bool can_assign) {
-    expression();
-    consume(TK_RPAREN, "Expected ')' after expression.");
+static void generate(Node *node) {
+    location = &node->token;
+    number_result = false;
+
+    switch (node->type) {
+        case NODE_NUMBER:
+            emit_constant(NUMBER_VAL(node->as.number));
+            number_result = true;
+            break;
+        case NODE_INTEGER:
+            emit_constant(INT_VAL(node->as.integer));
+            number_result = true;
+            break;
+        case NODE_STRING:
+            emit_constant(OBJ_VAL(copy_string(node->as.string.chars, node->as.string.length)));
+            break;
+        case NODE_TRUE:
+            emit_byte(OP_TRUE);
+            break;
+        case NODE_FALSE:
+            emit_byte(OP_FALSE);
+            break;
+        case NODE_NIL:
+            emit_byte(OP_NIL);
+            break;
+        case NODE_VARIABLE:
+        case NODE_ASSIGN:
+            named_variable(node);
+            break;
+        case NODE_UNARY:
+            // compile the operand, then the operator instruction
+            generate(node->as.operand);
+            location = &node->token;
+            emit_byte(node->token.type == TK_BANG ? OP_NOT : OP_NEGATE);
+            // negation fails on anything but a number
+            number_result = node->token.type != TK_BANG;
+            break;
+        case NODE_BINARY:
+            generate_binary(node);
+            break;
+        case NODE_AND:
+            generate_and(node);
+            break;
+        case NODE_OR:
+            generate_or(node);
+            break;
+        case NODE_CALL: {
+            ObjFunction *inlined = inline_candidate(node);
+            if (inlined != NULL) {
+                generate_inlined_call(node, inlined);
+            } else {
+                NodeList *arguments = &node->as.call.arguments;
+                generate(node->as.call.callee);
+                for (int i = 0; i < arguments->count; i++) generate(arguments->items[i]);
+                location = &node->token;
+                emit_operand(OP_CALL, (uint32_t) arguments->count);
+            }
+            number_result = false;
+            break;
+        }
+        case NODE_LIST: {
+            NodeList *items = &node->as.items;
+            for (int i = 0; i < items->count; i++) generate(items->items[i]);
+            location = &node->token;
+            emit_operand(OP_BUILD_LIST, (uint32_t) items->count);
+            number_result = false;
+            break;
+        }
+        case NODE_INDEX:
+        case NODE_STORE_INDEX:
+            generate(node->as.subscript.list);
+            if (node->type == NODE_INDEX && is_range(node->as.subscript.index)) {
+                // a slice takes the bounds of the range, without building it
+                generate(node->as.subscript.index->as.binary.left);
+                generate(node->as.subscript.index->as.binary.right);
+                location = &node->token;
+                emit_byte(OP_SLICE_LIST);
+                number_result = false;
+                break;
+            }
+            generate(node->as.subscript.index);
+            if (node->type == NODE_STORE_INDEX) generate(node->as.subscript.value);
+            location = &node->token;
+            emit_byte(node->type == NODE_STORE_INDEX ? OP_STORE_LIST : OP_INDEX_LIST);
+            number_result = false;
+            break;
+        case NODE_EXPRESSION_STATEMENT:
+            if (generate_local_update(node->as.expression)) break;
+            generate(node->as.expression);
+            location = &node->token;
+            emit_byte(OP_POP);
+            break;
+        case NODE_IMPORT:
+            // leaves nil, or the value the module's script returns
+            emit_operand(OP_IMPORT, make_constant(OBJ_VAL(copy_string(node->as.string.chars, node->as.string.length))));
+            emit_byte(OP_POP);
+            break;
+        case NODE_PRINTLN:
+            generate(node->as.expression);
+            location = &node->token;
+            emit_byte(OP_PRINTLN);
+            break;
+        case NODE_LET:
+            generate_variable_declaration(node);
+            break;
+        case NODE_FUNCTION:
+            generate_function_declaration(node);
+            break;
+        case NODE_BLOCK:
+            begin_scope();
+            generate_statements(&node->as.items);
+            location = &node->token;
+            end_scope();
+            break;
+        case NODE_IF:
+            generate_if(node);
+            break;
+        case NODE_WHILE:
+            generate_while(node);
+            break;
+        case NODE_FOR_IN:
+            generate_for_in(node);
+            break;
+        case NODE_RETURN:
+            generate_return(node);
+            break;
+        case NODE_UNREACHABLE:
+            generate_unreachable(node);
+            break;
+        case NODE_SCRIPT:
+            generate_statements(&node->as.items);
+            break;
+    }
 }
 
-static void number(bool can_assign) {
-    double value = strtod(parser.previous.start, NULL);
-    emit_constant(NUMBER_VAL(value));
+void mark_compiler_roots() {
+    Compiler *compiler = current;
+    while (compiler != NULL) {
+        mark_object((Obj*)compiler->function);
+        compiler = compiler->enclosing;
+    }
 }
 
-static void or_(bool can_assign) {
-    int else_jump = emit_jump(OP_JUMP_IF_FALSE);
-    int end_jump = emit_jump(OP_JUMP);
+// Parse and optimize the scripts of the program the queue hands out, until
+// there are none left.
+static void parse_program(ParseQueue *queue) {
+    for (;;) {
+        int index = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+        if (index >= program_count) break;
+
+        ProgramScript *script = &program[index];
+        initialize_ast_arena(&ast, queue->unmanaged);
+        script->tree = parse(script->source, script->path);
+        if (script->tree != NULL && vm.optimization_level > 0) {
+            optimize(script->tree, &ast);
+        }
 
-    patch_jump(else_jump);
-    emit_byte(OP_POP);
+        // the arena now belongs to the script
+        script->ast = ast;
+        initialize_ast_arena(&ast, false);
+    }
 
-    parse_precedence(PREC_OR);
-    patch_jump(end_jump);
+    free_token_buffer(&tokens);
 }
 
-static void string(bool can_assign) {
-    // take the characters directly from the lexeme, and eliminate the surrounding quotes.
-    emit_constant(OBJ_VAL(copy_string(
-            parser.previous.start + 1,
-            parser.previous.length - 2
-    )));
-}
-
-static bool is_assignment_token(TokenType type) {
-    switch (type) {
-        case TK_EQUAL:
-        case TK_PLUS_EQUAL:
-        case TK_MINUS_EQUAL:
-        case TK_STAR_EQUAL:
-        case TK_SLASH_EQUAL:
-            return true;
-        default:
-            return false;
-    }
+static void *run_parse_thread(void *argument) {
+    parse_thread = true;
+    parse_program((ParseQueue*)argument);
+    return NULL;
 }
 
-static void named_variable(Token name, bool can_assign) {
-    uint8_t get_op, set_op;
-    int arg = resolve_local(current, &name);
+static void free_program() {
+    for (int i = 0; i < program_count; i++) {
+        free_ast_arena(&program[i].ast);
+    }
+    free(program);
+    program = NULL;
+    program_count = 0;
+}
 
-    // determine the appropriate get and set instructions
-    // to use based on whether the variable is local or global.
-    if (arg != -1) {
-        get_op = OP_GET_LOCAL;
-        set_op = OP_SET_LOCAL;
-    } else {
-        arg = identifier_constant(&name);
-        get_op = OP_GET_GLOBAL;
-        set_op = OP_SET_GLOBAL;
+ObjFunction *compile_program(const char **sources, const char **paths, int count, int threads) {
+    // a compilation aborted by an out-of-memory error may have left a stale
+    // compiler and trees behind
+    current = NULL;
+    unreachable_depth = 0;
+    free_table(&script_functions);
+    free_table(&script_globals);
+    free_ast_arena(&ast);
+    free_program();
+
+    program = (ProgramScript*)calloc(count, sizeof(ProgramScript));
+    if (program == NULL) exit(1);
+    program_count = count;
+    for (int i = 0; i < count; i++) {
+        program[i].source = sources[i];
+        program[i].path = paths != NULL ? paths[i] : NULL;
     }
 
-    if (can_assign && is_assignment_token(parser.current.type)) {
-        expression();
-        emit_byte_pair(set_op, (uint8_t) arg);
-    } else {
-        emit_byte_pair(get_op, (uint8_t) arg);
+    // the VM's thread parses too, so only threads - 1 are started. once a
+    // thread is started, trees are kept off the VM heap, as an out-of-memory
+    // error on the VM's thread would unwind past the threads still parsing.
+    if (threads > count) threads = count;
+    ParseQueue queue = {0, threads > 1};
+    pthread_t *helpers = threads > 1 ? (pthread_t*)malloc(sizeof(pthread_t) * (threads - 1)) : NULL;
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&helpers[started], NULL, run_parse_thread, &queue) == 0) {
+        started++;
     }
-}
 
-static void variable(bool can_assign) {
-    named_variable(parser.previous, can_assign);
-}
+    parse_program(&queue);
+    for (int i = 0; i < started; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
 
-static void unary(bool can_assign) {
-    TokenType operator_type = parser.previous.type;
+    bool had_error = false;
+    for (int i = 0; i < count; i++) {
+        had_error = had_error || program[i].tree == NULL;
+    }
+    if (had_error) {
+        free_program();
+        return NULL;
+    }
 
-    // compile the operand
-    expression();
+    // link the scripts into one, which runs them in order
+    Compiler compiler;
+    initialize_compiler(&compiler, TYPE_SCRIPT, NULL, NULL);
+    initialize_table(&script_functions);
+    initialize_table(&script_globals);
+    parser.had_error = false;
+    parser.panic_mode = false;
 
-    // emit the operator instruction
-    switch (operator_type) {
-        case TK_BANG:
-            emit_byte(OP_NOT);
-            break;
-        case TK_MINUS:
-            emit_byte(OP_NEGATE);
-            break;
-        default:
-            return; // unreachable
+    for (int i = 0; i < count; i++) {
+        parser.path = program[i].path;
+        generate(program[i].tree);
     }
-}
 
-ParseRule rules[] = {
-        [TK_LPAREN]         = {grouping, call, PREC_CALL},
-        [TK_RBRACE]         = {NULL, NULL, PREC_NONE},
-        [TK_LBRACE]         = {NULL, NULL, PREC_NONE},
-        [TK_RPAREN]         = {NULL, NULL, PREC_NONE},
-        [TK_LBRACKET]       = {list, subscript, PREC_SUBSCRIPT},
-        [TK_RBRACKET]       = {NULL, NULL, PREC_NONE},
-        [TK_COMMA]          = {NULL, NULL, PREC_NONE},
-        [TK_RANGE]          = {NULL, binary, PREC_RANGE},
-        [TK_DOT]            = {NULL, NULL, PREC_NONE},
-        [TK_MINUS]          = {unary, binary, PREC_TERM},
-        [TK_PLUS]           = {NULL, binary, PREC_TERM},
-        [TK_SEMICOLON]      = {NULL, NULL, PREC_NONE},
-        [TK_SLASH]          = {NULL, binary, PREC_FACTOR},
-        [TK_STAR]           = {NULL, binary, PREC_FACTOR},
-        [TK_PERCENT]        = {NULL, binary, PREC_FACTOR},
-        [TK_BANG]           = {unary, NULL, PREC_NONE},
-        [TK_BANG_EQUAL]     = {NULL, binary, PREC_EQUALITY},
-        [TK_EQUAL]          = {NULL, NULL, PREC_NONE},
-        [TK_PLUS_EQUAL]     = {NULL, NULL, PREC_NONE},
-        [TK_MINUS_EQUAL]    = {NULL, NULL, PREC_NONE},
-        [TK_STAR_EQUAL]     = {NULL, NULL, PREC_NONE},
-        [TK_SLASH_EQUAL]    = {NULL, NULL, PREC_NONE},
-        [TK_PERCENT_EQUAL]  = {NULL, NULL, PREC_NONE},
-        [TK_EQUAL_EQUAL]    = {NULL, binary, PREC_EQUALITY},
-        [TK_GREATER]        = {NULL, binary, PREC_COMPARISON},
-        [TK_GREATER_EQUAL]  = {NULL, binary, PREC_COMPARISON},
-        [TK_LESS]           = {NULL, binary, PREC_COMPARISON},
-        [TK_LESS_EQUAL]     = {NULL, binary, PREC_COMPARISON},
-        [TK_IDENTIFIER]     = {variable, NULL, PREC_NONE},
-        [TK_STRING]         = {string, NULL, PREC_NONE},
-        [TK_NUMBER]         = {number, NULL, PREC_NONE},
-        [TK_AND]            = {NULL, and_, PREC_AND},
-        [TK_CLASS]          = {NULL, NULL, PREC_NONE},
-        [TK_ELSE]           = {NULL, NULL, PREC_NONE},
-        [TK_FALSE]          = {literal, NULL, PREC_NONE},
-        [TK_FN]             = {NULL, NULL, PREC_NONE},
-        [TK_FOR]            = {NULL, NULL, PREC_NONE},
-        [TK_IF]             = {NULL, NULL, PREC_NONE},
-        [TK_NIL]            = {literal, NULL, PREC_NONE}, // TODO: Rename to TK_NULL
-        [TK_OR]             = {NULL, or_, PREC_OR},
-        [TK_PRINTLN]        = {NULL, NULL, PREC_NONE},
-        [TK_RETURN]         = {NULL, NULL, PREC_NONE},
-        [TK_SUPER]          = {NULL, NULL, PREC_NONE},
-        [TK_SELF]           = {NULL, NULL, PREC_NONE},
-        [TK_TRUE]           = {literal, NULL, PREC_NONE},
-        [TK_LET]            = {NULL, NULL, PREC_NONE},
-        [TK_WHILE]          = {NULL, NULL, PREC_NONE},
-        [TK_ERROR]          = {NULL, NULL, PREC_NONE},
-        [TK_EOF]            = {NULL, NULL, PREC_NONE}
-};
+    location = &program[count - 1].tree->token;
+    ObjFunction *function = end_compiler();
+    free_table(&script_functions);
+    free_table(&script_globals);
+    free_ast_arena(&ast);
+    free_program();
+    location = NULL;
+    return parser.had_error ? NULL : function;
+}
 
-static ParseRule *get_rule(TokenType type) {
-    return &rules[type];
+ObjFunction *compile(const char *source, const char *path) {
+    return compile_program(&source, path != NULL ? &path : NULL, 1, 1);
 }
 
-ObjFunction *compile(const char *source) {
-    initialize_lexer(source);
+bool compile_deferred_function(ObjFunction *target) {
+    // a compilation aborted by an out-of-memory error may have left a stale
+    // compiler and tree behind
+    current = NULL;
+    unreachable_depth = 0;
+    free_ast_arena(&ast);
 
-    // initialize the compiler
-    Compiler compiler;
-    initialize_compiler(&compiler, TYPE_SCRIPT);
+    begin_parse(target->source, target->path, target->source_line);
 
-//    compiling_module = module;
+    Token name = {TK_IDENTIFIER, target->name->chars, target->name->length, target->source_line};
+    Node *node = function(name, false);
 
-    parser.had_error = false;
-    parser.panic_mode = false;
+    if (!parser.had_error) {
+        if (vm.optimization_level > 0) {
+            optimize(node, &ast);
+        }
 
-    advance();
+        Compiler compiler;
+        initialize_compiler(&compiler, TYPE_FUNCTION, &node->token, target);
+        generate_function_body(node);
+        end_compiler();
+    }
 
-    while (!match(TK_EOF)) {
-        declaration();
+    free_ast_arena(&ast);
+    free_token_buffer(&tokens);
+    location = NULL;
+
+    if (parser.had_error) {
+        // the function stays deferred, the next call reports the errors again
+        free_module(&target->module);
+        return false;
     }
 
-    ObjFunction *function = end_compiler();
-    return parser.had_error ? NULL : function;
-}
\ No newline at end of file
+    FREE_ARRAY(char, target->source, target->source_length + 1);
+    target->source = NULL;
+    return true;
+}
@@ -1,87 +1,125 @@
-#include <stdio.h>
-
 #include "debug.h"
+#include "output.h"
 
 void disassemble_module(Module* module, const char* name) {
-    printf("=== %s ===\n", name);
+    print_output("=== %s ===\n", name);
 
     for (uint32_t offset = 0; offset < module->count;) {
         offset = disassemble_instruction(module, offset);
     }
 }
 
+// Read an operand of the given number of bytes, most significant byte first.
+static uint32_t read_operand(Module* module, int offset, int length) {
+    uint32_t operand = 0;
+    for (int i = 0; i < length; i++) {
+        operand = operand << 8 | module->code[offset + i];
+    }
+    return operand;
+}
+
+// Print the name of an instruction, marking the ones with the OP_WIDE prefix.
+static void print_name(const char* name, bool wide) {
+    print_output(wide ? "wide %-11s" : "%-16s", name);
+}
+
 static int simple_instruction(const char* name, int offset) {
     // Print the name of the instruction.
-    printf("%s\n", name);
+    print_output("%s\n", name);
     // Return the offset of the next instruction in the module's array of instructions.
     return offset + 1;
 }
 
-static int constant_instruction(const char* name, Module* module, int offset) {
-    // Get the index of the constant value from the next byte in the module's array of instructions.
-    uint8_t constant = module->code[offset + 1];
+static int constant_instruction(const char* name, Module* module, int offset, bool wide) {
+    // Get the index of the constant value from the operand, one byte or three after OP_WIDE.
+    int length = wide ? 3 : 1;
+    uint32_t constant = read_operand(module, offset + 1, length);
 
     // Print the constant value and its index in the array of values.
-    printf("%-16s %4d '", name, constant);
+    print_name(name, wide);
+    print_output(" %4u '", constant);
     print_value(module->constants.values[constant]);
-    printf("'\n");
+    print_output("'\n");
 
     // Return the offset of the next instruction in the module's array of instructions.
-    return offset + 2;
+    return offset + 1 + length;
 }
 
-static int jump_instruction(const char* name, int sign, Module* module, int offset) {
-    // Read in the two bytes of the jump offset.
-    uint16_t jump = (uint16_t)(module->code[offset + 1] << 8);
-    jump |= module->code[offset + 2];
+static int jump_instruction(const char* name, int sign, Module* module, int offset, bool wide) {
+    // Read in the jump offset, two bytes or four after OP_WIDE.
+    int length = wide ? 4 : 2;
+    uint32_t jump = read_operand(module, offset + 1, length);
 
-    // Print the jump offset and the target of the jump.
-    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    // Print the jump offset and the target of the jump. A wide instruction
+    // starts at its prefix.
+    int start = wide ? offset - 1 : offset;
+    int end = offset + 1 + length;
+    print_name(name, wide);
+    print_output(" %4d -> %lld\n", start, (long long) end + sign * (long long) jump);
 
     // Return the offset of the next instruction in the module's array of instructions.
-    return offset + 3;
+    return end;
 }
 
-static int list_instruction(const char* name, Module* module, int offset) {
-    // Get the index of the constant value from the next byte in the module's array of instructions.
-    uint8_t constant = module->code[offset + 1];
+static int callee_jump_instruction(const char* name, Module* module, int offset, bool wide) {
+    // Read in the function's constant index, then the jump offset.
+    int index_length = wide ? 3 : 1;
+    int jump_length = wide ? 4 : 2;
+    uint32_t constant = read_operand(module, offset + 1, index_length);
+    uint32_t jump = read_operand(module, offset + 1 + index_length, jump_length);
 
-    // Print the constant value and its index in the array of values.
-    printf("%-16s %4d '", name, constant);
+    int start = wide ? offset - 1 : offset;
+    int end = offset + 1 + index_length + jump_length;
+    print_name(name, wide);
+    print_output(" %4u '", constant);
     print_value(module->constants.values[constant]);
-    printf("'\n");
+    print_output("' %d -> %lld\n", start, (long long) end + jump);
+
+    return end;
+}
+
+static int byte_instruction(const char* name, Module* module, int offset, bool wide) {
+    // Print the operand: a stack slot, an argument count or an item count.
+    int length = wide ? 3 : 1;
+    print_name(name, wide);
+    print_output(" %4u\n", read_operand(module, offset + 1, length));
 
     // Return the offset of the next instruction in the module's array of instructions.
-    return offset + 2;
+    return offset + 1 + length;
 }
 
 int disassemble_instruction(Module* module, uint32_t offset) {
-    printf("%04d ", offset);
+    print_output("%04d ", offset);
     // Print the line number if the current instruction is on the same line as the previous instruction.
-    if (offset > 0 && module->lines[offset] == module->lines[offset - 1]) {
-        printf("   | ");
+    int line = get_line(module, offset);
+    if (offset > 0 && line == get_line(module, offset - 1)) {
+        print_output("   | ");
     } else {
-        printf("%4d ", module->lines[offset]);
+        print_output("%4d ", line);
     }
 
+    // the instruction after an OP_WIDE prefix is printed with its wide operand
+    bool wide = module->code[offset] == OP_WIDE;
+    if (wide) offset++;
+
     uint8_t instruction = module->code[offset];
     switch (instruction) {
         case OP_PRINTLN:
             return simple_instruction("println", (int)offset);
         case OP_JUMP:
-            return jump_instruction("jmp", 1, module, (int)offset);
+            return jump_instruction("jmp", 1, module, (int)offset, wide);
         case OP_JUMP_IF_FALSE:
-            return jump_instruction("jmp_fal", 1, module, (int)offset);
+            return jump_instruction("jmp_fal", 1, module, (int)offset, wide);
         case OP_JUMP_IF_TRUE:
-            return jump_instruction("jmp_tru", 1, module, (int)offset);
+            return jump_instruction("jmp_tru", 1, module, (int)offset, wide);
         case OP_LOOP:
-            return jump_instruction("loop", -1, module, (int)offset);
+            return jump_instruction("loop", -1, module, (int)offset, wide);
         case OP_CALL:
-            return constant_instruction("call", module, (int)offset);
+            return byte_instruction("call", module, (int)offset, wide);
         case OP_RETURN:
             return simple_instruction("return", (int)offset);
         case OP_CONSTANT:
-            return constant_instruction("ld_const", module, (int)offset);
+            return constant_instruction("ld_const", module, (int)offset, wide);
         case OP_NIL:
             return simple_instruction("nil", (int)offset);
         case OP_TRUE:
@@ -90,16 +128,20 @@ int disassemble_instruction(Module* module, uint32_t offset) {
             return simple_instruction("fal", (int)offset);
         case OP_POP:
             return simple_instruction("pop", (int)offset);
+        case OP_POPN:
+            return byte_instruction("pop_n", module, (int)offset, wide);
         case OP_GET_LOCAL:
-            return constant_instruction("get_loc", module, (int)offset);
+            return byte_instruction("get_loc", module, (int)offset, wide);
         case OP_SET_LOCAL:
-            return constant_instruction("set_loc", module, (int)offset);
+            return byte_instruction("set_loc", module, (int)offset, wide);
         case OP_GET_GLOBAL:
-            return constant_instruction("get_glo", module, (int)offset);
+            return constant_instruction("get_glo", module, (int)offset, wide);
         case OP_DEFINE_GLOBAL:
-            return constant_instruction("def_glo", module, (int)offset);
+            return constant_instruction("def_glo", module, (int)offset, wide);
         case OP_SET_GLOBAL:
-            return constant_instruction("set_glo", module, (int)offset);
+            return constant_instruction("set_glo", module, (int)offset, wide);
+        case OP_IMPORT:
+            return constant_instruction("import", module, (int)offset, wide);
         case OP_EQUAL:
             return simple_instruction("equ", (int)offset);
         case OP_GREATER:
@@ -108,6 +150,30 @@ int disassemble_instruction(Module* module, uint32_t offset) {
             return simple_instruction("less", (int)offset);
         case OP_LESS_EQUAL:
             return simple_instruction("less_eq", (int)offset);
+        case OP_GREATER_EQUAL:
+            return simple_instruction("grt_eq", (int)offset);
+        case OP_NOT_EQUAL:
+            return simple_instruction("not_equ", (int)offset);
+        case OP_ADD_NN:
+            return simple_instruction("add_nn", (int)offset);
+        case OP_SUBTRACT_NN:
+            return simple_instruction("sub_nn", (int)offset);
+        case OP_MULTIPLY_NN:
+            return simple_instruction("mul_nn", (int)offset);
+        case OP_DIVIDE_NN:
+            return simple_instruction("div_nn", (int)offset);
+        case OP_GREATER_NN:
+            return simple_instruction("grt_nn", (int)offset);
+        case OP_LESS_NN:
+            return simple_instruction("less_nn", (int)offset);
+        case OP_LESS_EQUAL_NN:
+            return simple_instruction("less_eq_nn", (int)offset);
+        case OP_GREATER_EQUAL_NN:
+            return simple_instruction("grt_eq_nn", (int)offset);
+        case OP_ADD_LOCAL_NN:
+            return byte_instruction("add_loc_nn", module, (int)offset, wide);
+        case OP_SUBTRACT_LOCAL_NN:
+            return byte_instruction("sub_loc_nn", module, (int)offset, wide);
         case OP_ADD:
             return simple_instruction("add", (int)offset);
         case OP_SUBTRACT:
@@ -116,12 +182,14 @@ int disassemble_instruction(Module* module, uint32_t offset) {
             return simple_instruction("mul", (int)offset);
         case OP_DIVIDE:
             return simple_instruction("div", (int)offset);
+        case OP_MODULO:
+            return simple_instruction("mod", (int)offset);
         case OP_NOT:
             return simple_instruction("not", (int)offset);
         case OP_NEGATE:
             return simple_instruction("neg", (int)offset);
         case OP_BUILD_LIST:
-            return list_instruction("bld_lst", module, (int)offset);
+            return byte_instruction("bld_lst", module, (int)offset, wide);
         case OP_INDEX_LIST:
             return simple_instruction("idx_lst", (int)offset);
         case OP_STORE_LIST:
@@ -130,6 +198,8 @@ int disassemble_instruction(Module* module, uint32_t offset) {
             return simple_instruction("bld_rng", (int)offset);
         case OP_GET_LIST_LENGTH:
             return simple_instruction("len_lst", (int)offset);
+        case OP_SLICE_LIST:
+            return simple_instruction("slc_lst", (int)offset);
         case OP_INCREMENT:
             return simple_instruction("inc", (int)offset);
         case OP_RANGE_START:
@@ -140,8 +210,18 @@ int disassemble_instruction(Module* module, uint32_t offset) {
             return simple_instruction("inc_rng", (int)offset);
         case OP_DUPLICATE:
             return simple_instruction("dup", (int)offset);
+        case OP_GET_REGISTER:
+            return simple_instruction("get_reg", (int)offset);
+        case OP_SET_REGISTER:
+            return simple_instruction("set_reg", (int)offset);
+        case OP_JUMP_IF_CALLEE:
+            return callee_jump_instruction("jmp_cal", module, (int)offset, wide);
+        case OP_PEEK:
+            return byte_instruction("peek", module, (int)offset, wide);
+        case OP_POP_UNDER:
+            return byte_instruction("pop_und", module, (int)offset, wide);
         default:
-            printf("Unknown opcode %d\n", instruction);
+            print_output("Unknown opcode %d\n", instruction);
             return (int)offset + 1;
     }
 }
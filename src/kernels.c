@@ -0,0 +1,389 @@
+#include <math.h>
+#include <string.h>
+
+#include "kernels.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// AVX2 kernels are compiled for x86 whatever the target of the build, and
+// only called once the CPU is known to support them.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_AVX2
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// The number of lanes sums, dot products, minimums and maximums are
+// accumulated in: four SSE2 registers, or two AVX2 registers.
+#define LANES 8
+
+Kernels kernels;
+
+static double combine_sums(const double lanes[LANES]) {
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+// x < least ? x : least, which is also what MINPD computes for x and least
+static double least(double x, double least) {
+    return x < least ? x : least;
+}
+
+static double greatest(double x, double greatest) {
+    return x > greatest ? x : greatest;
+}
+
+static double combine_least(const double lanes[LANES], const double *rest, size_t count) {
+    double result = INFINITY;
+    for (int lane = 0; lane < LANES; lane++) result = least(lanes[lane], result);
+    for (size_t i = 0; i < count; i++) result = least(rest[i], result);
+    return result;
+}
+
+static double combine_greatest(const double lanes[LANES], const double *rest, size_t count) {
+    double result = -INFINITY;
+    for (int lane = 0; lane < LANES; lane++) result = greatest(lanes[lane], result);
+    for (size_t i = 0; i < count; i++) result = greatest(rest[i], result);
+    return result;
+}
+
+static double sum_plain(const double *values, size_t count) {
+    double lanes[LANES] = {0};
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        for (int lane = 0; lane < LANES; lane++) lanes[lane] += values[i + lane];
+    }
+
+    double sum = combine_sums(lanes);
+    for (; i < count; i++) sum += values[i];
+    return sum;
+}
+
+static double dot_plain(const double *a, const double *b, size_t count) {
+    double lanes[LANES] = {0};
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        for (int lane = 0; lane < LANES; lane++) lanes[lane] += a[i + lane] * b[i + lane];
+    }
+
+    double sum = combine_sums(lanes);
+    for (; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static double min_plain(const double *values, size_t count) {
+    double lanes[LANES];
+    for (int lane = 0; lane < LANES; lane++) lanes[lane] = INFINITY;
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        for (int lane = 0; lane < LANES; lane++) lanes[lane] = least(values[i + lane], lanes[lane]);
+    }
+    return combine_least(lanes, values + i, count - i);
+}
+
+static double max_plain(const double *values, size_t count) {
+    double lanes[LANES];
+    for (int lane = 0; lane < LANES; lane++) lanes[lane] = -INFINITY;
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        for (int lane = 0; lane < LANES; lane++) lanes[lane] = greatest(values[i + lane], lanes[lane]);
+    }
+    return combine_greatest(lanes, values + i, count - i);
+}
+
+static void scale_plain(double *values, size_t count, double factor) {
+    for (size_t i = 0; i < count; i++) values[i] *= factor;
+}
+
+static void add_plain(double *a, const double *b, size_t count) {
+    for (size_t i = 0; i < count; i++) a[i] += b[i];
+}
+
+static size_t count_less_plain(const double *values, size_t count, double bound) {
+    size_t result = 0;
+    for (size_t i = 0; i < count; i++) result += values[i] < bound;
+    return result;
+}
+
+static size_t count_greater_plain(const double *values, size_t count, double bound) {
+    size_t result = 0;
+    for (size_t i = 0; i < count; i++) result += values[i] > bound;
+    return result;
+}
+
+static const Kernels plain_kernels = {
+    "plain", sum_plain, dot_plain, min_plain, max_plain, scale_plain, add_plain, count_less_plain,
+    count_greater_plain,
+};
+
+#ifdef __SSE2__
+
+static double sum_sse2(const double *values, size_t count) {
+    __m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd(), sum2 = _mm_setzero_pd(), sum3 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        sum0 = _mm_add_pd(sum0, _mm_loadu_pd(values + i));
+        sum1 = _mm_add_pd(sum1, _mm_loadu_pd(values + i + 2));
+        sum2 = _mm_add_pd(sum2, _mm_loadu_pd(values + i + 4));
+        sum3 = _mm_add_pd(sum3, _mm_loadu_pd(values + i + 6));
+    }
+
+    double lanes[LANES];
+    _mm_storeu_pd(lanes, sum0);
+    _mm_storeu_pd(lanes + 2, sum1);
+    _mm_storeu_pd(lanes + 4, sum2);
+    _mm_storeu_pd(lanes + 6, sum3);
+    double sum = combine_sums(lanes);
+    for (; i < count; i++) sum += values[i];
+    return sum;
+}
+
+static double dot_sse2(const double *a, const double *b, size_t count) {
+    __m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd(), sum2 = _mm_setzero_pd(), sum3 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+        sum2 = _mm_add_pd(sum2, _mm_mul_pd(_mm_loadu_pd(a + i + 4), _mm_loadu_pd(b + i + 4)));
+        sum3 = _mm_add_pd(sum3, _mm_mul_pd(_mm_loadu_pd(a + i + 6), _mm_loadu_pd(b + i + 6)));
+    }
+
+    double lanes[LANES];
+    _mm_storeu_pd(lanes, sum0);
+    _mm_storeu_pd(lanes + 2, sum1);
+    _mm_storeu_pd(lanes + 4, sum2);
+    _mm_storeu_pd(lanes + 6, sum3);
+    double sum = combine_sums(lanes);
+    for (; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static double min_sse2(const double *values, size_t count) {
+    __m128d least0 = _mm_set1_pd(INFINITY), least1 = least0, least2 = least0, least3 = least0;
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        least0 = _mm_min_pd(_mm_loadu_pd(values + i), least0);
+        least1 = _mm_min_pd(_mm_loadu_pd(values + i + 2), least1);
+        least2 = _mm_min_pd(_mm_loadu_pd(values + i + 4), least2);
+        least3 = _mm_min_pd(_mm_loadu_pd(values + i + 6), least3);
+    }
+
+    double lanes[LANES];
+    _mm_storeu_pd(lanes, least0);
+    _mm_storeu_pd(lanes + 2, least1);
+    _mm_storeu_pd(lanes + 4, least2);
+    _mm_storeu_pd(lanes + 6, least3);
+    return combine_least(lanes, values + i, count - i);
+}
+
+static double max_sse2(const double *values, size_t count) {
+    __m128d greatest0 = _mm_set1_pd(-INFINITY), greatest1 = greatest0, greatest2 = greatest0, greatest3 = greatest0;
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        greatest0 = _mm_max_pd(_mm_loadu_pd(values + i), greatest0);
+        greatest1 = _mm_max_pd(_mm_loadu_pd(values + i + 2), greatest1);
+        greatest2 = _mm_max_pd(_mm_loadu_pd(values + i + 4), greatest2);
+        greatest3 = _mm_max_pd(_mm_loadu_pd(values + i + 6), greatest3);
+    }
+
+    double lanes[LANES];
+    _mm_storeu_pd(lanes, greatest0);
+    _mm_storeu_pd(lanes + 2, greatest1);
+    _mm_storeu_pd(lanes + 4, greatest2);
+    _mm_storeu_pd(lanes + 6, greatest3);
+    return combine_greatest(lanes, values + i, count - i);
+}
+
+static void scale_sse2(double *values, size_t count, double factor) {
+    __m128d by = _mm_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_pd(values + i, _mm_mul_pd(_mm_loadu_pd(values + i), by));
+        _mm_storeu_pd(values + i + 2, _mm_mul_pd(_mm_loadu_pd(values + i + 2), by));
+    }
+    for (; i < count; i++) values[i] *= factor;
+}
+
+static void add_sse2(double *a, const double *b, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_pd(a + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        _mm_storeu_pd(a + i + 2, _mm_add_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    for (; i < count; i++) a[i] += b[i];
+}
+
+// The comparisons of eight elements with a bound make a byte of mask bits,
+// which are counted at once.
+static size_t count_less_sse2(const double *values, size_t count, double bound) {
+    __m128d with = _mm_set1_pd(bound);
+    size_t result = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        int mask = _mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd(values + i), with)) |
+                   _mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd(values + i + 2), with)) << 2 |
+                   _mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd(values + i + 4), with)) << 4 |
+                   _mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd(values + i + 6), with)) << 6;
+        result += (size_t) __builtin_popcount((unsigned) mask);
+    }
+    return result + count_less_plain(values + i, count - i, bound);
+}
+
+static size_t count_greater_sse2(const double *values, size_t count, double bound) {
+    __m128d with = _mm_set1_pd(bound);
+    size_t result = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        int mask = _mm_movemask_pd(_mm_cmpgt_pd(_mm_loadu_pd(values + i), with)) |
+                   _mm_movemask_pd(_mm_cmpgt_pd(_mm_loadu_pd(values + i + 2), with)) << 2 |
+                   _mm_movemask_pd(_mm_cmpgt_pd(_mm_loadu_pd(values + i + 4), with)) << 4 |
+                   _mm_movemask_pd(_mm_cmpgt_pd(_mm_loadu_pd(values + i + 6), with)) << 6;
+        result += (size_t) __builtin_popcount((unsigned) mask);
+    }
+    return result + count_greater_plain(values + i, count - i, bound);
+}
+
+static const Kernels sse2_kernels = {
+    "sse2", sum_sse2, dot_sse2, min_sse2, max_sse2, scale_sse2, add_sse2, count_less_sse2, count_greater_sse2,
+};
+
+#endif
+
+#ifdef KERNELS_AVX2
+
+TARGET_AVX2 static double sum_avx2(const double *values, size_t count) {
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(values + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(values + i + 4));
+    }
+
+    double lanes[LANES];
+    _mm256_storeu_pd(lanes, sum0);
+    _mm256_storeu_pd(lanes + 4, sum1);
+    double sum = combine_sums(lanes);
+    for (; i < count; i++) sum += values[i];
+    return sum;
+}
+
+// products are rounded before they are added, as in the other versions: the
+// target does not include FMA, so the compiler cannot fuse them
+TARGET_AVX2 static double dot_avx2(const double *a, const double *b, size_t count) {
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+
+    double lanes[LANES];
+    _mm256_storeu_pd(lanes, sum0);
+    _mm256_storeu_pd(lanes + 4, sum1);
+    double sum = combine_sums(lanes);
+    for (; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+TARGET_AVX2 static double min_avx2(const double *values, size_t count) {
+    __m256d least0 = _mm256_set1_pd(INFINITY), least1 = least0;
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        least0 = _mm256_min_pd(_mm256_loadu_pd(values + i), least0);
+        least1 = _mm256_min_pd(_mm256_loadu_pd(values + i + 4), least1);
+    }
+
+    double lanes[LANES];
+    _mm256_storeu_pd(lanes, least0);
+    _mm256_storeu_pd(lanes + 4, least1);
+    return combine_least(lanes, values + i, count - i);
+}
+
+TARGET_AVX2 static double max_avx2(const double *values, size_t count) {
+    __m256d greatest0 = _mm256_set1_pd(-INFINITY), greatest1 = greatest0;
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        greatest0 = _mm256_max_pd(_mm256_loadu_pd(values + i), greatest0);
+        greatest1 = _mm256_max_pd(_mm256_loadu_pd(values + i + 4), greatest1);
+    }
+
+    double lanes[LANES];
+    _mm256_storeu_pd(lanes, greatest0);
+    _mm256_storeu_pd(lanes + 4, greatest1);
+    return combine_greatest(lanes, values + i, count - i);
+}
+
+TARGET_AVX2 static void scale_avx2(double *values, size_t count, double factor) {
+    __m256d by = _mm256_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_pd(values + i, _mm256_mul_pd(_mm256_loadu_pd(values + i), by));
+        _mm256_storeu_pd(values + i + 4, _mm256_mul_pd(_mm256_loadu_pd(values + i + 4), by));
+    }
+    for (; i < count; i++) values[i] *= factor;
+}
+
+TARGET_AVX2 static void add_avx2(double *a, const double *b, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_pd(a + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        _mm256_storeu_pd(a + i + 4, _mm256_add_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    for (; i < count; i++) a[i] += b[i];
+}
+
+TARGET_AVX2 static size_t count_less_avx2(const double *values, size_t count, double bound) {
+    __m256d with = _mm256_set1_pd(bound);
+    size_t result = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(values + i), with, _CMP_LT_OQ)) |
+                   _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(values + i + 4), with, _CMP_LT_OQ)) << 4;
+        result += (size_t) __builtin_popcount((unsigned) mask);
+    }
+    return result + count_less_plain(values + i, count - i, bound);
+}
+
+TARGET_AVX2 static size_t count_greater_avx2(const double *values, size_t count, double bound) {
+    __m256d with = _mm256_set1_pd(bound);
+    size_t result = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(values + i), with, _CMP_GT_OQ)) |
+                   _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(values + i + 4), with, _CMP_GT_OQ)) << 4;
+        result += (size_t) __builtin_popcount((unsigned) mask);
+    }
+    return result + count_greater_plain(values + i, count - i, bound);
+}
+
+static const Kernels avx2_kernels = {
+    "avx2", sum_avx2, dot_avx2, min_avx2, max_avx2, scale_avx2, add_avx2, count_less_avx2, count_greater_avx2,
+};
+
+#endif
+
+bool select_kernels(const char *name) {
+    if (strcmp(name, "plain") == 0) {
+        kernels = plain_kernels;
+        return true;
+    }
+#ifdef __SSE2__
+    if (strcmp(name, "sse2") == 0) {
+        kernels = sse2_kernels;
+        return true;
+    }
+#endif
+#ifdef KERNELS_AVX2
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        kernels = avx2_kernels;
+        return true;
+    }
+#endif
+    return false;
+}
+
+void initialize_kernels() {
+    if (!select_kernels("avx2") && !select_kernels("sse2")) select_kernels("plain");
+}
@@ -1,91 +1,350 @@
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "arena.h"
 #include "common.h"
+#include "kernels.h"
+#include "lexer.h"
 #include "module.h"
+#include "output.h"
 #include "debug.h"
+#include "snapshot.h"
+#include "source.h"
 #include "vm.h"
 
 // TODO: Investigate error recovery strategies
 
-#define MAX_LINE_LENGTH 1024
+// Whether a chunk of input can be run: every bracket it opens is closed, and
+// every string it starts ends. The chunk is continued on the next line
+// otherwise, which lets a function be typed over several lines.
+static bool input_complete(const char *chunk) {
+    initialize_lexer(chunk);
 
+    int depth = 0;
+    for (Token token = lex_token(); token.type != TK_EOF; token = lex_token()) {
+        switch (token.type) {
+            case TK_LPAREN:
+            case TK_LBRACE:
+            case TK_LBRACKET:
+                depth++;
+                break;
+            case TK_RPAREN:
+            case TK_RBRACE:
+            case TK_RBRACKET:
+                depth--;
+                break;
+            case TK_ERROR:
+                // a string is only unterminated at the end of the input
+                if (strcmp(token.start, "Unterminated string.") == 0) return false;
+                break;
+            default:
+                break;
+        }
+    }
+
+    // too many closing brackets is an error the compiler reports
+    return depth <= 0;
+}
+
+// Read, compile and run chunks of input. Each chunk is compiled on its own,
+// as a script that shares the globals of those before it: the functions they
+// declared are called, and inlined, as they were compiled, and the code of a
+// chunk is garbage once it has run. Lines can be of any length.
 static void repl() {
-    char line[MAX_LINE_LENGTH];
+    char *line = NULL;
+    size_t line_capacity = 0;
+
+    // the chunk being typed, kept across chunks so that its buffer is reused
+    char *chunk = NULL;
+    size_t chunk_length = 0;
+    size_t chunk_capacity = 0;
+
     for (;;) {
-        printf("protoslang> ");
-        if (!fgets(line, MAX_LINE_LENGTH, stdin)) {
-            printf("\n");
+        // the prompt goes out with whatever the last chunk printed
+        write_output(chunk_length == 0 ? "protoslang> " : "        ... ", 12);
+        flush_output();
+
+        ssize_t length = getline(&line, &line_capacity, stdin);
+        if (length < 0) {
+            end_output_line();
+            // report the errors in an unfinished chunk
+            if (chunk_length > 0) interpret(chunk);
             break;
         }
 
-        interpret(line);
+        if (chunk_length + (size_t) length + 1 > chunk_capacity) {
+            chunk_capacity = (chunk_length + (size_t) length + 1) * 2;
+            chunk = (char *)realloc(chunk, chunk_capacity);
+            if (chunk == NULL) {
+                fprintf(stderr, "Not enough memory to read the input.\n");
+                exit(74);
+            }
+        }
+        memcpy(chunk + chunk_length, line, (size_t) length + 1);
+        chunk_length += (size_t) length;
+
+        if (!input_complete(chunk)) continue;
+
+        interpret(chunk);
+        chunk_length = 0;
     }
-}
 
-static char *read_file(const char *path) {
-    // open the file
-    FILE *file = fopen(path, "rb");
+    free(line);
+    free(chunk);
+}
 
-    // check if the file was opened successfully
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+// Load a script, or exit if it cannot be.
+static void read_file(const char *path, Source *source) {
+    switch (load_source(path, source)) {
+        case SOURCE_OK:
+            return;
+        case SOURCE_NOT_FOUND:
+            fprintf(stderr, "Could not open file \"%s\".\n", path);
+            exit(74);
+        case SOURCE_UNREADABLE:
+            fprintf(stderr, "Could not read file \"%s\".\n", path);
+            exit(74);
     }
+}
 
-    // seek to the end of the file to determine its size
-    fseek(file, 0L, SEEK_END);
-    size_t file_size = ftell(file);
-    rewind(file);
+static const char *snapshot_path = NULL;
 
-    // allocate memory for the source code
-    char *source = (char *)malloc(file_size + 1);
-    if (source == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+static void run_files(const char **paths, int count) {
+    // load the source code from the specified files
+    Source *files = (Source *)malloc(sizeof(Source) * count);
+    const char **sources = (const char **)malloc(sizeof(char *) * count);
+    if (files == NULL || sources == NULL) {
+        fprintf(stderr, "Not enough memory to read the scripts.\n");
         exit(74);
     }
+    for (int i = 0; i < count; i++) {
+        read_file(paths[i], &files[i]);
+        sources[i] = files[i].chars;
+    }
 
-    // get the number of bytes read and check for errors
-    size_t bytes_read = fread(source, sizeof(char), file_size, file);
-    if (bytes_read < file_size) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+    // interpret the source code, the scripts run as one program in the order given
+    InterpretResult result = interpret_program(sources, paths, count);
+    for (int i = 0; i < count; i++) {
+        unload_source(&files[i]);
+    }
+    free(sources);
+    free(files);
+
+    // snapshot the heap the script left behind
+    if (snapshot_path != NULL && !write_heap_snapshot(snapshot_path)) {
+        fprintf(stderr, "Could not write heap snapshot to \"%s\".\n", snapshot_path);
     }
 
-    // insert a null terminator at the end of the source code
-    source[bytes_read] = '\0';
+    // check the result of the interpretation
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+// Lex a file over and over for half a second, and print the throughput.
+static void bench_lexer(const char *path) {
+    Source file;
+    read_file(path, &file);
+    const char *source = file.chars;
+    size_t size = file.length;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    // close the file
-    fclose(file);
+    long passes = 0;
+    long tokens = 0;
+    double seconds;
+    do {
+        initialize_lexer(source);
+        for (Token token = lex_token(); token.type != TK_EOF; token = lex_token()) tokens++;
+        passes++;
 
-    return source;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seconds = (double) (now.tv_sec - start.tv_sec) + (double) (now.tv_nsec - start.tv_nsec) / 1e9;
+    } while (seconds < 0.5);
+
+    printf("%zu bytes, %ld tokens: %.1f MB/s\n", size, tokens / passes, (double) size * passes / seconds / 1e6);
+    unload_source(&file);
 }
 
-static void run_file(const char *path) {
-    // load the source code from the specified file
-    char *source = read_file(path);
+static void on_snapshot_signal(int signal) {
+    (void) signal;
+    request_heap_snapshot();
+}
 
-    // interpret the source code
-    InterpretResult result = interpret(source);
-    free(source);
+static void usage() {
+    fprintf(stderr, "Usage: protoslang [options] [path...]\n"
+                    "Options:\n"
+                    "  -O0, -O1               disable or enable optimization of the syntax tree (default -O1)\n"
+                    "  --print-code           disassemble each function as it is compiled\n"
+                    "  --eager                compile every function up front instead of on its first call\n"
+                    "  --prelex               split each script into tokens before parsing it\n"
+                    "  --compile-threads <n>  parse the scripts given on n threads (default: one per core)\n"
+                    "  --compile-stats        print the time compiling takes\n"
+                    "  --module-path <dir>    search dir for imported modules before the current directory\n"
+                    "  --gc-incremental       collect garbage in bounded slices\n"
+                    "  --gc-max-pause-us <n>  pause budget of an incremental slice (implies --gc-incremental)\n"
+                    "  --gc-threads <n>       mark and sweep full collections on n threads\n"
+                    "  --gc-stats             print the collector's pause histogram on exit\n"
+                    "  --heap-limit <size>    fail allocations that would grow the heap past size\n"
+                    "  --heap-soft-limit <size>  collect whenever the heap grows past size\n"
+                    "  --heap-huge-pages      back the heap with transparent huge pages\n"
+                    "  --mem-stats            print heap accounting counters on exit\n"
+                    "  --heap-snapshot <file> write a heap snapshot when the script finishes\n"
+                    "  --summarize-heap <file>  print the top types and dominators of a snapshot\n"
+                    "  --bench-lexer <file>   print how fast the file is split into tokens\n"
+                    "  --kernels <name>       run array natives with the plain, sse2 or avx2 kernels\n"
+                    "Sending SIGUSR1 writes a heap snapshot to protoslang-<pid>-<n>.heapsnapshot.\n"
+                    "Sizes are in bytes, or suffixed with k, m or g.\n");
+    exit(64);
+}
 
-    // check the result of the interpretation
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+// Parse a byte count with an optional k, m or g suffix.
+static size_t parse_size(const char *text) {
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
+
+    switch (*end) {
+        case 'k': case 'K': size <<= 10; end++; break;
+        case 'm': case 'M': size <<= 20; end++; break;
+        case 'g': case 'G': size <<= 30; end++; break;
+        default: break;
+    }
+
+    if (*end != '\0' || size == 0) usage();
+    return (size_t) size;
+}
+
+static bool print_gc = false;
+static bool print_memory = false;
+
+// Print the statistics asked for, once. They describe the heap, so they must
+// be printed while the VM still holds it.
+static void print_stats() {
+    if (print_gc) print_gc_stats();
+    if (print_memory) print_memory_stats();
+    print_gc = false;
+    print_memory = false;
 }
 
 int main(int argc, const char* argv[]) {
     initialize_vm();
 
-    if (argc == 1) {
+    const char **paths = (const char **)malloc(sizeof(char *) * argc);
+    int path_count = 0;
+    const char **module_paths = (const char **)malloc(sizeof(char *) * argc);
+    if (paths == NULL || module_paths == NULL) exit(1);
+    vm.module_paths = module_paths;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0) {
+            vm.optimization_level = argv[i][2] - '0';
+        } else if (strcmp(argv[i], "--print-code") == 0) {
+            vm.print_code = true;
+        } else if (strcmp(argv[i], "--eager") == 0) {
+            vm.defer_functions = false;
+        } else if (strcmp(argv[i], "--prelex") == 0) {
+            vm.prelex_tokens = true;
+        } else if (strcmp(argv[i], "--compile-threads") == 0) {
+            if (++i == argc) usage();
+
+            char *end;
+            long threads = strtol(argv[i], &end, 10);
+            if (*end != '\0' || threads <= 0 || threads > 256) usage();
+
+            vm.compile_threads = (int) threads;
+        } else if (strcmp(argv[i], "--compile-stats") == 0) {
+            vm.print_compile_time = true;
+        } else if (strcmp(argv[i], "--module-path") == 0) {
+            if (++i == argc) usage();
+            module_paths[vm.module_path_count++] = argv[i];
+        } else if (strcmp(argv[i], "--gc-incremental") == 0) {
+            vm.gc_incremental = true;
+        } else if (strcmp(argv[i], "--gc-max-pause-us") == 0) {
+            if (++i == argc) usage();
+
+            char *end;
+            long pause = strtol(argv[i], &end, 10);
+            if (*end != '\0' || pause <= 0) usage();
+
+            vm.gc_incremental = true;
+            vm.gc_max_pause_us = (uint64_t) pause;
+        } else if (strcmp(argv[i], "--gc-threads") == 0) {
+            if (++i == argc) usage();
+
+            char *end;
+            long threads = strtol(argv[i], &end, 10);
+            if (*end != '\0' || threads <= 0 || threads > 256) usage();
+
+            vm.gc_threads = (int) threads;
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            print_gc = true;
+        } else if (strcmp(argv[i], "--heap-limit") == 0) {
+            if (++i == argc) usage();
+            vm.hard_heap_limit = parse_size(argv[i]);
+        } else if (strcmp(argv[i], "--heap-soft-limit") == 0) {
+            if (++i == argc) usage();
+            vm.soft_heap_limit = parse_size(argv[i]);
+            if (vm.next_gc > vm.soft_heap_limit) vm.next_gc = vm.soft_heap_limit;
+        } else if (strcmp(argv[i], "--heap-huge-pages") == 0) {
+            arena_use_huge_pages(true);
+        } else if (strcmp(argv[i], "--mem-stats") == 0) {
+            print_memory = true;
+        } else if (strcmp(argv[i], "--heap-snapshot") == 0) {
+            if (++i == argc) usage();
+            snapshot_path = argv[i];
+        } else if (strcmp(argv[i], "--summarize-heap") == 0) {
+            // offline mode, nothing is run
+            if (++i == argc) usage();
+            if (!summarize_heap_snapshot(argv[i])) {
+                fprintf(stderr, "Could not read heap snapshot \"%s\".\n", argv[i]);
+                exit(74);
+            }
+            free(paths);
+            free(module_paths);
+            free_vm();
+            return 0;
+        } else if (strcmp(argv[i], "--kernels") == 0) {
+            if (++i == argc || !select_kernels(argv[i])) usage();
+        } else if (strcmp(argv[i], "--bench-lexer") == 0) {
+            // offline mode, nothing is run
+            if (++i == argc) usage();
+            bench_lexer(argv[i]);
+            free(paths);
+            free(module_paths);
+            free_vm();
+            return 0;
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else {
+            paths[path_count++] = argv[i];
+        }
+    }
+
+    // run_files() exits directly on errors, so the statistics are printed, and
+    // the output buffer written, from exit handlers as well
+    atexit(print_stats);
+    atexit(flush_output);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_snapshot_signal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
+
+    if (path_count == 0) {
         repl();
-    } else if (argc == 2) {
-        run_file(argv[1]);
     } else {
-        fprintf(stderr, "Usage: protoslang [path]\n");
-        exit(64);
+        run_files(paths, path_count);
     }
 
+    flush_output();
+    print_stats();
+
+    free(paths);
+    free(module_paths);
     free_vm();
     return 0;
 }
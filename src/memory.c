@@ -1,32 +1,331 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "arena.h"
+#include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+// The number of gray objects traced, or objects swept, between reads of the
+// clock during an incremental slice, and the number of string table entries.
+#define GC_WORK_QUANTUM 64
+#define GC_TABLE_QUANTUM 1024
+
+// The number of bytes the mutator may allocate during a cycle before it is
+// made to perform a slice of collection work itself.
+#define GC_STEP_BYTES (64 * 1024)
+
+// How many times more often the mutator performs slices once the heap has
+// grown past twice the threshold that started the cycle, so that the
+// collector catches up without a pause longer than the budget.
+#define GC_CATCH_UP_RATE 16
+
+// The number of safepoints in run() the mutator passes between slices when it
+// is not allocating. This leaves the mutator most of the time during a cycle.
+#define GC_SAFEPOINT_INTERVAL 4096
+
+// The number of gray objects a marker keeps private before it offers a batch
+// of them to idle markers, and the size of that batch.
+#define GC_STEAL_BATCH 128
+
+// The number of objects in one chunk of a parallel sweep.
+#define GC_SWEEP_CHUNK 4096
+
+// A participant in a parallel collection. The main thread is worker 0.
+typedef struct {
+    // gray objects only this worker pops and pushes
+    Obj** local;
+    int local_count;
+    int local_capacity;
+
+    // gray objects that other workers may steal, guarded by lock
+    pthread_mutex_t lock;
+    Obj** shared;
+    int shared_count;
+    int shared_capacity;
+
+    // bytes freed by this worker during a parallel sweep
+    size_t freed_bytes;
+
+    pthread_t thread;
+} GCWorker;
+
+typedef enum {
+    GC_JOB_MARK,
+    GC_JOB_SWEEP,
+} GCJob;
+
+// The surviving objects of one sweep chunk, in list order.
+typedef struct {
+    Obj* first;
+    Obj* last;
+} SweepChunk;
+
+// The pool of helper threads used by parallel collections. It is started on
+// the first parallel collection and lives until the VM is freed.
+static struct {
+    int count;
+    GCWorker* workers;
+
+    // job dispatch: helpers wait for the generation to change
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;
+    GCJob job;
+    int finished;
+    bool shutdown;
+
+    // the number of markers that may still produce gray objects
+    int active;
+
+    // the heads of each sweep chunk and the survivors they produced
+    Obj** chunk_heads;
+    SweepChunk* chunks;
+    int chunk_count;
+    int chunk_capacity;
+    int next_chunk;
+} pool;
+
+// The worker the current thread is acting as during a parallel collection.
+static _Thread_local GCWorker* gc_worker = NULL;
+
+static uint64_t now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000u + (uint64_t) time.tv_nsec;
+}
+
+// The CPU time the current thread has used. Unlike the wall clock it does not
+// advance while the thread is preempted.
+static uint64_t thread_cpu_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return (uint64_t) time.tv_sec * 1000000000u + (uint64_t) time.tv_nsec;
+}
+
+// Raise an out-of-memory error. Inside interpret() this unwinds to its error
+// handler, which reports a runtime error and leaves the VM usable.
+static void out_of_memory(size_t size) {
+    vm.out_of_memory_errors++;
+
+    if (vm.error_handler == NULL) {
+        fprintf(stderr, "Out of memory allocating %zu bytes.\n", size);
+        exit(1);
+    }
+
+    longjmp(*vm.error_handler, 1);
+}
+
+// Blocks of up to ARENA_MAX_BLOCK bytes live in the arenas, larger ones come
+// from the system allocator. Either way the caller's size says which it is.
+static void free_block(void *block, size_t size) {
+    if (size <= ARENA_MAX_BLOCK) {
+        arena_free(block, size);
+    } else {
+        free(block);
+    }
+}
+
+// Resize a block, moving it between the arenas and the system allocator when
+// its size calls for it. Returns NULL, leaving the block as it was, on failure.
+static void *resize_block(void *previous, size_t old_size, size_t new_size) {
+    if (new_size > ARENA_MAX_BLOCK && (previous == NULL || old_size > ARENA_MAX_BLOCK)) {
+        return realloc(previous, new_size);
+    }
+
+    if (previous != NULL && old_size <= ARENA_MAX_BLOCK && new_size <= ARENA_MAX_BLOCK &&
+        arena_same_class(old_size, new_size)) {
+        return previous;
+    }
+
+    void *result = new_size <= ARENA_MAX_BLOCK ? arena_allocate(new_size) : malloc(new_size);
+    if (result == NULL || previous == NULL) return result;
+
+    memcpy(result, previous, old_size < new_size ? old_size : new_size);
+    free_block(previous, old_size);
+    return result;
+}
+
 void* reallocate(void* previous, size_t old_size, size_t new_size) {
+    if (gc_worker != NULL) {
+        // a parallel sweep only ever frees. the bytes are accounted per
+        // worker and subtracted from the heap total once the sweep is done.
+        gc_worker->freed_bytes += old_size;
+        if (old_size <= ARENA_MAX_BLOCK) {
+            arena_free_concurrent(previous, old_size);
+        } else {
+            free(previous);
+        }
+        return NULL;
+    }
+
+    if (new_size > old_size) {
+        size_t growth = new_size - old_size;
+
+#ifdef DEBUG_STRESS_GC
+        collect_garbage();
+#else
+        if (vm.gc_phase != GC_PHASE_IDLE) {
+            // an incremental cycle is running, make the mutator pay for what it
+            // allocates. a mutator outrunning the collector pays more often.
+            vm.gc_debt += growth;
+            size_t step_bytes = vm.bytes_allocated + growth > vm.next_gc * GC_HEAP_GROW_FACTOR
+                                ? GC_STEP_BYTES / GC_CATCH_UP_RATE
+                                : GC_STEP_BYTES;
+            if (vm.gc_debt > step_bytes) gc_step();
+        } else if (vm.bytes_allocated + growth > vm.next_gc) {
+            if (vm.gc_incremental) {
+                gc_step();
+            } else {
+                collect_garbage();
+            }
+        }
+#endif
+
+        if (vm.hard_heap_limit > 0 && vm.bytes_allocated + growth > vm.hard_heap_limit) {
+            // only give up once a full collection could not make room. a cycle
+            // already in progress keeps what was allocated during it, so when
+            // finishing it is not enough, collect again from the roots.
+            bool in_progress = vm.gc_phase != GC_PHASE_IDLE;
+            collect_garbage();
+            if (in_progress && vm.bytes_allocated + growth > vm.hard_heap_limit) collect_garbage();
+            if (vm.bytes_allocated + growth > vm.hard_heap_limit) out_of_memory(new_size);
+        }
+    }
+
     // If the new size is 0, free the previous allocation and return NULL.
     if (new_size == 0) {
-        free(previous);
+        free_block(previous, old_size);
+        vm.bytes_allocated -= old_size;
         return NULL;
     }
 
-    // Reallocate the previous allocation to the new size, exit on failure.
-    void* result = realloc(previous, new_size);
-    if (result == NULL) exit(1);
+    // Reallocate the previous allocation to the new size. When the system is
+    // out of memory, collect and retry once before raising an error.
+    void* result = resize_block(previous, old_size, new_size);
+    if (result == NULL) {
+        collect_garbage();
+        result = resize_block(previous, old_size, new_size);
+        if (result == NULL) out_of_memory(new_size);
+    }
+
+    vm.bytes_allocated += new_size - old_size;
+    if (vm.bytes_allocated > vm.peak_bytes_allocated) {
+        vm.peak_bytes_allocated = vm.bytes_allocated;
+    }
+
     return result;
 }
 
+static void push_local(GCWorker *worker, Obj *object) {
+    if (worker->local_capacity < worker->local_count + 1) {
+        worker->local_capacity = GROW_CAPACITY(worker->local_capacity);
+        worker->local = (Obj**)realloc(worker->local, sizeof(Obj*) * worker->local_capacity);
+        if (worker->local == NULL) exit(1);
+    }
+
+    worker->local[worker->local_count++] = object;
+}
+
+void mark_object(Obj *object) {
+    if (object == NULL) return;
+
+    if (gc_worker != NULL) {
+        // markers race to claim an object, only the one that flips its mark traces it
+        if (__atomic_exchange_n(&object->mark, vm.mark_epoch, __ATOMIC_RELAXED) == vm.mark_epoch) return;
+        push_local(gc_worker, object);
+        return;
+    }
+
+    if (object->mark == vm.mark_epoch) return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    print_value(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    object->mark = vm.mark_epoch;
+
+    // the gray stack is allocated with the system allocator so that growing it
+    // can never recursively trigger a collection.
+    if (vm.gray_capacity < vm.gray_count + 1) {
+        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
+        vm.gray_stack = (Obj**)realloc(vm.gray_stack, sizeof(Obj*) * vm.gray_capacity);
+        if (vm.gray_stack == NULL) exit(1);
+    }
+
+    vm.gray_stack[vm.gray_count++] = object;
+}
+
+void mark_value(Value value) {
+    if (IS_OBJ(value)) mark_object(AS_OBJ(value));
+}
+
+static void mark_array(ValueArray *array) {
+    for (int i = 0; i < array->count; i++) {
+        mark_value(array->values[i]);
+    }
+}
+
+static void blacken_object(Obj *object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)object);
+    print_value(OBJ_VAL(object));
+    printf("\n");
+#endif
+
+    switch (object->type) {
+        case OBJ_FUNCTION: {
+            ObjFunction *function = (ObjFunction*)object;
+            mark_object((Obj*)function->name);
+            mark_array(&function->module.constants);
+            break;
+        }
+        case OBJ_LIST: {
+            ObjList *list = (ObjList*)object;
+            // a view marks its own items too, its base may have been
+            // allocated black and never be blackened
+            if (list->base != NULL) mark_object((Obj*)list->base);
+            for (int i = 0; i < list->count; i++) {
+                mark_value(list->items[i]);
+            }
+            break;
+        }
+        case OBJ_STRING:
+        case OBJ_RANGE:
+        case OBJ_NATIVE:
+        case OBJ_ARRAY:
+            break;
+    }
+}
+
 static void free_object(Obj *object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
     switch (object->type) {
         case OBJ_STRING: {
             ObjString *string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
+            // a string may have run out of memory before it had characters
+            if (string->chars != NULL) FREE_ARRAY(char, string->chars, string->length + 1);
             FREE(ObjString, string);
             break;
         }
         case OBJ_LIST: {
             ObjList *list = (ObjList*)object;
-            FREE_ARRAY(Value, list->items, list->capacity);
+            // the items of a view belong to its base
+            if (list->base == NULL) FREE_ARRAY(Value, list->items, list->capacity);
             FREE(ObjList, list);
             break;
         }
@@ -35,15 +334,597 @@ static void free_object(Obj *object) {
             FREE(ObjRange, range);
             break;
         }
+        case OBJ_NATIVE:
+            FREE(ObjNative, object);
+            break;
+        case OBJ_ARRAY: {
+            ObjArray *array = (ObjArray*)object;
+            FREE_ARRAY(double, array->as.doubles, array->count);
+            FREE(ObjArray, array);
+            break;
+        }
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction*)object;
             free_module(&function->module);
+            if (function->source != NULL) FREE_ARRAY(char, function->source, function->source_length + 1);
             FREE(ObjFunction, object);
             break;
         }
     }
 }
 
+// Gray everything the mutator can reach directly, scanning the stack from
+// the given slot up. Apart from the globals table, which is guarded by the
+// barrier in table_set(), these roots change without barriers and are
+// scanned again before marking may finish.
+static void mark_stack_roots(Value *from) {
+    for (Value *slot = from; slot < vm.stack_top; slot++) {
+        mark_value(*slot);
+    }
+    vm.gc_stack_floor = vm.frame_count > 0 ? vm.frames[vm.frame_count - 1].slots : vm.stack;
+
+    for (int i = 0; i < vm.frame_count; i++) {
+        mark_object((Obj*)vm.frames[i].function);
+    }
+
+    mark_value(vm.reg_0);
+    mark_compiler_roots();
+}
+
+static void start_cycle() {
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+
+    // flipping the epoch turns every object white at once
+    vm.mark_epoch ^= 1;
+    vm.gc_phase = GC_PHASE_MARK;
+
+    mark_stack_roots(vm.stack);
+    mark_table(&vm.globals);
+    mark_table(&vm.modules);
+}
+
+// Trace gray objects until none remain or the deadline passes.
+// Returns true when the gray stack has been drained.
+static bool trace_references(uint64_t deadline) {
+    int quantum = GC_WORK_QUANTUM;
+
+    while (vm.gray_count > 0) {
+        Obj *object = vm.gray_stack[--vm.gray_count];
+        blacken_object(object);
+
+        if (--quantum == 0) {
+            if (now_ns() >= deadline) return false;
+            quantum = GC_WORK_QUANTUM;
+        }
+    }
+
+    return true;
+}
+
+// Try to finish the mark phase. The unbarriered roots are rescanned, and if
+// that grays nothing new the marking is complete. Otherwise, tracing resumes.
+// Only the part of the stack written since the last scan is scanned again, so
+// the rescan takes about as long as the frames the mutator ran in since.
+static bool finish_mark() {
+    mark_stack_roots(vm.gc_stack_floor);
+    if (vm.gray_count > 0) return false;
+
+    vm.gc_phase = GC_PHASE_SWEEP;
+    vm.sweep_cursor = &vm.objects;
+    vm.strings_cursor = 0;
+    vm.strings_entries = vm.strings.entries;
+    return true;
+}
+
+// Return to idle once the pages are released and set the threshold for the next cycle.
+static void end_cycle() {
+    vm.gc_phase = GC_PHASE_IDLE;
+
+    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    if (vm.next_gc < GC_INITIAL_THRESHOLD) vm.next_gc = GC_INITIAL_THRESHOLD;
+
+    if (vm.soft_heap_limit > 0 && vm.next_gc > vm.soft_heap_limit) {
+        // collect as the heap reaches the soft limit. once the live heap is
+        // past it, collect whenever it grows by another quarter.
+        vm.next_gc = vm.bytes_allocated < vm.soft_heap_limit
+                     ? vm.soft_heap_limit
+                     : vm.bytes_allocated + vm.bytes_allocated / 4;
+    }
+
+    vm.gc_stats.cycles++;
+}
+
+// Sweep unreached objects until the end of the heap or the deadline.
+// Returns true when the sweep is complete.
+static bool sweep(uint64_t deadline) {
+    // the string table holds weak references, the strings about to be freed
+    // are dropped from it first. a table the mutator has grown since is
+    // walked again from the start.
+    while (vm.strings_cursor < vm.strings.capacity || vm.strings_entries != vm.strings.entries) {
+        if (vm.strings_entries != vm.strings.entries) {
+            vm.strings_entries = vm.strings.entries;
+            vm.strings_cursor = 0;
+        }
+        vm.strings_cursor = table_remove_white(&vm.strings, vm.strings_cursor, GC_TABLE_QUANTUM);
+        if (now_ns() >= deadline) return false;
+    }
+
+    int quantum = GC_WORK_QUANTUM;
+
+    while (*vm.sweep_cursor != NULL) {
+        Obj *object = *vm.sweep_cursor;
+
+        if (object->mark == vm.mark_epoch) {
+            vm.sweep_cursor = &object->next;
+        } else {
+            *vm.sweep_cursor = object->next;
+            free_object(object);
+        }
+
+        if (--quantum == 0) {
+            if (now_ns() >= deadline) return false;
+            quantum = GC_WORK_QUANTUM;
+        }
+    }
+
+    vm.sweep_cursor = NULL;
+    arena_release_empty_pages();
+    vm.gc_phase = GC_PHASE_RELEASE;
+    return true;
+}
+
+// Return the pages the sweep emptied to the OS until none are left or the
+// deadline passes, then end the cycle. Returns true when the cycle is over.
+static bool release_pages(uint64_t deadline) {
+    while (!arena_release_queued_pages()) {
+        if (now_ns() >= deadline) return false;
+    }
+
+    end_cycle();
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end, %zu bytes live, next at %zu\n", vm.bytes_allocated, vm.next_gc);
+#endif
+
+    return true;
+}
+
+// Record a pause that started at the given wall clock and thread CPU times.
+static void record_pause(uint64_t start, uint64_t cpu_start) {
+    uint64_t pause_ns = now_ns() - start;
+    uint64_t cpu_ns = thread_cpu_ns() - cpu_start;
+
+    GCStats *stats = &vm.gc_stats;
+    stats->pauses++;
+    stats->total_pause_ns += pause_ns;
+    if (pause_ns > stats->max_pause_ns) stats->max_pause_ns = pause_ns;
+    if (cpu_ns > stats->max_pause_cpu_ns) stats->max_pause_cpu_ns = cpu_ns;
+
+    int bucket = 0;
+    for (uint64_t us = pause_ns / 1000; us > 0 && bucket < GC_PAUSE_BUCKETS - 1; us >>= 1) {
+        bucket++;
+    }
+    stats->histogram[bucket]++;
+}
+
+void gc_step() {
+    uint64_t start = now_ns();
+    uint64_t cpu_start = thread_cpu_ns();
+    uint64_t deadline = start + vm.gc_max_pause_us * 1000;
+
+    if (vm.gc_phase == GC_PHASE_IDLE) start_cycle();
+
+    while (vm.gc_phase == GC_PHASE_MARK) {
+        if (!trace_references(deadline) || finish_mark()) break;
+    }
+
+    if (vm.gc_phase == GC_PHASE_SWEEP && now_ns() < deadline) {
+        sweep(deadline);
+    }
+
+    if (vm.gc_phase == GC_PHASE_RELEASE && now_ns() < deadline) {
+        release_pages(deadline);
+    }
+
+    vm.gc_debt = 0;
+    vm.gc_countdown = GC_SAFEPOINT_INTERVAL;
+    record_pause(start, cpu_start);
+}
+
+void finish_sweep() {
+    if (vm.gc_phase != GC_PHASE_SWEEP) return;
+
+    uint64_t start = now_ns();
+    uint64_t cpu_start = thread_cpu_ns();
+    sweep(UINT64_MAX);
+    record_pause(start, cpu_start);
+}
+
+// Move up to count gray objects from the end of one stack to another.
+static int transfer(Obj **from, int *from_count, GCWorker *to, int count) {
+    int remaining = *from_count;
+    if (count > remaining) count = remaining;
+
+    for (int i = 0; i < count; i++) {
+        push_local(to, from[--remaining]);
+    }
+
+    // other workers check the count without taking the lock
+    __atomic_store_n(from_count, remaining, __ATOMIC_RELAXED);
+    return count;
+}
+
+// Offer a batch of private gray objects to idle markers.
+static void share_batch(GCWorker *worker) {
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->shared_capacity < worker->shared_count + GC_STEAL_BATCH) {
+        worker->shared_capacity = worker->shared_count + GC_STEAL_BATCH * 2;
+        worker->shared = (Obj**)realloc(worker->shared, sizeof(Obj*) * worker->shared_capacity);
+        if (worker->shared == NULL) exit(1);
+    }
+
+    worker->local_count -= GC_STEAL_BATCH;
+    memcpy(worker->shared + worker->shared_count, worker->local + worker->local_count,
+           sizeof(Obj*) * GC_STEAL_BATCH);
+    __atomic_store_n(&worker->shared_count, worker->shared_count + GC_STEAL_BATCH, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&worker->lock);
+}
+
+// Take half the shared gray objects of a victim, which may be the thief itself.
+static bool steal(GCWorker *thief, GCWorker *victim) {
+    if (__atomic_load_n(&victim->shared_count, __ATOMIC_RELAXED) == 0) return false;
+
+    pthread_mutex_lock(&victim->lock);
+    int taken = transfer(victim->shared, &victim->shared_count, thief, (victim->shared_count + 1) / 2);
+    pthread_mutex_unlock(&victim->lock);
+
+    return taken > 0;
+}
+
+static bool steal_any(GCWorker *thief) {
+    int self = (int) (thief - pool.workers);
+
+    for (int i = 0; i < pool.count; i++) {
+        if (steal(thief, &pool.workers[(self + i) % pool.count])) return true;
+    }
+
+    return false;
+}
+
+static bool any_shared_work() {
+    for (int i = 0; i < pool.count; i++) {
+        if (__atomic_load_n(&pool.workers[i].shared_count, __ATOMIC_RELAXED) > 0) return true;
+    }
+
+    return false;
+}
+
+// Trace gray objects until every marker runs dry. A marker without work stops
+// counting as active, and marking is over once no marker is active and no
+// shared work remains, since only active markers can create gray objects.
+static void parallel_mark(GCWorker *worker) {
+    for (;;) {
+        while (worker->local_count > 0) {
+            blacken_object(worker->local[--worker->local_count]);
+
+            if (worker->local_count >= GC_STEAL_BATCH * 2 &&
+                __atomic_load_n(&worker->shared_count, __ATOMIC_RELAXED) == 0) {
+                share_batch(worker);
+            }
+        }
+
+        if (steal_any(worker)) continue;
+
+        __atomic_fetch_sub(&pool.active, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (any_shared_work()) {
+                __atomic_fetch_add(&pool.active, 1, __ATOMIC_SEQ_CST);
+                if (steal_any(worker)) break;
+                __atomic_fetch_sub(&pool.active, 1, __ATOMIC_SEQ_CST);
+            }
+
+            if (__atomic_load_n(&pool.active, __ATOMIC_SEQ_CST) == 0 && !any_shared_work()) return;
+            sched_yield();
+        }
+    }
+}
+
+// Sweep chunks of the object list until none are left, keeping the survivors
+// of each chunk linked together so they can be stitched back in order.
+static void parallel_sweep(GCWorker *worker) {
+    for (;;) {
+        int index = __atomic_fetch_add(&pool.next_chunk, 1, __ATOMIC_RELAXED);
+        if (index >= pool.chunk_count) return;
+
+        Obj *object = pool.chunk_heads[index];
+        Obj *end = index + 1 < pool.chunk_count ? pool.chunk_heads[index + 1] : NULL;
+        SweepChunk *chunk = &pool.chunks[index];
+        chunk->first = NULL;
+        chunk->last = NULL;
+
+        while (object != end) {
+            Obj *next = object->next;
+
+            if (object->mark == vm.mark_epoch) {
+                if (chunk->last == NULL) {
+                    chunk->first = object;
+                } else {
+                    chunk->last->next = object;
+                }
+                chunk->last = object;
+            } else {
+                free_object(object);
+            }
+
+            object = next;
+        }
+    }
+}
+
+static void run_worker(GCWorker *worker, GCJob job) {
+    gc_worker = worker;
+
+    switch (job) {
+        case GC_JOB_MARK:
+            parallel_mark(worker);
+            break;
+        case GC_JOB_SWEEP:
+            parallel_sweep(worker);
+            break;
+    }
+
+    gc_worker = NULL;
+}
+
+static void *helper_main(void *argument) {
+    GCWorker *worker = (GCWorker*)argument;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen && !pool.shutdown) {
+            pthread_cond_wait(&pool.start, &pool.lock);
+        }
+        if (pool.shutdown) break;
+
+        seen = pool.generation;
+        GCJob job = pool.job;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_worker(worker, job);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.finished++;
+        pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+static void start_helpers() {
+    pool.count = vm.gc_threads;
+    pool.workers = (GCWorker*)calloc(pool.count, sizeof(GCWorker));
+    if (pool.workers == NULL) exit(1);
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.start, NULL);
+    pthread_cond_init(&pool.done, NULL);
+
+    for (int i = 0; i < pool.count; i++) {
+        pthread_mutex_init(&pool.workers[i].lock, NULL);
+    }
+
+    // the main thread acts as worker 0, so only count - 1 threads are spawned
+    for (int i = 1; i < pool.count; i++) {
+        if (pthread_create(&pool.workers[i].thread, NULL, helper_main, &pool.workers[i]) != 0) {
+            fprintf(stderr, "Could not start garbage collector thread.\n");
+            exit(1);
+        }
+    }
+}
+
+// Run a job on every worker, with the main thread taking part, and wait for all of them.
+static void run_job(GCJob job) {
+    pthread_mutex_lock(&pool.lock);
+    pool.job = job;
+    pool.generation++;
+    pool.finished = 0;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    run_worker(&pool.workers[0], job);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.finished < pool.count - 1) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void collect_in_parallel() {
+    if (pool.workers == NULL) start_helpers();
+
+    // gray the roots into worker 0 and share them so every marker starts with work
+    vm.mark_epoch ^= 1;
+    vm.gc_phase = GC_PHASE_MARK;
+
+    GCWorker *main_worker = &pool.workers[0];
+    gc_worker = main_worker;
+    mark_stack_roots(vm.stack);
+    mark_table(&vm.globals);
+    mark_table(&vm.modules);
+    gc_worker = NULL;
+
+    while (main_worker->local_count > GC_STEAL_BATCH) {
+        share_batch(main_worker);
+    }
+
+    pool.active = pool.count;
+    run_job(GC_JOB_MARK);
+
+    table_remove_white(&vm.strings, 0, vm.strings.capacity);
+    vm.gc_phase = GC_PHASE_SWEEP;
+
+    // split the object list into chunks, the walk only touches the list links
+    pool.chunk_count = 0;
+    int position = 0;
+    for (Obj *object = vm.objects; object != NULL; object = object->next, position++) {
+        if (position % GC_SWEEP_CHUNK != 0) continue;
+
+        if (pool.chunk_capacity < pool.chunk_count + 1) {
+            pool.chunk_capacity = GROW_CAPACITY(pool.chunk_capacity);
+            pool.chunk_heads = (Obj**)realloc(pool.chunk_heads, sizeof(Obj*) * pool.chunk_capacity);
+            pool.chunks = (SweepChunk*)realloc(pool.chunks, sizeof(SweepChunk) * pool.chunk_capacity);
+            if (pool.chunk_heads == NULL || pool.chunks == NULL) exit(1);
+        }
+
+        pool.chunk_heads[pool.chunk_count++] = object;
+    }
+
+    pool.next_chunk = 0;
+    run_job(GC_JOB_SWEEP);
+
+    // stitch the surviving chunks back together in their original order
+    Obj **link = &vm.objects;
+    for (int i = 0; i < pool.chunk_count; i++) {
+        if (pool.chunks[i].first == NULL) continue;
+        *link = pool.chunks[i].first;
+        link = &pool.chunks[i].last->next;
+    }
+    *link = NULL;
+
+    for (int i = 0; i < pool.count; i++) {
+        GCWorker *worker = &pool.workers[i];
+        vm.bytes_allocated -= worker->freed_bytes;
+        worker->freed_bytes = 0;
+    }
+
+    arena_release_empty_pages();
+    release_pages(UINT64_MAX);
+}
+
+static void stop_helpers() {
+    if (pool.workers == NULL) return;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = true;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 1; i < pool.count; i++) {
+        pthread_join(pool.workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < pool.count; i++) {
+        pthread_mutex_destroy(&pool.workers[i].lock);
+        free(pool.workers[i].local);
+        free(pool.workers[i].shared);
+    }
+
+    free(pool.workers);
+    free(pool.chunk_heads);
+    free(pool.chunks);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.start);
+    pthread_cond_destroy(&pool.done);
+    memset(&pool, 0, sizeof(pool));
+}
+
+void collect_garbage() {
+    uint64_t start = now_ns();
+    uint64_t cpu_start = thread_cpu_ns();
+
+    if (vm.gc_threads > 1 && vm.gc_phase == GC_PHASE_IDLE) {
+        collect_in_parallel();
+        vm.gc_debt = 0;
+        record_pause(start, cpu_start);
+        return;
+    }
+
+    if (vm.gc_phase == GC_PHASE_IDLE) start_cycle();
+
+    while (vm.gc_phase == GC_PHASE_MARK) {
+        trace_references(UINT64_MAX);
+        finish_mark();
+    }
+
+    if (vm.gc_phase == GC_PHASE_SWEEP) sweep(UINT64_MAX);
+    release_pages(UINT64_MAX);
+
+    vm.gc_debt = 0;
+    record_pause(start, cpu_start);
+}
+
+void print_gc_stats() {
+    GCStats *stats = &vm.gc_stats;
+
+    fprintf(stderr, "gc: %d thread%s, %llu cycles, %llu pauses, total %.3f ms, max %.1f us (%.1f us cpu)",
+            vm.gc_threads, vm.gc_threads == 1 ? "" : "s",
+            (unsigned long long) stats->cycles, (unsigned long long) stats->pauses,
+            stats->total_pause_ns / 1e6, stats->max_pause_ns / 1e3, stats->max_pause_cpu_ns / 1e3);
+    if (vm.gc_incremental) {
+        fprintf(stderr, " (budget %llu us)", (unsigned long long) vm.gc_max_pause_us);
+    }
+    fprintf(stderr, "\n");
+
+    fprintf(stderr, "gc pause histogram (us):\n");
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (stats->histogram[i] == 0) continue;
+
+        unsigned long long low = i == 0 ? 0 : 1ull << (i - 1);
+        if (i == GC_PAUSE_BUCKETS - 1) {
+            fprintf(stderr, "  [%8llu,      inf) %llu\n", low, (unsigned long long) stats->histogram[i]);
+        } else {
+            fprintf(stderr, "  [%8llu, %8llu) %llu\n", low, 1ull << i, (unsigned long long) stats->histogram[i]);
+        }
+    }
+}
+
+MemoryStats get_memory_stats() {
+    MemoryStats stats;
+    stats.bytes_allocated = vm.bytes_allocated;
+    stats.peak_bytes_allocated = vm.peak_bytes_allocated;
+    stats.soft_limit = vm.soft_heap_limit;
+    stats.hard_limit = vm.hard_heap_limit;
+    stats.out_of_memory_errors = vm.out_of_memory_errors;
+    stats.collections = vm.gc_stats.cycles;
+
+    // during a sweep, the objects left white were not reached and are only
+    // waiting to be freed. at any other time every object counts as live.
+    memset(&stats.live, 0, sizeof(stats.live));
+    for (Obj *object = vm.objects; object != NULL; object = object->next) {
+        if (vm.gc_phase == GC_PHASE_SWEEP && object->mark != vm.mark_epoch) continue;
+        stats.live.objects[object->type]++;
+        stats.live.bytes[object->type] += object_size(object);
+    }
+
+    stats.arenas = arena_stats();
+    return stats;
+}
+
+void print_memory_stats() {
+    MemoryStats stats = get_memory_stats();
+
+    fprintf(stderr, "memory: %zu bytes allocated, peak %zu", stats.bytes_allocated, stats.peak_bytes_allocated);
+    if (stats.soft_limit > 0) fprintf(stderr, ", soft limit %zu", stats.soft_limit);
+    if (stats.hard_limit > 0) fprintf(stderr, ", hard limit %zu", stats.hard_limit);
+    fprintf(stderr, ", %llu out-of-memory errors\n", (unsigned long long) stats.out_of_memory_errors);
+    fprintf(stderr, "arenas: %zu bytes reserved, %zu pages resident, peak %zu, %zu pages released\n",
+            stats.arenas.reserved_bytes, stats.arenas.resident_pages,
+            stats.arenas.peak_resident_pages, stats.arenas.released_pages);
+
+    fprintf(stderr, "live heap by type, %llu collections:\n", (unsigned long long) stats.collections);
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        fprintf(stderr, "  %-10s %10zu objects %12zu bytes\n",
+                obj_type_name((ObjType) type), stats.live.objects[type], stats.live.bytes[type]);
+    }
+}
+
 void free_objects() {
     Obj *object = vm.objects;
     while (object != NULL) {
@@ -51,4 +932,12 @@ void free_objects() {
         free_object(object);
         object = next;
     }
+
+    vm.objects = NULL;
+    stop_helpers();
+    free(vm.gray_stack);
+    vm.gray_stack = NULL;
+    vm.gray_count = 0;
+    vm.gray_capacity = 0;
+    free_arenas();
 }
@@ -4,6 +4,7 @@
 
 #include "module.h"
 #include "memory.h"
+#include "vm.h"
 
 // Initialize a module.
 void initialize_module(Module* module) {
@@ -13,6 +14,11 @@ void initialize_module(Module* module) {
     module->capacity = 0;
     module->code = NULL;
     module->lines = NULL;
+    module->line_count = 0;
+    module->line_capacity = 0;
+    module->inlines = NULL;
+    module->inline_count = 0;
+    module->inline_capacity = 0;
 
     // Initialize the module's array of values.
     initialize_value_array(&module->constants);
@@ -22,8 +28,9 @@ void initialize_module(Module* module) {
 void free_module(Module* module) {
     // Free the array of instructions.
     FREE_ARRAY(uint8_t, module->code, module->capacity);
-    // Free the array of line numbers.
-    FREE_ARRAY(int, module->lines, module->capacity);
+    // Free the table of line numbers.
+    FREE_ARRAY(LineRun, module->lines, module->line_capacity);
+    FREE_ARRAY(InlineRun, module->inlines, module->inline_capacity);
     // Free the array of values.
     free_value_array(&module->constants);
     // Reset the module's fields to their initial values.
@@ -35,21 +42,99 @@ void write_module(Module* module, uint8_t byte, int line) {
     // If the module's array of instructions is full, reallocate the array to double its capacity.
     if (module->capacity < module->count + 1) {
         uint32_t old_capacity = module->capacity;
+        module->code = GROW_ARRAY(module->code, uint8_t, old_capacity, GROW_CAPACITY(old_capacity));
         module->capacity = GROW_CAPACITY(old_capacity);
-        module->code = GROW_ARRAY(module->code, uint8_t, old_capacity, module->capacity);
-        module->lines = GROW_ARRAY(module->lines, int, old_capacity, module->capacity);
     }
 
     // Append the byte to the end of the module.
+    mark_line(module, module->count, line);
     module->code[module->count] = byte;
-    module->lines[module->count] = line;
     module->count++;
 }
 
+void mark_line(Module* module, uint32_t offset, int line) {
+    // The code continues the last run while it stays on the same line.
+    if (module->line_count > 0 && module->lines[module->line_count - 1].line == line) return;
+
+    if (module->line_capacity < module->line_count + 1) {
+        int old_capacity = module->line_capacity;
+        module->lines = GROW_ARRAY(module->lines, LineRun, old_capacity, GROW_CAPACITY(old_capacity));
+        module->line_capacity = GROW_CAPACITY(old_capacity);
+    }
+
+    LineRun* run = &module->lines[module->line_count++];
+    run->offset = offset;
+    run->line = line;
+}
+
+int get_line(Module* module, uint32_t offset) {
+    // Find the last run that starts at or before the offset.
+    int low = 0;
+    int high = module->line_count - 1;
+    while (low < high) {
+        int middle = low + (high - low + 1) / 2;
+        if (module->lines[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    return module->line_count > 0 ? module->lines[low].line : 0;
+}
+
+void mark_inlined(Module* module, uint32_t start, uint32_t end, int line, ObjString* name) {
+    if (start == end) return;
+
+    // The code continues the last run while it comes from the same line.
+    if (module->inline_count > 0) {
+        InlineRun* last = &module->inlines[module->inline_count - 1];
+        if (last->end == start && last->line == line && last->name == name) {
+            last->end = end;
+            return;
+        }
+    }
+
+    if (module->inline_capacity < module->inline_count + 1) {
+        int old_capacity = module->inline_capacity;
+        module->inlines = GROW_ARRAY(module->inlines, InlineRun, old_capacity, GROW_CAPACITY(old_capacity));
+        module->inline_capacity = GROW_CAPACITY(old_capacity);
+    }
+
+    InlineRun* run = &module->inlines[module->inline_count++];
+    run->start = start;
+    run->end = end;
+    run->line = line;
+    run->name = name;
+}
+
+InlineRun* get_inlined(Module* module, uint32_t offset) {
+    // Search the runs, which do not overlap, for the one holding the offset.
+    int low = 0;
+    int high = module->inline_count - 1;
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        InlineRun* run = &module->inlines[middle];
+        if (offset < run->start) {
+            high = middle - 1;
+        } else if (offset >= run->end) {
+            low = middle + 1;
+        } else {
+            return run;
+        }
+    }
+
+    return NULL;
+}
+
 // Add a constant value to a module.
 uint32_t add_constant(Module* module, Value value) {
-    // Write the value to the module's array of values.
+    // Write the value to the module's array of values. The value is kept on the
+    // stack so that a collection triggered by growing the array cannot free it.
+    WRITE_BARRIER(value);
+    push(value);
     write_value_array(&module->constants, value);
+    pop();
     // Return the index of the value in the array of values.
     return module->constants.count - 1;
 }
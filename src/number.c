@@ -0,0 +1,527 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "number.h"
+
+// Numbers are formatted with Grisu3 (Florian Loitsch, "Printing
+// Floating-Point Numbers Quickly and Accurately with Integers", PLDI 2010):
+// the bounds of the interval of reals that round to the number are scaled by
+// a cached power of ten into a range where 64-bit integer arithmetic yields
+// the decimal digits, and digits are generated until the result is inside the
+// interval. The scaled bounds are only known to within one unit, and for the
+// few numbers, about half a percent, where that could make the digits longer
+// or farther from the number than the shortest, closest ones, Grisu3 says so
+// and the digits are found by rounding with the C library instead.
+
+// A floating-point number with a 64-bit significand: f * 2^e.
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define SIGNIFICAND_BITS 52
+#define HIDDEN_BIT ((uint64_t) 1 << SIGNIFICAND_BITS)
+#define SIGNIFICAND_MASK (HIDDEN_BIT - 1)
+#define EXPONENT_MASK 0x7ff0000000000000ull
+#define EXPONENT_BIAS (1023 + SIGNIFICAND_BITS)
+
+// 10^k for k = -348, -340, ..., 340, rounded to 64-bit significands.
+static const DiyFp cached_powers[] = {
+    {0xfa8fd5a0081c0288ull, -1220}, {0xbaaee17fa23ebf76ull, -1193}, {0x8b16fb203055ac76ull, -1166},
+    {0xcf42894a5dce35eaull, -1140}, {0x9a6bb0aa55653b2dull, -1113}, {0xe61acf033d1a45dfull, -1087},
+    {0xab70fe17c79ac6caull, -1060}, {0xff77b1fcbebcdc4full, -1034}, {0xbe5691ef416bd60cull, -1007},
+    {0x8dd01fad907ffc3cull, -980}, {0xd3515c2831559a83ull, -954}, {0x9d71ac8fada6c9b5ull, -927},
+    {0xea9c227723ee8bcbull, -901}, {0xaecc49914078536dull, -874}, {0x823c12795db6ce57ull, -847},
+    {0xc21094364dfb5637ull, -821}, {0x9096ea6f3848984full, -794}, {0xd77485cb25823ac7ull, -768},
+    {0xa086cfcd97bf97f4ull, -741}, {0xef340a98172aace5ull, -715}, {0xb23867fb2a35b28eull, -688},
+    {0x84c8d4dfd2c63f3bull, -661}, {0xc5dd44271ad3cdbaull, -635}, {0x936b9fcebb25c996ull, -608},
+    {0xdbac6c247d62a584ull, -582}, {0xa3ab66580d5fdaf6ull, -555}, {0xf3e2f893dec3f126ull, -529},
+    {0xb5b5ada8aaff80b8ull, -502}, {0x87625f056c7c4a8bull, -475}, {0xc9bcff6034c13053ull, -449},
+    {0x964e858c91ba2655ull, -422}, {0xdff9772470297ebdull, -396}, {0xa6dfbd9fb8e5b88full, -369},
+    {0xf8a95fcf88747d94ull, -343}, {0xb94470938fa89bcfull, -316}, {0x8a08f0f8bf0f156bull, -289},
+    {0xcdb02555653131b6ull, -263}, {0x993fe2c6d07b7facull, -236}, {0xe45c10c42a2b3b06ull, -210},
+    {0xaa242499697392d3ull, -183}, {0xfd87b5f28300ca0eull, -157}, {0xbce5086492111aebull, -130},
+    {0x8cbccc096f5088ccull, -103}, {0xd1b71758e219652cull, -77}, {0x9c40000000000000ull, -50},
+    {0xe8d4a51000000000ull, -24}, {0xad78ebc5ac620000ull, 3}, {0x813f3978f8940984ull, 30},
+    {0xc097ce7bc90715b3ull, 56}, {0x8f7e32ce7bea5c70ull, 83}, {0xd5d238a4abe98068ull, 109},
+    {0x9f4f2726179a2245ull, 136}, {0xed63a231d4c4fb27ull, 162}, {0xb0de65388cc8ada8ull, 189},
+    {0x83c7088e1aab65dbull, 216}, {0xc45d1df942711d9aull, 242}, {0x924d692ca61be758ull, 269},
+    {0xda01ee641a708deaull, 295}, {0xa26da3999aef774aull, 322}, {0xf209787bb47d6b85ull, 348},
+    {0xb454e4a179dd1877ull, 375}, {0x865b86925b9bc5c2ull, 402}, {0xc83553c5c8965d3dull, 428},
+    {0x952ab45cfa97a0b3ull, 455}, {0xde469fbd99a05fe3ull, 481}, {0xa59bc234db398c25ull, 508},
+    {0xf6c69a72a3989f5cull, 534}, {0xb7dcbf5354e9beceull, 561}, {0x88fcf317f22241e2ull, 588},
+    {0xcc20ce9bd35c78a5ull, 614}, {0x98165af37b2153dfull, 641}, {0xe2a0b5dc971f303aull, 667},
+    {0xa8d9d1535ce3b396ull, 694}, {0xfb9b7cd9a4a7443cull, 720}, {0xbb764c4ca7a44410ull, 747},
+    {0x8bab8eefb6409c1aull, 774}, {0xd01fef10a657842cull, 800}, {0x9b10a4e5e9913129ull, 827},
+    {0xe7109bfba19c0c9dull, 853}, {0xac2820d9623bf429ull, 880}, {0x80444b5e7aa7cf85ull, 907},
+    {0xbf21e44003acdd2dull, 933}, {0x8e679c2f5e44ff8full, 960}, {0xd433179d9c8cb841ull, 986},
+    {0x9e19db92b4e31ba9ull, 1013}, {0xeb96bf6ebadf77d9ull, 1039}, {0xaf87023b9bf0ee6bull, 1066},
+};
+
+#define FIRST_CACHED_POWER (-348)
+#define CACHED_POWER_STEP 8
+
+static const uint64_t powers_of_ten[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull, 1000000000ull,
+    10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull,
+    1000000000000000ull, 10000000000000000ull, 100000000000000000ull, 1000000000000000000ull,
+    10000000000000000000ull,
+};
+
+static DiyFp diy_fp_of(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    int biased_exponent = (int) ((bits & EXPONENT_MASK) >> SIGNIFICAND_BITS);
+    uint64_t significand = bits & SIGNIFICAND_MASK;
+    if (biased_exponent == 0) {
+        // subnormal
+        return (DiyFp) {significand, 1 - EXPONENT_BIAS};
+    }
+    return (DiyFp) {significand + HIDDEN_BIT, biased_exponent - EXPONENT_BIAS};
+}
+
+static DiyFp normalize(DiyFp x) {
+    int shift = __builtin_clzll(x.f);
+    return (DiyFp) {x.f << shift, x.e - shift};
+}
+
+// The product, rounded to its upper 64 bits.
+static DiyFp multiply(DiyFp x, DiyFp y) {
+    unsigned __int128 product = (unsigned __int128) x.f * y.f;
+    uint64_t high = (uint64_t) (product >> 64);
+    uint64_t low = (uint64_t) product;
+    return (DiyFp) {high + (low >> 63), x.e + y.e + 64};
+}
+
+// The cached power that scales a number with binary exponent e into the
+// range digits are generated in, and its decimal exponent, negated.
+static DiyFp cached_power(int e, int *k) {
+    double estimate = (-61 - e) * 0.30102999566398114 + 347;
+    int rounded = (int) estimate;
+    if (estimate - rounded > 0.0) rounded++;
+
+    int index = (rounded >> 3) + 1;
+    *k = -(FIRST_CACHED_POWER + index * CACHED_POWER_STEP);
+    return cached_powers[index];
+}
+
+// Move the last digit towards w while the result stays inside the interval,
+// where distance is how far w is below the upper bound, rest how far the
+// digits are, and unit how far off both may be. Returns whether the digits
+// are certainly inside the interval and the closest to w there are.
+static bool round_weed(char *digits, int length, uint64_t distance, uint64_t unsafe, uint64_t rest,
+                       uint64_t ten_kappa, uint64_t unit) {
+    uint64_t small_distance = distance - unit;
+    uint64_t big_distance = distance + unit;
+    while (rest < small_distance && unsafe - rest >= ten_kappa &&
+           (rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance)) {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+
+    // were w as far below the upper bound as it may be, the digit would have
+    // to move once more
+    if (rest < big_distance && unsafe - rest >= ten_kappa &&
+        (rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance)) {
+        return false;
+    }
+    return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+// Generate the digits of the upper bound, widened by the unit the products
+// may be off by, until they are within the widened interval, and add the
+// position of the last one to k. Returns whether they are the shortest.
+static bool generate_digits(DiyFp low, DiyFp w, DiyFp high, char *digits, int *length, int *k) {
+    uint64_t unit = 1;
+    uint64_t too_high = high.f + unit;
+    uint64_t unsafe = too_high - (low.f - unit);
+    uint64_t distance = too_high - w.f;
+
+    DiyFp one = {(uint64_t) 1 << -high.e, high.e};
+    uint32_t integral = (uint32_t) (too_high >> -one.e);
+    uint64_t fraction = too_high & (one.f - 1);
+
+    int kappa = 10;
+    while (kappa > 1 && integral < powers_of_ten[kappa - 1]) kappa--;
+
+    *length = 0;
+    while (kappa > 0) {
+        uint32_t divisor = (uint32_t) powers_of_ten[kappa - 1];
+        uint32_t digit = integral / divisor;
+        integral %= divisor;
+        if (digit != 0 || *length != 0) digits[(*length)++] = (char) ('0' + digit);
+        kappa--;
+
+        uint64_t rest = ((uint64_t) integral << -one.e) + fraction;
+        if (rest < unsafe) {
+            *k += kappa;
+            return round_weed(digits, *length, distance, unsafe, rest, (uint64_t) divisor << -one.e, unit);
+        }
+    }
+
+    for (;;) {
+        fraction *= 10;
+        unit *= 10;
+        unsafe *= 10;
+        char digit = (char) (fraction >> -one.e);
+        if (digit != 0 || *length != 0) digits[(*length)++] = (char) ('0' + digit);
+        fraction &= one.f - 1;
+        kappa--;
+
+        if (fraction < unsafe) {
+            *k += kappa;
+            return round_weed(digits, *length, distance * unit, unsafe, fraction, one.f, unit);
+        }
+    }
+}
+
+// The shortest digits of a positive number, closest to it: it is
+// digits * 10^k. Returns false when they cannot be told this way.
+static bool grisu3(double value, char *digits, int *length, int *k) {
+    DiyFp v = diy_fp_of(value);
+
+    // the bounds halfway to the neighbouring numbers, which are closer below
+    // a power of two, except below the smallest normal one
+    DiyFp upper = normalize((DiyFp) {(v.f << 1) + 1, v.e - 1});
+    bool closer_below = v.f == HIDDEN_BIT && v.e != 1 - EXPONENT_BIAS;
+    DiyFp lower = closer_below ? (DiyFp) {(v.f << 2) - 1, v.e - 2} : (DiyFp) {(v.f << 1) - 1, v.e - 1};
+    lower.f <<= lower.e - upper.e;
+    lower.e = upper.e;
+
+    DiyFp power = cached_power(upper.e, k);
+    DiyFp w = multiply(normalize(v), power);
+    DiyFp high = multiply(upper, power);
+    DiyFp low = multiply(lower, power);
+    return generate_digits(low, w, high, digits, length, k);
+}
+
+static int write_exponent(int exponent, char *buffer) {
+    int length = 0;
+    buffer[length++] = 'e';
+    buffer[length++] = exponent < 0 ? '-' : '+';
+    if (exponent < 0) exponent = -exponent;
+    if (exponent >= 100) buffer[length++] = (char) ('0' + exponent / 100);
+    if (exponent >= 10) buffer[length++] = (char) ('0' + exponent / 10 % 10);
+    buffer[length++] = (char) ('0' + exponent % 10);
+    return length;
+}
+
+// Lay out digits * 10^k with the decimal point where it belongs.
+static int write_decimal(const char *digits, int length, int k, char *buffer) {
+    // the position of the decimal point relative to the first digit
+    int point = length + k;
+
+    if (k >= 0 && point <= 21) {
+        // an integer: 1234e2 is 123400
+        memcpy(buffer, digits, (size_t) length);
+        memset(buffer + length, '0', (size_t) k);
+        return point;
+    }
+
+    if (point > 0 && point <= 21) {
+        // 1234e-2 is 12.34
+        memcpy(buffer, digits, (size_t) point);
+        buffer[point] = '.';
+        memcpy(buffer + point + 1, digits + point, (size_t) (length - point));
+        return length + 1;
+    }
+
+    if (point > -6 && point <= 0) {
+        // 1234e-6 is 0.001234
+        buffer[0] = '0';
+        buffer[1] = '.';
+        memset(buffer + 2, '0', (size_t) -point);
+        memcpy(buffer + 2 - point, digits, (size_t) length);
+        return 2 - point + length;
+    }
+
+    // scientific notation: 1234e30 is 1.234e+33
+    int written = 0;
+    buffer[written++] = digits[0];
+    if (length > 1) {
+        buffer[written++] = '.';
+        memcpy(buffer + written, digits + 1, (size_t) (length - 1));
+        written += length - 1;
+    }
+    return written + write_exponent(point - 1, buffer + written);
+}
+
+// Integers below 2^53 are exact as doubles, and all integers are written by
+// plain division.
+static int write_integer(uint64_t integer, char *buffer) {
+    char digits[20];
+    int length = 0;
+    do {
+        digits[sizeof(digits) - 1 - length++] = (char) ('0' + integer % 10);
+        integer /= 10;
+    } while (integer != 0);
+
+    memcpy(buffer, digits + sizeof(digits) - length, (size_t) length);
+    return length;
+}
+
+// Whether significand * 10^exponent parses back to value.
+static bool reads_back(uint64_t significand, int exponent, double value) {
+    char text[NUMBER_BUFFER_SIZE];
+    snprintf(text, sizeof(text), "%" PRIu64 "e%d", significand, exponent);
+    return strtod(text, NULL) == value;
+}
+
+// Round a positive number to precision significant digits with the C
+// library, which is exact but slow, into significand * 10^exponent. Returns
+// whether those or, below a power of two where the interval that reads back
+// is lopsided, their neighbour parse back to the number.
+static bool round_slowly(double value, int precision, uint64_t *significand, int *exponent) {
+    char text[NUMBER_BUFFER_SIZE];
+    snprintf(text, sizeof(text), "%.*e", precision - 1, value);
+
+    // d.ddde+x
+    const char *p = text;
+    *significand = 0;
+    for (; *p != 'e'; p++) {
+        if (*p != '.') *significand = *significand * 10 + (uint64_t) (*p - '0');
+    }
+    *exponent = atoi(p + 1) - (precision - 1);
+
+    if (reads_back(*significand, *exponent, value)) return true;
+    if (reads_back(*significand + 1, *exponent, value)) {
+        (*significand)++;
+        return true;
+    }
+    if (*significand > 1 && reads_back(*significand - 1, *exponent, value)) {
+        (*significand)--;
+        return true;
+    }
+    return false;
+}
+
+// The shortest digits of a positive number where Grisu3 cannot tell them.
+// A precision that reads back stays so with more digits, so the shortest one
+// is searched for from the number of digits Grisu3 got, which is seldom off
+// by more than one; 17 digits always read back.
+static int shortest_slowly(double value, int guess, char *digits, int *k) {
+    uint64_t significand;
+    int exponent;
+    int fewest = 1;
+    int shortest = guess < 1 ? 1 : guess > 17 ? 17 : guess;
+    while (!round_slowly(value, shortest, &significand, &exponent)) {
+        fewest = ++shortest;
+    }
+
+    int precision = shortest - 1;
+    while (fewest < shortest) {
+        uint64_t rounded;
+        int rounded_exponent;
+        if (round_slowly(value, precision, &rounded, &rounded_exponent)) {
+            shortest = precision;
+            significand = rounded;
+            exponent = rounded_exponent;
+        } else {
+            fewest = precision + 1;
+        }
+        precision = (fewest + shortest) / 2;
+    }
+
+    while (significand % 10 == 0) {
+        significand /= 10;
+        exponent++;
+    }
+    *k = exponent;
+    return write_integer(significand, digits);
+}
+
+int format_number(double value, char *buffer) {
+    int length = 0;
+
+    if (isnan(value)) {
+        memcpy(buffer, "nan", 4);
+        return 3;
+    }
+    if (signbit(value)) {
+        buffer[length++] = '-';
+        value = -value;
+    }
+
+    if (isinf(value)) {
+        memcpy(buffer + length, "inf", 4);
+        return length + 3;
+    }
+
+    if (value < 9007199254740992.0 && value == (double) (uint64_t) value) {
+        length += write_integer((uint64_t) value, buffer + length);
+    } else {
+        char digits[20];
+        int k;
+        int count;
+        if (!grisu3(value, digits, &count, &k)) count = shortest_slowly(value, count, digits, &k);
+        length += write_decimal(digits, count, k, buffer + length);
+    }
+
+    buffer[length] = '\0';
+    return length;
+}
+
+int format_integer(int64_t value, char *buffer) {
+    int length = 0;
+    // the magnitude of the most negative integer only fits unsigned
+    uint64_t magnitude = (uint64_t) value;
+    if (value < 0) {
+        buffer[length++] = '-';
+        magnitude = 0 - magnitude;
+    }
+
+    length += write_integer(magnitude, buffer + length);
+    buffer[length] = '\0';
+    return length;
+}
+
+// Powers of ten that doubles hold exactly.
+static const double exact_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define MAX_EXACT_POWER 22
+#define MAX_EXACT_INTEGER ((uint64_t) 1 << 53)
+
+// Parse what the fast path cannot with the C library, which is exact but slower.
+static double parse_slowly(const char *chars, int length) {
+    char small[64];
+    char *copy = length < (int) sizeof(small) ? small : (char *)malloc((size_t) length + 1);
+    if (copy == NULL) exit(1);
+    memcpy(copy, chars, (size_t) length);
+    copy[length] = '\0';
+
+    double value = strtod(copy, NULL);
+    if (copy != small) free(copy);
+    return value;
+}
+
+bool parse_number(const char *chars, int length, double *value) {
+    const char *p = chars;
+    const char *end = chars + length;
+
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+
+    // the significant digits, as an integer, and the power of ten they are scaled by
+    uint64_t significand = 0;
+    int digit_count = 0;
+    int exponent = 0;
+    bool truncated = false;
+
+    const char *digits = p;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (digit_count < 19) {
+            significand = significand * 10 + (uint64_t) (*p - '0');
+            if (significand != 0) digit_count++;
+        } else {
+            exponent++;
+            truncated = truncated || *p != '0';
+        }
+    }
+    bool has_digits = p > digits;
+
+    if (p < end && *p == '.') {
+        p++;
+        const char *fraction = p;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (digit_count < 19) {
+                significand = significand * 10 + (uint64_t) (*p - '0');
+                if (significand != 0) digit_count++;
+                exponent--;
+            } else {
+                truncated = truncated || *p != '0';
+            }
+        }
+        has_digits = has_digits || p > fraction;
+    }
+    if (!has_digits) return false;
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool negative_exponent = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+')) p++;
+        if (p == end || *p < '0' || *p > '9') return false;
+
+        int written = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            // past any exponent a double can have, the digits only matter to strtod
+            if (written < 100000) written = written * 10 + (*p - '0');
+        }
+        exponent += negative_exponent ? -written : written;
+    }
+    if (p != end) return false;
+
+    // Clinger's fast path: an integer that fits in a double's significand,
+    // scaled by an exact power of ten, is correctly rounded by a single
+    // multiplication or division.
+    if (!truncated && significand <= MAX_EXACT_INTEGER && exponent >= -MAX_EXACT_POWER &&
+        exponent <= MAX_EXACT_POWER) {
+        double result = (double) significand;
+        result = exponent < 0 ? result / exact_powers_of_ten[-exponent] : result * exact_powers_of_ten[exponent];
+        *value = negative ? -result : result;
+        return true;
+    }
+
+    if (significand == 0 && !truncated) {
+        *value = negative ? -0.0 : 0.0;
+        return true;
+    }
+
+    *value = parse_slowly(chars, length);
+    return true;
+}
+
+bool parse_integer(const char *chars, int length, int64_t *value) {
+    const char *p = chars;
+    const char *end = chars + length;
+
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    if (p == end) return false;
+
+    // accumulated as a magnitude, which for the most negative integer is one
+    // past the largest positive one
+    uint64_t limit = negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+    uint64_t magnitude = 0;
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9') return false;
+        uint64_t digit = (uint64_t) (*p - '0');
+        if (magnitude > (limit - digit) / 10) return false;
+        magnitude = magnitude * 10 + digit;
+    }
+
+    *value = negative ? (int64_t) (0 - magnitude) : (int64_t) magnitude;
+    return true;
+}
+
+bool number_to_integer(double value, int64_t *integer) {
+    // -2^63 is exact as a double, and so is 2^63, the first value past the range
+    if (!(value >= -9223372036854775808.0 && value < 9223372036854775808.0)) return false;
+    int64_t truncated = (int64_t) value;
+    if ((double) truncated != value) return false;
+    *integer = truncated;
+    return true;
+}
+
+NumberOrder compare_integer_to_double(int64_t integer, double number) {
+    if (number != number) return ORDER_UNORDERED;
+
+    // doubles from 2^63 up, and below -2^63, are beyond every integer
+    if (number >= 9223372036854775808.0) return ORDER_LESS;
+    if (number < -9223372036854775808.0) return ORDER_GREATER;
+
+    // the integer part of the double is exact in range, and so is what is
+    // left of the double without it
+    int64_t truncated = (int64_t) number;
+    if (integer != truncated) return integer < truncated ? ORDER_LESS : ORDER_GREATER;
+    double fraction = number - (double) truncated;
+    if (fraction > 0) return ORDER_LESS;
+    if (fraction < 0) return ORDER_GREATER;
+    return ORDER_EQUAL;
+}
@@ -2,7 +2,9 @@
 #include <string.h>
 
 #include "memory.h"
+#include "number.h"
 #include "object.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -14,6 +16,9 @@ static Obj *allocate_object(size_t size, ObjType type) {
     // allocate a new object onto the heap
     Obj *object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
+    // new objects are born in the current epoch, which makes them black when
+    // allocated during a collection and white once the next cycle starts.
+    object->mark = vm.mark_epoch;
 
     // insert the new object into the linked list of objects
     object->next = vm.objects;
@@ -26,41 +31,149 @@ static Obj *allocate_object(size_t size, ObjType type) {
 ObjFunction *new_function() {
     ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
+    function->max_slots = 0;
     function->name = NULL;
+    function->source = NULL;
+    function->source_length = 0;
+    function->source_line = 0;
+    function->path = NULL;
     initialize_module(&function->module);
     return function;
 }
 
-ObjRange *allocate_range(double start, double end) {
+ObjNative *new_native(NativeFn function) {
+    ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    native->function = function;
+    return native;
+}
+
+ObjRange *allocate_range(Value start, Value end) {
     ObjRange *range = ALLOCATE_OBJ(ObjRange, OBJ_RANGE);
     range->start = start;
     range->end = end;
     return range;
 }
 
+ObjArray *allocate_array(ArrayKind kind, int count) {
+    ObjArray *array = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
+    array->kind = kind;
+    array->count = 0;
+    array->as.doubles = NULL;
+
+    // the array is kept on the stack while its elements are allocated, and
+    // only counts them once they are
+    if (count > 0) {
+        push(OBJ_VAL(array));
+        double *elements = ALLOCATE(double, count);
+        memset(elements, 0, sizeof(double) * (size_t) count);
+        array->as.doubles = elements;
+        array->count = count;
+        pop();
+    }
+    return array;
+}
+
+Value read_array(ObjArray *array, int index) {
+    if (array->kind == ARRAY_INT) return INT_VAL(array->as.integers[index]);
+    return NUMBER_VAL(array->as.doubles[index]);
+}
+
+bool store_array(ObjArray *array, int index, Value value) {
+    if (!IS_NUMBER(value)) return false;
+
+    if (array->kind == ARRAY_DOUBLE) {
+        array->as.doubles[index] = AS_NUMBER(value);
+        return true;
+    }
+
+    if (IS_INT(value)) {
+        array->as.integers[index] = AS_INT(value);
+        return true;
+    }
+    return number_to_integer(AS_DOUBLE(value), &array->as.integers[index]);
+}
+
 ObjList *allocate_list() {
     ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
     list->count = 0;
     list->capacity = 0;
     list->items = NULL;
+    list->base = NULL;
     return list;
 }
 
+// Give a view a copy of its items, so that it can be changed without
+// changing the lists it shares them with.
+static void own_items(ObjList *list) {
+    push(OBJ_VAL(list));
+    Value *items = ALLOCATE(Value, list->count);
+    memcpy(items, list->items, sizeof(Value) * (size_t) list->count);
+    list->items = items;
+    list->capacity = list->count;
+    list->base = NULL;
+    pop();
+}
+
+ObjList *slice_list(ObjList *list, int start, int end) {
+    if (start >= end) return allocate_list();
+
+    push(OBJ_VAL(list));
+
+    // a list that owns its items first hands them to a new base, and becomes
+    // a view of all of them
+    if (list->base == NULL) {
+        ObjList *base = allocate_list();
+        base->count = list->count;
+        base->capacity = list->capacity;
+        base->items = list->items;
+        list->capacity = 0;
+        list->base = base;
+    }
+
+    ObjList *view = allocate_list();
+    view->count = end - start;
+    view->items = list->items + start;
+    view->base = list->base;
+
+    // a view made while marking is born black and never traced, so what it
+    // shares is shaded now, before a change to the list can copy it away
+    if (vm.gc_phase == GC_PHASE_MARK) {
+        mark_object((Obj*)view->base);
+        for (int i = 0; i < view->count; i++) mark_value(view->items[i]);
+    }
+    pop();
+    return view;
+}
+
 void append_to_list(ObjList *list, Value value) {
+    if (list->base != NULL) own_items(list);
+
     // calculate new capacity and reallocate if necessary
     if (list->capacity < list->count + 1) {
-        int old_capacity = list->capacity;
-        list->capacity = GROW_CAPACITY(old_capacity);
-        list->items = GROW_ARRAY(list->items, Value, old_capacity, list->capacity);
+        // the capacity is only updated once the allocation succeeded, an
+        // out-of-memory error must leave the list intact.
+        int capacity = GROW_CAPACITY(list->capacity);
+        list->items = GROW_ARRAY(list->items, Value, list->capacity, capacity);
+        list->capacity = capacity;
     }
 
     // append the value to the list
+    WRITE_BARRIER(value);
     list->items[list->count] = value;
     list->count++;
 }
 
 void store_list(ObjList *list, int index, Value value) {
+    // the value may not be reachable from anywhere else while a view copies
+    // its items
+    if (list->base != NULL) {
+        push(value);
+        own_items(list);
+        pop();
+    }
+
     // store the value in the list
+    WRITE_BARRIER(value);
     list->items[index] = value;
 }
 
@@ -70,6 +183,8 @@ Value read_list(ObjList *list, int index) {
 }
 
 void delete_from_list(ObjList *list, int index) {
+    if (list->base != NULL) own_items(list);
+
     // delete the value from the list
     for (int i = index; i < list->count - 1; i++) {
         list->items[i] = list->items[i + 1];
@@ -84,15 +199,6 @@ bool is_valid_index(ObjList *list, int index) {
     return index >= 0 && index < list->count;
 }
 
-static ObjString *allocate_string(char *chars, int length, uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
-    table_set(&vm.strings, string, NIL_VAL);
-    return string;
-}
-
 static uint32_t hash_string(const char *key, int length) {
     // FNV-la hash function
     uint32_t hash = 2166136261u;
@@ -104,38 +210,80 @@ static uint32_t hash_string(const char *key, int length) {
     return hash;
 }
 
-ObjString *take_string(char *chars, int length) {
-    // calculate the hash of the string
-    uint32_t hash = hash_string(chars, length);
+// Allocate a string of the given length, for the caller to fill in. The
+// object comes first and only owns its characters once they are allocated, so
+// an out-of-memory error in between leaves nothing the collector cannot free.
+static ObjString *allocate_string(int length) {
+    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    string->length = 0;
+    string->chars = NULL;
+    string->hash = 0;
+
+    push(OBJ_VAL(string));
+    char *chars = ALLOCATE(char, length + 1);
+    chars[length] = '\0';
+    string->chars = chars;
+    string->length = length;
+    pop();
+
+    return string;
+}
+
+// Find the interned string equal to the given characters, or NULL. During a
+// sweep, the table may still hold a string that was not reached, until the
+// sweep frees it: being found makes it live again.
+static ObjString *find_interned(const char *chars, int length, uint32_t hash) {
     ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+    if (interned != NULL && vm.gc_phase == GC_PHASE_SWEEP) interned->obj.mark = vm.mark_epoch;
+    return interned;
+}
+
+static void intern_string(ObjString *string, uint32_t hash) {
+    string->hash = hash;
+
+    // keep the string reachable in case interning it triggers a collection
+    push(OBJ_VAL(string));
+    table_set(&vm.strings, string, NIL_VAL);
+    pop();
+}
+
+ObjString *concatenate_strings(ObjString *a, ObjString *b) {
+    // the result is built in place, it is only known whether an equal
+    // string exists once its characters are
+    ObjString *result = allocate_string(a->length + b->length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
 
+    uint32_t hash = hash_string(result->chars, result->length);
+    ObjString *interned = find_interned(result->chars, result->length, hash);
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        // the unused string is left to the collector, without its characters
+        FREE_ARRAY(char, result->chars, result->length + 1);
+        result->chars = NULL;
+        result->length = 0;
         return interned;
     }
 
-    // return the new string
-    return allocate_string(chars, length, hash);
+    intern_string(result, hash);
+    return result;
 }
 
 ObjString *copy_string(const char *chars, int length) {
     // calculate the hash of the string
     uint32_t hash = hash_string(chars, length);
-    ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+    ObjString *interned = find_interned(chars, length, hash);
 
     if (interned != NULL) {
         return interned;
     }
 
-    // allocate a new string onto the heap
-    char *heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-
-    // null-terminate the string
-    heap_chars[length] = '\0';
+    // copy the characters into a new string
+    ObjString *string = allocate_string(length);
+    memcpy(string->chars, chars, length);
 
     // return the new string
-    return allocate_string(heap_chars, length, hash);
+    intern_string(string, hash);
+    return string;
 }
 
 void print_object(Value value) {
@@ -144,7 +292,7 @@ void print_object(Value value) {
             print_function(AS_FUNCTION(value));
             break;
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            write_output(AS_CSTRING(value), (size_t) AS_STRING(value)->length);
             break;
         case OBJ_LIST:
             print_list(AS_LIST(value));
@@ -152,29 +300,95 @@ void print_object(Value value) {
         case OBJ_RANGE:
             print_range(AS_RANGE(value));
             break;
+        case OBJ_NATIVE:
+            print_output("<native fn>");
+            break;
+        case OBJ_ARRAY:
+            print_array(AS_ARRAY(value));
+            break;
     }
 }
 
 void print_function(ObjFunction *function) {
     if (function->name == NULL) {
-        printf("<script>");
+        print_output("<script>");
         return;
     }
 
-    printf("<fn %s>", function->name->chars);
+    print_output("<fn %s>", function->name->chars);
 }
 
 void print_list(ObjList* list) {
-    printf("[");
+    write_output("[", 1);
     for (int i = 0; i < list->count; i++) {
         print_value(list->items[i]); // Assume printValue is a function that can print Lox values correctly
         if (i < list->count - 1) {
-            printf(", ");
+            write_output(", ", 2);
         }
     }
-    printf("]");
+    write_output("]", 1);
+}
+
+void print_array(ObjArray *array) {
+    write_output("[", 1);
+    for (int i = 0; i < array->count; i++) {
+        print_value(read_array(array, i));
+        if (i < array->count - 1) {
+            write_output(", ", 2);
+        }
+    }
+    write_output("]", 1);
 }
 
 void print_range(ObjRange* range) {
-    printf("%g..%g", range->start, range->end);
+    print_value(range->start);
+    write_output("..", 2);
+    print_value(range->end);
+}
+
+const char *obj_type_name(ObjType type) {
+    switch (type) {
+        case OBJ_FUNCTION:
+            return "function";
+        case OBJ_STRING:
+            return "string";
+        case OBJ_LIST:
+            return "list";
+        case OBJ_RANGE:
+            return "range";
+        case OBJ_NATIVE:
+            return "native";
+        case OBJ_ARRAY:
+            return "array";
+    }
+
+    return "unknown"; // unreachable
+}
+
+size_t object_size(Obj *object) {
+    switch (object->type) {
+        case OBJ_FUNCTION: {
+            ObjFunction *function = (ObjFunction*)object;
+            return sizeof(ObjFunction) +
+                   function->module.capacity * sizeof(uint8_t) +
+                   function->module.line_capacity * sizeof(LineRun) +
+                   function->module.inline_capacity * sizeof(InlineRun) +
+                   function->module.constants.capacity * sizeof(Value) +
+                   (function->source != NULL ? function->source_length + 1 : 0);
+        }
+        case OBJ_STRING: {
+            ObjString *string = (ObjString*)object;
+            return sizeof(ObjString) + (string->chars != NULL ? string->length + 1 : 0);
+        }
+        case OBJ_LIST:
+            return sizeof(ObjList) + ((ObjList*)object)->capacity * sizeof(Value);
+        case OBJ_RANGE:
+            return sizeof(ObjRange);
+        case OBJ_NATIVE:
+            return sizeof(ObjNative);
+        case OBJ_ARRAY:
+            return sizeof(ObjArray) + ((ObjArray*)object)->count * sizeof(double);
+    }
+
+    return 0; // unreachable
 }
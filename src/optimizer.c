@@ -0,0 +1,456 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "number.h"
+#include "optimizer.h"
+
+// Every rewrite here must leave the behaviour of the script unchanged, runtime
+// errors included: only operations that cannot fail on the operands they see
+// are folded, and they are folded the way the VM would compute them. Nor may
+// it change which scripts compile: code that is removed could hold an error
+// compiling it reports, so statements are kept as unreachable instead, and an
+// operand that names a variable is never dropped.
+
+// the arena of the tree being optimized
+static _Thread_local AstArena *arena;
+
+static bool is_constant(Node *node) {
+    switch (node->type) {
+        case NODE_NUMBER:
+        case NODE_INTEGER:
+        case NODE_STRING:
+        case NODE_TRUE:
+        case NODE_FALSE:
+        case NODE_NIL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether a constant is truthy. Only nil and false are falsey.
+static bool is_truthy(Node *node) {
+    return node->type != NODE_NIL && node->type != NODE_FALSE;
+}
+
+static bool is_number(Node *node) {
+    return node->type == NODE_NUMBER || node->type == NODE_INTEGER;
+}
+
+// The value of a number constant as a double, the way the VM reads it.
+static double number_of(Node *node) {
+    return node->type == NODE_INTEGER ? (double) node->as.integer : node->as.number;
+}
+
+static bool constants_equal(Node *a, Node *b) {
+    // an integer equals the double with exactly the same value
+    if (a->type == NODE_INTEGER && b->type == NODE_INTEGER) return a->as.integer == b->as.integer;
+    if (a->type == NODE_NUMBER && b->type == NODE_NUMBER) return a->as.number == b->as.number;
+    if (a->type == NODE_INTEGER && b->type == NODE_NUMBER) {
+        return compare_integer_to_double(a->as.integer, b->as.number) == ORDER_EQUAL;
+    }
+    if (a->type == NODE_NUMBER && b->type == NODE_INTEGER) {
+        return compare_integer_to_double(b->as.integer, a->as.number) == ORDER_EQUAL;
+    }
+    if (a->type != b->type) return false;
+
+    switch (a->type) {
+        case NODE_STRING:
+            // strings are interned, so equal contents are the same object
+            return a->as.string.length == b->as.string.length &&
+                   memcmp(a->as.string.chars, b->as.string.chars, a->as.string.length) == 0;
+        default:
+            return true;
+    }
+}
+
+static void make_number(Node *node, double value) {
+    node->type = NODE_NUMBER;
+    node->as.number = value;
+}
+
+static void make_integer(Node *node, int64_t value) {
+    node->type = NODE_INTEGER;
+    node->as.integer = value;
+}
+
+static void make_bool(Node *node, bool value) {
+    node->type = value ? NODE_TRUE : NODE_FALSE;
+}
+
+// Replace a node by one of its operands, keeping the operand's token.
+static void replace(Node *node, Node *by) {
+    *node = *by;
+}
+
+static void fold_expression(Node *node);
+
+static void fold_unary(Node *node) {
+    Node *operand = node->as.operand;
+    fold_expression(operand);
+    if (!is_constant(operand)) return;
+
+    if (node->token.type == TK_BANG) {
+        make_bool(node, !is_truthy(operand));
+    } else if (operand->type == NODE_NUMBER) {
+        make_number(node, -operand->as.number);
+    } else if (operand->type == NODE_INTEGER) {
+        int64_t value = operand->as.integer;
+        if (value != INT64_MIN) {
+            make_integer(node, -value);
+        } else {
+            make_number(node, -(double) value);
+        }
+    }
+}
+
+// The remainder the VM computes, of operands that are integers or doubles
+// that hold them. The VM rejects fractions, and a zero divisor has no result.
+static void fold_remainder(Node *node, int64_t a, int64_t b) {
+    if (b != 0) make_integer(node, b == -1 ? 0 : a % b);
+}
+
+// Integers stay integers while the result fits in 64 bits, as in the VM.
+static void fold_integers(Node *node, int64_t a, int64_t b) {
+    int64_t result;
+    switch (node->token.type) {
+        case TK_PLUS:
+            if (__builtin_add_overflow(a, b, &result)) make_number(node, (double) a + (double) b);
+            else make_integer(node, result);
+            break;
+        case TK_MINUS:
+            if (__builtin_sub_overflow(a, b, &result)) make_number(node, (double) a - (double) b);
+            else make_integer(node, result);
+            break;
+        case TK_STAR:
+            if (__builtin_mul_overflow(a, b, &result)) make_number(node, (double) a * (double) b);
+            else make_integer(node, result);
+            break;
+        case TK_SLASH:
+            // integers that divide evenly give an integer
+            if (b != 0 && !(b == -1 && a == INT64_MIN) && a % b == 0) make_integer(node, a / b);
+            else make_number(node, (double) a / (double) b);
+            break;
+        case TK_PERCENT: fold_remainder(node, a, b); break;
+        case TK_GREATER: make_bool(node, a > b); break;
+        case TK_LESS: make_bool(node, a < b); break;
+        case TK_GREATER_EQUAL: make_bool(node, a >= b); break;
+        case TK_LESS_EQUAL: make_bool(node, a <= b); break;
+        default: break;
+    }
+}
+
+static void fold_numbers(Node *node, double a, double b) {
+    switch (node->token.type) {
+        case TK_PLUS: make_number(node, a + b); break;
+        case TK_MINUS: make_number(node, a - b); break;
+        case TK_STAR: make_number(node, a * b); break;
+        case TK_SLASH: make_number(node, a / b); break;
+        case TK_PERCENT: {
+            int64_t x, y;
+            if (number_to_integer(a, &x) && number_to_integer(b, &y)) fold_remainder(node, x, y);
+            break;
+        }
+        case TK_GREATER: make_bool(node, a > b); break;
+        case TK_LESS: make_bool(node, a < b); break;
+        // compiled as the negated opposite comparison, which differs for NaN
+        case TK_GREATER_EQUAL: make_bool(node, !(a < b)); break;
+        case TK_LESS_EQUAL: make_bool(node, !(a > b)); break;
+        default: break;
+    }
+}
+
+// A comparison of an integer with a double, given how the left operand
+// orders against the right. It is exact, as in the VM.
+static void fold_mixed_comparison(Node *node, NumberOrder order) {
+    switch (node->token.type) {
+        case TK_GREATER: make_bool(node, order == ORDER_GREATER); break;
+        case TK_LESS: make_bool(node, order == ORDER_LESS); break;
+        // compiled as the negated opposite comparison, which differs for NaN
+        case TK_GREATER_EQUAL: make_bool(node, order != ORDER_LESS); break;
+        case TK_LESS_EQUAL: make_bool(node, order != ORDER_GREATER); break;
+        default: break;
+    }
+}
+
+static bool is_comparison(TokenType operator) {
+    return operator == TK_GREATER || operator == TK_LESS || operator == TK_GREATER_EQUAL ||
+           operator == TK_LESS_EQUAL;
+}
+
+// Whether a number is a power of two, or its negation, in the normal range.
+static bool is_power_of_two(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint64_t exponent = (bits >> 52) & 0x7ff;
+    return (bits & 0xfffffffffffffull) == 0 && exponent != 0 && exponent != 0x7ff;
+}
+
+// Divide by a power of two as a multiplication by its reciprocal, which is
+// exact: both round the same product, and fail on the same operands. Only a
+// double divisor is replaced, since an integer that divides evenly by an
+// integer gives an integer, and the product would be a double.
+static void reduce_division(Node *node) {
+    Node *right = node->as.binary.right;
+    if (node->token.type != TK_SLASH || right->type != NODE_NUMBER) return;
+
+    double reciprocal = 1 / right->as.number;
+    if (is_power_of_two(right->as.number) && is_power_of_two(reciprocal)) {
+        node->token.type = TK_STAR;
+        right->as.number = reciprocal;
+    }
+}
+
+static void fold_binary(Node *node) {
+    Node *left = node->as.binary.left;
+    Node *right = node->as.binary.right;
+    fold_expression(left);
+    fold_expression(right);
+    if (!is_constant(left) || !is_constant(right)) {
+        reduce_division(node);
+        return;
+    }
+
+    TokenType operator = node->token.type;
+    if (operator == TK_EQUAL_EQUAL || operator == TK_BANG_EQUAL) {
+        make_bool(node, constants_equal(left, right) == (operator == TK_EQUAL_EQUAL));
+    } else if (left->type == NODE_INTEGER && right->type == NODE_INTEGER) {
+        fold_integers(node, left->as.integer, right->as.integer);
+    } else if (is_comparison(operator) && left->type == NODE_INTEGER && right->type == NODE_NUMBER) {
+        fold_mixed_comparison(node, compare_integer_to_double(left->as.integer, right->as.number));
+    } else if (is_comparison(operator) && left->type == NODE_NUMBER && right->type == NODE_INTEGER) {
+        // the order of the right operand against the left, turned around
+        NumberOrder order = compare_integer_to_double(right->as.integer, left->as.number);
+        if (order == ORDER_LESS) order = ORDER_GREATER;
+        else if (order == ORDER_GREATER) order = ORDER_LESS;
+        fold_mixed_comparison(node, order);
+    } else if (is_number(left) && is_number(right)) {
+        fold_numbers(node, number_of(left), number_of(right));
+    } else if (operator == TK_PLUS && left->type == NODE_STRING && right->type == NODE_STRING) {
+        int length = left->as.string.length + right->as.string.length;
+        char *chars = ast_allocate(arena, (size_t) length + 1);
+        memcpy(chars, left->as.string.chars, left->as.string.length);
+        memcpy(chars + left->as.string.length, right->as.string.chars, right->as.string.length);
+
+        node->type = NODE_STRING;
+        node->as.string.chars = chars;
+        node->as.string.length = length;
+    }
+}
+
+// Whether an expression reads or assigns a variable anywhere in it. Compiling
+// the name can report an error, such as a local read in its own initializer.
+static bool names_variable(Node *node) {
+    switch (node->type) {
+        case NODE_VARIABLE:
+        case NODE_ASSIGN:
+            return true;
+        case NODE_UNARY:
+            return names_variable(node->as.operand);
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            return names_variable(node->as.binary.left) || names_variable(node->as.binary.right);
+        case NODE_CALL:
+            if (names_variable(node->as.call.callee)) return true;
+            for (int i = 0; i < node->as.call.arguments.count; i++) {
+                if (names_variable(node->as.call.arguments.items[i])) return true;
+            }
+            return false;
+        case NODE_LIST:
+            for (int i = 0; i < node->as.items.count; i++) {
+                if (names_variable(node->as.items.items[i])) return true;
+            }
+            return false;
+        case NODE_INDEX:
+        case NODE_STORE_INDEX:
+            return names_variable(node->as.subscript.list) || names_variable(node->as.subscript.index) ||
+                   (node->as.subscript.value != NULL && names_variable(node->as.subscript.value));
+        default:
+            return false;
+    }
+}
+
+static void fold_list(NodeList *list) {
+    for (int i = 0; i < list->count; i++) fold_expression(list->items[i]);
+}
+
+static void fold_expression(Node *node) {
+    switch (node->type) {
+        case NODE_ASSIGN:
+            fold_expression(node->as.value);
+            break;
+        case NODE_UNARY:
+            fold_unary(node);
+            break;
+        case NODE_BINARY:
+            fold_binary(node);
+            break;
+        case NODE_AND:
+        case NODE_OR: {
+            // both produce their left operand when it decides the result, and
+            // their right operand otherwise
+            Node *left = node->as.binary.left;
+            fold_expression(left);
+            fold_expression(node->as.binary.right);
+            if (is_constant(left)) {
+                bool decided = node->type == NODE_AND ? !is_truthy(left) : is_truthy(left);
+                if (!decided) {
+                    replace(node, node->as.binary.right);
+                } else if (!names_variable(node->as.binary.right)) {
+                    replace(node, left);
+                }
+            }
+            break;
+        }
+        case NODE_CALL:
+            fold_expression(node->as.call.callee);
+            fold_list(&node->as.call.arguments);
+            break;
+        case NODE_LIST:
+            fold_list(&node->as.items);
+            break;
+        case NODE_INDEX:
+        case NODE_STORE_INDEX:
+            fold_expression(node->as.subscript.list);
+            fold_expression(node->as.subscript.index);
+            if (node->as.subscript.value != NULL) fold_expression(node->as.subscript.value);
+            break;
+        default:
+            break;
+    }
+}
+
+// Whether control never reaches the statement after this one. There is no
+// break statement, so a loop on a truthy constant can only be left by a return.
+static bool terminates(Node *node) {
+    switch (node->type) {
+        case NODE_RETURN:
+            return true;
+        case NODE_BLOCK:
+            // the statements after one that never completes are unreachable
+            for (int i = 0; i < node->as.items.count; i++) {
+                if (terminates(node->as.items.items[i])) return true;
+            }
+            return false;
+        case NODE_IF:
+            return node->as.branch.else_branch != NULL &&
+                   terminates(node->as.branch.then_branch) && terminates(node->as.branch.else_branch);
+        case NODE_WHILE:
+            return is_constant(node->as.branch.condition) && is_truthy(node->as.branch.condition);
+        default:
+            return false;
+    }
+}
+
+static Node *optimize_statement(Node *node);
+
+// Keep a statement that can never run, rather than remove it.
+static Node *unreachable(Node *node) {
+    Node *wrapper = new_node(arena, NODE_UNREACHABLE, node->token);
+    append_node(arena, &wrapper->as.items, node);
+    return wrapper;
+}
+
+// Optimize a list of statements, dropping the removed ones. Everything after
+// a statement that never completes is kept as one unreachable statement.
+static void optimize_statements(NodeList *statements) {
+    int count = 0;
+    for (int i = 0; i < statements->count; i++) {
+        Node *statement = optimize_statement(statements->items[i]);
+        if (statement == NULL) continue;
+
+        statements->items[count++] = statement;
+        if (!terminates(statement) || i + 1 == statements->count) continue;
+
+        Node *rest = unreachable(statements->items[i + 1]);
+        for (int j = i + 2; j < statements->count; j++) append_node(arena, &rest->as.items, statements->items[j]);
+        statements->items[count++] = rest;
+        break;
+    }
+
+    statements->count = count;
+}
+
+// Optimize a statement. Returns what replaces it, or NULL to remove it.
+static Node *optimize_statement(Node *node) {
+    switch (node->type) {
+        case NODE_EXPRESSION_STATEMENT:
+            fold_expression(node->as.expression);
+            // a constant has no effect
+            return is_constant(node->as.expression) ? NULL : node;
+        case NODE_PRINTLN:
+            fold_expression(node->as.expression);
+            return node;
+        case NODE_RETURN:
+            if (node->as.expression != NULL) fold_expression(node->as.expression);
+            return node;
+        case NODE_LET:
+            if (node->as.value != NULL) fold_expression(node->as.value);
+            return node;
+        case NODE_FUNCTION:
+            optimize_statements(&node->as.function.body);
+            return node;
+        case NODE_BLOCK:
+        case NODE_SCRIPT:
+            optimize_statements(&node->as.items);
+            return node;
+        case NODE_IF: {
+            Node *condition = node->as.branch.condition;
+            fold_expression(condition);
+
+            if (is_constant(condition)) {
+                // only the branch taken is compiled, it is a block with its own
+                // scope. the other is kept unreachable, and the two are held in
+                // their order by a block that declares nothing.
+                bool taken = is_truthy(condition);
+                Node *live = taken ? node->as.branch.then_branch : node->as.branch.else_branch;
+                Node *dead = taken ? node->as.branch.else_branch : node->as.branch.then_branch;
+                if (live != NULL) live = optimize_statement(live);
+                if (dead == NULL) return live;
+
+                Node *block = new_node(arena, NODE_BLOCK, node->token);
+                if (!taken) append_node(arena, &block->as.items, unreachable(dead));
+                if (live != NULL) append_node(arena, &block->as.items, live);
+                if (taken) append_node(arena, &block->as.items, unreachable(dead));
+                return block;
+            }
+
+            Node *then_branch = optimize_statement(node->as.branch.then_branch);
+            Node *else_branch = node->as.branch.else_branch != NULL
+                                ? optimize_statement(node->as.branch.else_branch) : NULL;
+
+            if (then_branch == NULL) {
+                // the then clause is always compiled, keep it as an empty block
+                then_branch = new_node(arena, NODE_BLOCK, node->token);
+            }
+            node->as.branch.then_branch = then_branch;
+            node->as.branch.else_branch = else_branch;
+            return node;
+        }
+        case NODE_WHILE: {
+            Node *condition = node->as.branch.condition;
+            fold_expression(condition);
+            if (is_constant(condition) && !is_truthy(condition)) return unreachable(node);
+
+            Node *body = optimize_statement(node->as.branch.then_branch);
+            node->as.branch.then_branch = body != NULL ? body : new_node(arena, NODE_BLOCK, node->token);
+            return node;
+        }
+        case NODE_FOR_IN: {
+            fold_expression(node->as.for_in.iterable);
+
+            Node *body = optimize_statement(node->as.for_in.body);
+            node->as.for_in.body = body != NULL ? body : new_node(arena, NODE_BLOCK, node->token);
+            return node;
+        }
+        default:
+            return node;
+    }
+}
+
+void optimize(Node *script, AstArena *ast_arena) {
+    arena = ast_arena;
+    optimize_statement(script);
+    arena = NULL;
+}
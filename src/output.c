@@ -0,0 +1,77 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output.h"
+#include "vm.h"
+
+void initialize_output() {
+    vm.output.length = 0;
+    vm.output.line_buffered = isatty(STDOUT_FILENO) != 0;
+}
+
+static void write_all(const char *chars, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(STDOUT_FILENO, chars, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            // stdout is gone, like a closed pipe: the output is dropped
+            return;
+        }
+        chars += written;
+        length -= (size_t) written;
+    }
+}
+
+void flush_output() {
+    write_all(vm.output.chars, vm.output.length);
+    vm.output.length = 0;
+}
+
+void write_output(const char *chars, size_t length) {
+    OutputBuffer *output = &vm.output;
+    if (output->length + length > OUTPUT_BUFFER_SIZE) {
+        flush_output();
+
+        // what does not fit in an empty buffer is written as it is
+        if (length > OUTPUT_BUFFER_SIZE) {
+            write_all(chars, length);
+            return;
+        }
+    }
+
+    memcpy(output->chars + output->length, chars, length);
+    output->length += length;
+}
+
+void print_output(const char *format, ...) {
+    OutputBuffer *output = &vm.output;
+    va_list args;
+
+    // format straight into the buffer when it fits, which it nearly always does
+    va_start(args, format);
+    size_t available = OUTPUT_BUFFER_SIZE - output->length;
+    int length = vsnprintf(output->chars + output->length, available, format, args);
+    va_end(args);
+    if (length < 0) return;
+    if ((size_t) length < available) {
+        output->length += (size_t) length;
+        return;
+    }
+
+    char *chars = (char *)malloc((size_t) length + 1);
+    if (chars == NULL) exit(1);
+    va_start(args, format);
+    vsnprintf(chars, (size_t) length + 1, format, args);
+    va_end(args);
+    write_output(chars, (size_t) length);
+    free(chars);
+}
+
+void end_output_line() {
+    write_output("\n", 1);
+    if (vm.output.line_buffered) flush_output();
+}
@@ -0,0 +1,389 @@
+#include "memory.h"
+#include "peephole.h"
+
+// The longest chain of jumps followed when threading a jump. Chains are short
+// in practice, the limit only guards against cycles.
+#define MAX_THREADING_HOPS 16
+
+// A decoded instruction. Offsets, jump targets included, are offsets in the
+// code being rewritten until the code is laid out again.
+typedef struct {
+    uint8_t op;
+    // whether the instruction has the OP_WIDE prefix
+    bool wide;
+    uint32_t operand;
+    int line;
+    // the run of inlined code the instruction belongs to, or -1
+    int inlined;
+    uint32_t offset;
+    uint32_t target;
+} Instruction;
+
+static bool is_jump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE || op == OP_LOOP ||
+           op == OP_JUMP_IF_CALLEE;
+}
+
+// The length of an instruction's index or count operand.
+static int operand_length(uint8_t op, bool wide) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_ADD_LOCAL_NN:
+        case OP_SUBTRACT_LOCAL_NN:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_IMPORT:
+        case OP_CALL:
+        case OP_BUILD_LIST:
+        case OP_POPN:
+        case OP_JUMP_IF_CALLEE:
+        case OP_PEEK:
+        case OP_POP_UNDER:
+            return wide ? 3 : 1;
+        default:
+            return 0;
+    }
+}
+
+// The length of a jump's offset, which follows any other operand.
+static int offset_length(uint8_t op, bool wide) {
+    return is_jump(op) ? (wide ? 4 : 2) : 0;
+}
+
+static uint32_t instruction_length(Instruction *instruction) {
+    return (instruction->wide ? 2 : 1) + operand_length(instruction->op, instruction->wide) +
+           offset_length(instruction->op, instruction->wide);
+}
+
+static uint32_t read_bytes(uint8_t *code, uint32_t start, int length) {
+    uint32_t value = 0;
+    for (int i = 0; i < length; i++) value = value << 8 | code[start + i];
+    return value;
+}
+
+static void write_bytes(uint8_t *code, uint32_t start, int length, uint32_t value) {
+    for (int i = 0; i < length; i++) code[start + i] = (value >> 8 * (length - 1 - i)) & 0xff;
+}
+
+// The number of values an instruction leaves on the stack, less the number it takes.
+static int stack_effect(Instruction *instruction) {
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DUPLICATE:
+        case OP_GET_REGISTER:
+        case OP_RANGE_START:
+        case OP_RANGE_END:
+        case OP_PEEK:
+        case OP_IMPORT:
+        // the callee it pushes when it does not jump
+        case OP_JUMP_IF_CALLEE:
+            return 1;
+        case OP_RETURN:
+        case OP_POP:
+        case OP_PRINTLN:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_REGISTER:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_ADD_NN:
+        case OP_SUBTRACT_NN:
+        case OP_MULTIPLY_NN:
+        case OP_DIVIDE_NN:
+        case OP_GREATER_NN:
+        case OP_LESS_NN:
+        case OP_LESS_EQUAL_NN:
+        case OP_GREATER_EQUAL_NN:
+        case OP_ADD_LOCAL_NN:
+        case OP_SUBTRACT_LOCAL_NN:
+        case OP_BUILD_RANGE:
+        case OP_INDEX_LIST:
+            return -1;
+        case OP_STORE_LIST:
+        case OP_SLICE_LIST:
+            return -2;
+        case OP_POPN:
+        case OP_CALL:
+        case OP_POP_UNDER:
+            return -(int) instruction->operand;
+        case OP_BUILD_LIST:
+            return 1 - (int) instruction->operand;
+        default:
+            return 0;
+    }
+}
+
+// The comparison that gives the opposite result of op, or 0 for instructions
+// that are not fused with a following OP_NOT.
+static uint8_t negated(uint8_t op) {
+    switch (op) {
+        case OP_EQUAL: return OP_NOT_EQUAL;
+        case OP_LESS: return OP_GREATER_EQUAL;
+        case OP_GREATER: return OP_LESS_EQUAL;
+        case OP_LESS_NN: return OP_GREATER_EQUAL_NN;
+        case OP_GREATER_NN: return OP_LESS_EQUAL_NN;
+        default: return 0;
+    }
+}
+
+// The distance a jump covers once the code is laid out at new_offsets.
+static uint32_t jump_distance(Instruction *instruction, uint32_t *new_offsets) {
+    uint32_t end = new_offsets[instruction->offset] + instruction_length(instruction);
+    uint32_t target = new_offsets[instruction->target];
+    return instruction->op == OP_LOOP ? end - target : target - end;
+}
+
+// Follow the jumps a jump lands on to its final destination.
+static uint32_t thread_jump(Instruction *instructions, int instruction_count, int *index_of, Instruction *jump) {
+    uint8_t op = jump->op;
+    uint32_t target = jump->target;
+
+    for (int hops = 0; hops < MAX_THREADING_HOPS && index_of[target] < instruction_count; hops++) {
+        Instruction *next = &instructions[index_of[target]];
+
+        if (next->op == OP_JUMP || (next->op == OP_LOOP && (op == OP_JUMP || op == OP_LOOP))) {
+            // unconditional jumps can be passed through, but conditional
+            // jumps only have a forward form
+            if (op != OP_JUMP && op != OP_LOOP && next->target <= jump->offset) break;
+            target = next->target;
+        } else if (next->op == op && (op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE)) {
+            // the condition is still on the stack and decides the same way
+            target = next->target;
+        } else if ((op == OP_JUMP_IF_FALSE && next->op == OP_JUMP_IF_TRUE) ||
+                   (op == OP_JUMP_IF_TRUE && next->op == OP_JUMP_IF_FALSE)) {
+            // the opposite test on the same condition never jumps
+            target = next->offset + instruction_length(next);
+        } else {
+            break;
+        }
+    }
+
+    return target;
+}
+
+// The scratch arrays of the code being finished, in one block. An
+// out-of-memory error unwinds past the call that allocated it, so the block
+// is kept here and a stale one is freed by the next call.
+static char *scratch = NULL;
+static size_t scratch_size = 0;
+
+static void free_scratch() {
+    FREE_ARRAY(char, scratch, scratch_size);
+    scratch = NULL;
+    scratch_size = 0;
+}
+
+int finish_code(Module *module, FarJump *far_jumps, int far_jump_count, int entry_depth, bool optimize) {
+    uint32_t count = module->count;
+    if (count == 0) return entry_depth;
+
+    if (scratch != NULL) free_scratch();
+    size_t size_of_instructions = sizeof(Instruction) * count;
+    size_t size_of_offsets = sizeof(uint32_t) * (count + 1);
+    size_t size_of_indices = sizeof(int) * (count + 1);
+    size_t total = size_of_instructions + size_of_offsets + 2 * size_of_indices + sizeof(bool) * (count + 1);
+    scratch = ALLOCATE(char, total);
+    scratch_size = total;
+
+    // the arrays are laid out from the most strictly aligned down
+    Instruction *instructions = (Instruction*) scratch;
+    uint32_t *new_offsets = (uint32_t*) (scratch + size_of_instructions);
+    int *index_of = (int*) (scratch + size_of_instructions + size_of_offsets);
+    int *depths = (int*) (scratch + size_of_instructions + size_of_offsets + size_of_indices);
+    bool *is_target = (bool*) (scratch + size_of_instructions + size_of_offsets + 2 * size_of_indices);
+
+    // decode, walking the line table and the inlined runs alongside the code
+    int instruction_count = 0;
+    int run = 0;
+    int inlined = 0;
+    for (uint32_t offset = 0; offset < count;) {
+        Instruction *instruction = &instructions[instruction_count];
+        instruction->wide = module->code[offset] == OP_WIDE;
+        instruction->op = module->code[offset + instruction->wide];
+        while (run + 1 < module->line_count && module->lines[run + 1].offset <= offset) run++;
+        instruction->line = module->lines[run].line;
+        while (inlined < module->inline_count && module->inlines[inlined].end <= offset) inlined++;
+        instruction->inlined = inlined < module->inline_count && module->inlines[inlined].start <= offset
+                               ? inlined : -1;
+        instruction->offset = offset;
+
+        uint32_t operand_start = offset + (instruction->wide ? 2 : 1);
+        int length = operand_length(instruction->op, instruction->wide);
+        uint32_t end = offset + instruction_length(instruction);
+        instruction->operand = read_bytes(module->code, operand_start, length);
+
+        if (is_jump(instruction->op)) {
+            uint32_t distance = read_bytes(module->code, operand_start + length,
+                                           offset_length(instruction->op, instruction->wide));
+            instruction->target = instruction->op == OP_LOOP ? end - distance : end + distance;
+        }
+
+        index_of[offset] = instruction_count++;
+        offset = end;
+    }
+    index_of[count] = instruction_count;
+
+    // the jumps that were too far for their placeholder operands
+    for (int i = 0; i < far_jump_count; i++) {
+        instructions[index_of[far_jumps[i].offset]].target = far_jumps[i].target;
+    }
+
+    int kept = instruction_count;
+    if (optimize) {
+        for (int i = 0; i < instruction_count; i++) {
+            Instruction *instruction = &instructions[i];
+            if (is_jump(instruction->op)) {
+                instruction->target = thread_jump(instructions, instruction_count, index_of, instruction);
+            }
+        }
+
+        // only the targets left after threading keep instructions apart
+        for (uint32_t offset = 0; offset <= count; offset++) is_target[offset] = false;
+        for (int i = 0; i < instruction_count; i++) {
+            if (is_jump(instructions[i].op)) is_target[instructions[i].target] = true;
+        }
+
+        // fuse pairs and runs of instructions, unless control can enter between them
+        kept = 0;
+        for (int i = 0; i < instruction_count; i++) {
+            Instruction instruction = instructions[i];
+            Instruction *next = i + 1 < instruction_count ? &instructions[i + 1] : NULL;
+
+            if (next != NULL && next->op == OP_NOT && !is_target[next->offset] && negated(instruction.op) != 0) {
+                instruction.op = negated(instruction.op);
+                i++;
+            } else if (instruction.op == OP_POP && next != NULL && next->op == OP_POP && !is_target[next->offset]) {
+                uint32_t pops = 1;
+                while (i + 1 < instruction_count && pops < UINT8_MAX &&
+                       instructions[i + 1].op == OP_POP && !is_target[instructions[i + 1].offset]) {
+                    pops++;
+                    i++;
+                }
+                instruction.op = OP_POPN;
+                instruction.operand = pops;
+            }
+
+            instructions[kept++] = instruction;
+        }
+    }
+
+    // an unconditional jump threaded backwards becomes a loop, and the other
+    // way around. every jump starts out in its compact form, unless it has
+    // another operand that needs the wide one.
+    for (int i = 0; i < kept; i++) {
+        Instruction *instruction = &instructions[i];
+        if (!is_jump(instruction->op)) continue;
+
+        if (instruction->op == OP_JUMP && instruction->target <= instruction->offset) instruction->op = OP_LOOP;
+        if (instruction->op == OP_LOOP && instruction->target > instruction->offset) instruction->op = OP_JUMP;
+        instruction->wide = instruction->operand > UINT8_MAX;
+    }
+
+    // lay the code out, widening the jumps whose distance does not fit until
+    // all of them do. widening only ever moves code apart, so jumps are never
+    // narrowed again and this settles after a few rounds.
+    uint32_t size;
+    bool relaxed;
+    do {
+        size = 0;
+        for (int i = 0; i < kept; i++) {
+            new_offsets[instructions[i].offset] = size;
+            size += instruction_length(&instructions[i]);
+        }
+        new_offsets[count] = size;
+
+        relaxed = true;
+        for (int i = 0; i < kept; i++) {
+            Instruction *instruction = &instructions[i];
+            if (is_jump(instruction->op) && !instruction->wide && jump_distance(instruction, new_offsets) > UINT16_MAX) {
+                instruction->wide = true;
+                relaxed = false;
+            }
+        }
+    } while (!relaxed);
+
+    // find the deepest the stack gets. the code follows the shape of the tree it
+    // was generated from, so walking it in order reaches every forward jump
+    // before the instruction it lands on, and a loop's start by falling through.
+    for (uint32_t offset = 0; offset <= count; offset++) depths[offset] = 0;
+    int depth = entry_depth;
+    int max_depth = entry_depth;
+    for (int i = 0; i < kept; i++) {
+        Instruction *instruction = &instructions[i];
+        if (depths[instruction->offset] > depth) depth = depths[instruction->offset];
+
+        depth += stack_effect(instruction);
+        if (depth < 0) depth = 0; // after a return
+        if (depth > max_depth) max_depth = depth;
+
+        if (is_jump(instruction->op) && instruction->target > instruction->offset &&
+            depths[instruction->target] < depth) {
+            depths[instruction->target] = depth;
+        }
+    }
+
+    // encode. wide jumps can make the code longer than it was, so it is
+    // written to a new array of the exact size, and the line table and the
+    // inlined runs are rebuilt. the module owns the new array before anything
+    // else is allocated.
+    uint8_t *code = ALLOCATE(uint8_t, size);
+    FREE_ARRAY(uint8_t, module->code, module->capacity);
+    module->code = code;
+    module->count = size;
+    module->capacity = size;
+
+    FREE_ARRAY(LineRun, module->lines, module->line_capacity);
+    module->lines = NULL;
+    module->line_count = 0;
+    module->line_capacity = 0;
+
+    InlineRun *inlines = module->inlines;
+    int inline_capacity = module->inline_capacity;
+    module->inlines = NULL;
+    module->inline_count = 0;
+    module->inline_capacity = 0;
+    for (int i = 0; i < kept; i++) {
+        Instruction *instruction = &instructions[i];
+        uint32_t at = new_offsets[instruction->offset];
+
+        uint32_t cursor = at;
+        if (instruction->wide) code[cursor++] = OP_WIDE;
+        code[cursor++] = instruction->op;
+
+        int length = operand_length(instruction->op, instruction->wide);
+        write_bytes(code, cursor, length, instruction->operand);
+        if (is_jump(instruction->op)) {
+            write_bytes(code, cursor + length, offset_length(instruction->op, instruction->wide),
+                        jump_distance(instruction, new_offsets));
+        }
+
+        mark_line(module, at, instruction->line);
+        if (instruction->inlined != -1) {
+            InlineRun *from = &inlines[instruction->inlined];
+            mark_inlined(module, at, at + instruction_length(instruction), from->line, from->name);
+        }
+    }
+    FREE_ARRAY(InlineRun, inlines, inline_capacity);
+
+    free_scratch();
+
+    // one slot of headroom: some instructions push a temporary, such as the
+    // list being built, before they pop their operands
+    return max_depth + 1;
+}
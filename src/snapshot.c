@@ -0,0 +1,718 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "snapshot.h"
+#include "vm.h"
+
+#define SNAPSHOT_MAGIC "SLHEAP1\n"
+
+// The longest label stored for an object.
+#define SNAPSHOT_LABEL_MAX 40
+
+// Retainer values of objects that are unreachable or held directly by a root.
+#define RETAINER_NONE 0
+#define RETAINER_ROOT 1
+
+// The number of largest types and dominators printed by the summarizer.
+#define SUMMARY_TOP 10
+
+// ---------------------------------------------------------------------------
+// Writing
+// ---------------------------------------------------------------------------
+
+// Maps object addresses to their index in the snapshot. The map is sized
+// from the object count once, so building it is linear in the heap size.
+typedef struct {
+    Obj *key;
+    uint32_t index;
+} ObjectSlot;
+
+typedef struct {
+    FILE *file;
+
+    uint32_t count;
+    Obj **objects;
+    ObjectSlot *slots;
+    uint32_t slot_mask;
+
+    uint32_t *retainers;
+
+    // breadth-first queue of object indices, for retaining paths
+    uint32_t *queue;
+    uint32_t queue_head;
+    uint32_t queue_tail;
+} SnapshotWriter;
+
+static uint32_t hash_pointer(Obj *object) {
+    uintptr_t bits = (uintptr_t) object;
+    bits ^= bits >> 17;
+    bits *= 0xed5ad4bbu;
+    bits ^= bits >> 11;
+    return (uint32_t) bits;
+}
+
+static ObjectSlot *find_slot(SnapshotWriter *writer, Obj *object) {
+    uint32_t index = hash_pointer(object) & writer->slot_mask;
+
+    for (;;) {
+        ObjectSlot *slot = &writer->slots[index];
+        if (slot->key == object || slot->key == NULL) return slot;
+        index = (index + 1) & writer->slot_mask;
+    }
+}
+
+static uint32_t object_index(SnapshotWriter *writer, Obj *object) {
+    return find_slot(writer, object)->index;
+}
+
+static void write_varint(FILE *file, uint64_t value) {
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        fputc(value != 0 ? byte | 0x80 : byte, file);
+    } while (value != 0);
+}
+
+static void write_label(FILE *file, const char *chars, int length) {
+    if (length > SNAPSHOT_LABEL_MAX) length = SNAPSHOT_LABEL_MAX;
+    write_varint(file, (uint64_t) length);
+    fwrite(chars, 1, (size_t) length, file);
+}
+
+// Call visit on every object directly referenced by an object.
+typedef void (*ReferenceVisitor)(SnapshotWriter *writer, uint32_t from, Obj *to);
+
+static void visit_value(SnapshotWriter *writer, uint32_t from, Value value, ReferenceVisitor visit) {
+    if (IS_OBJ(value)) visit(writer, from, AS_OBJ(value));
+}
+
+static void visit_references(SnapshotWriter *writer, uint32_t from, ReferenceVisitor visit) {
+    Obj *object = writer->objects[from];
+
+    switch (object->type) {
+        case OBJ_FUNCTION: {
+            ObjFunction *function = (ObjFunction*)object;
+            if (function->name != NULL) visit(writer, from, (Obj*)function->name);
+            for (int i = 0; i < function->module.constants.count; i++) {
+                visit_value(writer, from, function->module.constants.values[i], visit);
+            }
+            break;
+        }
+        case OBJ_LIST: {
+            ObjList *list = (ObjList*)object;
+            if (list->base != NULL) visit(writer, from, (Obj*)list->base);
+            for (int i = 0; i < list->count; i++) {
+                visit_value(writer, from, list->items[i], visit);
+            }
+            break;
+        }
+        case OBJ_STRING:
+        case OBJ_RANGE:
+        case OBJ_NATIVE:
+        case OBJ_ARRAY:
+            break;
+    }
+}
+
+static void count_reference(SnapshotWriter *writer, uint32_t from, Obj *to) {
+    (void) from;
+    (void) to;
+    writer->queue_tail++;
+}
+
+static void write_reference(SnapshotWriter *writer, uint32_t from, Obj *to) {
+    (void) from;
+    write_varint(writer->file, object_index(writer, to));
+}
+
+// Enqueue an object reached for the first time, recording what retained it.
+static void reach(SnapshotWriter *writer, uint32_t retainer, Obj *object) {
+    uint32_t index = object_index(writer, object);
+    if (writer->retainers[index] != RETAINER_NONE) return;
+
+    writer->retainers[index] = retainer;
+    writer->queue[writer->queue_tail++] = index;
+}
+
+static void reach_from_object(SnapshotWriter *writer, uint32_t from, Obj *to) {
+    reach(writer, from + 2, to);
+}
+
+static void reach_from_root(SnapshotWriter *writer, Value value) {
+    if (IS_OBJ(value)) reach(writer, RETAINER_ROOT, AS_OBJ(value));
+}
+
+// Visit each root, either to reach its object or to write it out.
+typedef void (*RootVisitor)(SnapshotWriter *writer, SnapshotRootKind kind, Value value, ObjString *name);
+
+static void visit_roots(SnapshotWriter *writer, RootVisitor visit) {
+    for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
+        visit(writer, SNAPSHOT_ROOT_STACK, *slot, NULL);
+    }
+
+    for (int i = 0; i < vm.frame_count; i++) {
+        visit(writer, SNAPSHOT_ROOT_FRAME, OBJ_VAL(vm.frames[i].function), NULL);
+    }
+
+    for (int i = 0; i < vm.globals.capacity; i++) {
+        Entry *entry = &vm.globals.entries[i];
+        if (entry->key == NULL) continue;
+        visit(writer, SNAPSHOT_ROOT_GLOBAL, OBJ_VAL(entry->key), entry->key);
+        visit(writer, SNAPSHOT_ROOT_GLOBAL, entry->value, entry->key);
+    }
+
+    visit(writer, SNAPSHOT_ROOT_REGISTER, vm.reg_0, NULL);
+
+    for (int i = 0; i < vm.modules.capacity; i++) {
+        Entry *entry = &vm.modules.entries[i];
+        if (entry->key == NULL) continue;
+        visit(writer, SNAPSHOT_ROOT_MODULE, OBJ_VAL(entry->key), entry->key);
+        visit(writer, SNAPSHOT_ROOT_MODULE, entry->value, entry->key);
+    }
+}
+
+static void reach_root(SnapshotWriter *writer, SnapshotRootKind kind, Value value, ObjString *name) {
+    (void) kind;
+    (void) name;
+    reach_from_root(writer, value);
+}
+
+static void count_root(SnapshotWriter *writer, SnapshotRootKind kind, Value value, ObjString *name) {
+    (void) kind;
+    (void) name;
+    if (IS_OBJ(value)) writer->queue_tail++;
+}
+
+static void write_root(SnapshotWriter *writer, SnapshotRootKind kind, Value value, ObjString *name) {
+    if (!IS_OBJ(value)) return;
+
+    fputc((int) kind, writer->file);
+    write_varint(writer->file, object_index(writer, AS_OBJ(value)));
+    if (name != NULL) {
+        write_label(writer->file, name->chars, name->length);
+    } else {
+        write_label(writer->file, "", 0);
+    }
+}
+
+static void write_object(SnapshotWriter *writer, uint32_t index) {
+    Obj *object = writer->objects[index];
+    FILE *file = writer->file;
+
+    fputc((int) object->type, file);
+    write_varint(file, object_size(object));
+    write_varint(file, writer->retainers[index]);
+
+    if (object->type == OBJ_STRING) {
+        ObjString *string = (ObjString*)object;
+        write_label(file, string->chars, string->length);
+    } else if (object->type == OBJ_FUNCTION && ((ObjFunction*)object)->name != NULL) {
+        ObjString *name = ((ObjFunction*)object)->name;
+        write_label(file, name->chars, name->length);
+    } else {
+        write_label(file, "", 0);
+    }
+
+    writer->queue_tail = 0;
+    visit_references(writer, index, count_reference);
+    write_varint(file, writer->queue_tail);
+    visit_references(writer, index, write_reference);
+}
+
+bool write_heap_snapshot(const char *path) {
+    // the objects a sweep has not reached yet may refer to objects it freed
+    finish_sweep();
+
+    SnapshotWriter writer;
+    memset(&writer, 0, sizeof(writer));
+
+    // number every object in the heap
+    for (Obj *object = vm.objects; object != NULL; object = object->next) {
+        writer.count++;
+    }
+
+    uint32_t slot_count = 16;
+    while (slot_count < writer.count * 2) slot_count <<= 1;
+    writer.slot_mask = slot_count - 1;
+
+    // the snapshot's own memory is kept out of the VM heap and its accounting
+    writer.objects = (Obj**)malloc(sizeof(Obj*) * (writer.count + 1));
+    writer.slots = (ObjectSlot*)calloc(slot_count, sizeof(ObjectSlot));
+    writer.retainers = (uint32_t*)calloc(writer.count + 1, sizeof(uint32_t));
+    writer.queue = (uint32_t*)malloc(sizeof(uint32_t) * (writer.count + 1));
+    writer.file = fopen(path, "wb");
+
+    bool ok = writer.objects != NULL && writer.slots != NULL &&
+              writer.retainers != NULL && writer.queue != NULL && writer.file != NULL;
+
+    if (ok) {
+        uint32_t index = 0;
+        for (Obj *object = vm.objects; object != NULL; object = object->next, index++) {
+            writer.objects[index] = object;
+            ObjectSlot *slot = find_slot(&writer, object);
+            slot->key = object;
+            slot->index = index;
+        }
+
+        // breadth first from the roots, so each retainer lies on a shortest retaining path
+        visit_roots(&writer, reach_root);
+        while (writer.queue_head < writer.queue_tail) {
+            visit_references(&writer, writer.queue[writer.queue_head++], reach_from_object);
+        }
+
+        fputs(SNAPSHOT_MAGIC, writer.file);
+        write_varint(writer.file, writer.count);
+        for (uint32_t i = 0; i < writer.count; i++) {
+            write_object(&writer, i);
+        }
+
+        writer.queue_tail = 0;
+        visit_roots(&writer, count_root);
+        write_varint(writer.file, writer.queue_tail);
+        visit_roots(&writer, write_root);
+
+        ok = !ferror(writer.file);
+    }
+
+    if (writer.file != NULL && fclose(writer.file) != 0) ok = false;
+    free(writer.objects);
+    free(writer.slots);
+    free(writer.retainers);
+    free(writer.queue);
+
+    return ok;
+}
+
+void request_heap_snapshot() {
+    vm.snapshot_requested = 1;
+}
+
+void write_requested_heap_snapshot() {
+    vm.snapshot_requested = 0;
+
+    char path[64];
+    snprintf(path, sizeof(path), "protoslang-%ld-%u.heapsnapshot", (long) getpid(), vm.snapshot_sequence++);
+
+    if (write_heap_snapshot(path)) {
+        fprintf(stderr, "Wrote heap snapshot to \"%s\".\n", path);
+    } else {
+        fprintf(stderr, "Could not write heap snapshot to \"%s\".\n", path);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Summarizing
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    uint8_t type;
+    uint64_t size;
+    uint32_t retainer;
+    char label[SNAPSHOT_LABEL_MAX + 1];
+} SnapshotObject;
+
+typedef struct {
+    uint32_t count;
+    SnapshotObject *objects;
+
+    // the references of object i are edges[edge_start[i] .. edge_start[i + 1]]
+    uint32_t *edge_start;
+    uint32_t *edges;
+
+    uint32_t root_count;
+    uint32_t *roots;
+    uint8_t *root_kinds;
+    char (*root_labels)[SNAPSHOT_LABEL_MAX + 1];
+} Snapshot;
+
+static bool read_varint(FILE *file, uint64_t *value) {
+    *value = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF) return false;
+
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return true;
+    }
+
+    return false;
+}
+
+static bool read_u32(FILE *file, uint32_t *value, uint32_t limit) {
+    uint64_t wide;
+    if (!read_varint(file, &wide) || wide > limit) return false;
+    *value = (uint32_t) wide;
+    return true;
+}
+
+static bool read_label(FILE *file, char *label) {
+    uint32_t length;
+    if (!read_u32(file, &length, SNAPSHOT_LABEL_MAX)) return false;
+    if (fread(label, 1, length, file) != length) return false;
+    label[length] = '\0';
+    return true;
+}
+
+static void free_snapshot(Snapshot *snapshot) {
+    free(snapshot->objects);
+    free(snapshot->edge_start);
+    free(snapshot->edges);
+    free(snapshot->roots);
+    free(snapshot->root_kinds);
+    free(snapshot->root_labels);
+}
+
+static bool read_snapshot(FILE *file, Snapshot *snapshot) {
+    char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+        return false;
+    }
+
+    if (!read_u32(file, &snapshot->count, UINT32_MAX - 2)) return false;
+
+    snapshot->objects = (SnapshotObject*)malloc(sizeof(SnapshotObject) * (snapshot->count + 1));
+    snapshot->edge_start = (uint32_t*)malloc(sizeof(uint32_t) * (snapshot->count + 1));
+    if (snapshot->objects == NULL || snapshot->edge_start == NULL) return false;
+
+    uint32_t edge_capacity = 0;
+    uint32_t edge_count = 0;
+
+    for (uint32_t i = 0; i < snapshot->count; i++) {
+        SnapshotObject *object = &snapshot->objects[i];
+
+        int type = fgetc(file);
+        if (type == EOF || type >= OBJ_TYPE_COUNT) return false;
+        object->type = (uint8_t) type;
+
+        if (!read_varint(file, &object->size)) return false;
+        if (!read_u32(file, &object->retainer, snapshot->count + 1)) return false;
+        if (!read_label(file, object->label)) return false;
+
+        uint32_t reference_count;
+        if (!read_u32(file, &reference_count, UINT32_MAX - edge_count)) return false;
+
+        snapshot->edge_start[i] = edge_count;
+        if (edge_count + reference_count > edge_capacity) {
+            while (edge_count + reference_count > edge_capacity) {
+                edge_capacity = edge_capacity < 1024 ? 1024 : edge_capacity * 2;
+            }
+            snapshot->edges = (uint32_t*)realloc(snapshot->edges, sizeof(uint32_t) * edge_capacity);
+            if (snapshot->edges == NULL) return false;
+        }
+
+        for (uint32_t j = 0; j < reference_count; j++) {
+            if (!read_u32(file, &snapshot->edges[edge_count++], snapshot->count - 1)) return false;
+        }
+    }
+    snapshot->edge_start[snapshot->count] = edge_count;
+
+    if (!read_u32(file, &snapshot->root_count, UINT32_MAX - 1)) return false;
+    snapshot->roots = (uint32_t*)malloc(sizeof(uint32_t) * (snapshot->root_count + 1));
+    snapshot->root_kinds = (uint8_t*)malloc(snapshot->root_count + 1);
+    snapshot->root_labels = malloc(sizeof(*snapshot->root_labels) * (snapshot->root_count + 1));
+    if (snapshot->roots == NULL || snapshot->root_kinds == NULL || snapshot->root_labels == NULL) return false;
+
+    for (uint32_t i = 0; i < snapshot->root_count; i++) {
+        int kind = fgetc(file);
+        if (kind == EOF || kind > SNAPSHOT_ROOT_MODULE) return false;
+        snapshot->root_kinds[i] = (uint8_t) kind;
+
+        if (!read_u32(file, &snapshot->roots[i], snapshot->count - 1)) return false;
+        if (!read_label(file, snapshot->root_labels[i])) return false;
+    }
+
+    return true;
+}
+
+// The successors of a node in the graph with a virtual root at index count,
+// whose successors are the roots of the snapshot.
+static uint32_t successor_count(Snapshot *snapshot, uint32_t node) {
+    if (node == snapshot->count) return snapshot->root_count;
+    return snapshot->edge_start[node + 1] - snapshot->edge_start[node];
+}
+
+static uint32_t successor(Snapshot *snapshot, uint32_t node, uint32_t i) {
+    if (node == snapshot->count) return snapshot->roots[i];
+    return snapshot->edges[snapshot->edge_start[node] + i];
+}
+
+#define UNDEFINED UINT32_MAX
+
+// Compute immediate dominators with the iterative algorithm of Cooper, Harvey
+// and Kennedy over a reverse postorder of the reachable graph. Returns the
+// postorder, and fills idom and postorder_index, where unreachable nodes
+// keep UNDEFINED.
+static uint32_t *compute_dominators(Snapshot *snapshot, uint32_t *idom,
+                                    uint32_t *postorder_index, uint32_t *reachable) {
+    uint32_t nodes = snapshot->count + 1;
+    uint32_t root = snapshot->count;
+
+    uint32_t *order = (uint32_t*)malloc(sizeof(uint32_t) * nodes);
+    uint32_t *stack = (uint32_t*)malloc(sizeof(uint32_t) * nodes);
+    uint32_t *next_child = (uint32_t*)calloc(nodes, sizeof(uint32_t));
+    uint8_t *visited = (uint8_t*)calloc(nodes, 1);
+    if (order == NULL || stack == NULL || next_child == NULL || visited == NULL) {
+        free(order);
+        free(stack);
+        free(next_child);
+        free(visited);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < nodes; i++) {
+        idom[i] = UNDEFINED;
+        postorder_index[i] = UNDEFINED;
+    }
+
+    // iterative depth-first search for the postorder
+    uint32_t count = 0;
+    uint32_t depth = 0;
+    stack[depth++] = root;
+    visited[root] = 1;
+    while (depth > 0) {
+        uint32_t node = stack[depth - 1];
+        if (next_child[node] < successor_count(snapshot, node)) {
+            uint32_t child = successor(snapshot, node, next_child[node]++);
+            if (!visited[child]) {
+                visited[child] = 1;
+                stack[depth++] = child;
+            }
+        } else {
+            postorder_index[node] = count;
+            order[count++] = node;
+            depth--;
+        }
+    }
+    *reachable = count;
+
+    // predecessors of each reachable node, in compressed rows
+    uint32_t *pred_start = (uint32_t*)calloc(nodes + 1, sizeof(uint32_t));
+    uint32_t edge_total = 0;
+    for (uint32_t node = 0; node < nodes; node++) {
+        if (!visited[node]) continue;
+        for (uint32_t i = 0; i < successor_count(snapshot, node); i++) {
+            pred_start[successor(snapshot, node, i) + 1]++;
+            edge_total++;
+        }
+    }
+    for (uint32_t node = 0; node < nodes; node++) pred_start[node + 1] += pred_start[node];
+
+    uint32_t *preds = (uint32_t*)malloc(sizeof(uint32_t) * (edge_total + 1));
+    uint32_t *fill = next_child;
+    memset(fill, 0, sizeof(uint32_t) * nodes);
+    for (uint32_t node = 0; node < nodes; node++) {
+        if (!visited[node]) continue;
+        for (uint32_t i = 0; i < successor_count(snapshot, node); i++) {
+            uint32_t target = successor(snapshot, node, i);
+            preds[pred_start[target] + fill[target]++] = node;
+        }
+    }
+
+    idom[root] = root;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        // reverse postorder, skipping the root which comes last in postorder
+        for (uint32_t i = count - 1; i-- > 0;) {
+            uint32_t node = order[i];
+            uint32_t new_idom = UNDEFINED;
+
+            for (uint32_t p = pred_start[node]; p < pred_start[node + 1]; p++) {
+                uint32_t pred = preds[p];
+                if (idom[pred] == UNDEFINED) continue;
+
+                if (new_idom == UNDEFINED) {
+                    new_idom = pred;
+                    continue;
+                }
+
+                // walk both fingers up the dominator tree until they meet
+                uint32_t a = pred;
+                uint32_t b = new_idom;
+                while (a != b) {
+                    while (postorder_index[a] < postorder_index[b]) a = idom[a];
+                    while (postorder_index[b] < postorder_index[a]) b = idom[b];
+                }
+                new_idom = a;
+            }
+
+            if (idom[node] != new_idom) {
+                idom[node] = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    free(stack);
+    free(next_child);
+    free(visited);
+    free(pred_start);
+    free(preds);
+    return order;
+}
+
+static void print_object_name(Snapshot *snapshot, uint32_t index) {
+    SnapshotObject *object = &snapshot->objects[index];
+    printf("%s#%u", obj_type_name((ObjType) object->type), index);
+    if (object->label[0] != '\0') printf(" \"%s\"", object->label);
+}
+
+// Print the first root that holds an object.
+static void print_root(Snapshot *snapshot, uint32_t index) {
+    static const char *kinds[] = {"stack slot", "call frame", "global", "register", "module"};
+
+    for (uint32_t i = 0; i < snapshot->root_count; i++) {
+        if (snapshot->roots[i] != index) continue;
+
+        printf("%s", kinds[snapshot->root_kinds[i]]);
+        if (snapshot->root_labels[i][0] != '\0') printf(" '%s'", snapshot->root_labels[i]);
+        printf("\n");
+        return;
+    }
+
+    printf("root\n");
+}
+
+static void print_retaining_path(Snapshot *snapshot, uint32_t index) {
+    printf("      retained by: ");
+    uint32_t retainer = snapshot->objects[index].retainer;
+
+    for (int depth = 0; depth < 8; depth++) {
+        if (retainer == RETAINER_NONE) {
+            printf("nothing (unreachable)\n");
+            return;
+        }
+        if (retainer == RETAINER_ROOT) {
+            print_root(snapshot, index);
+            return;
+        }
+
+        index = retainer - 2;
+        print_object_name(snapshot, index);
+        printf(" <- ");
+        retainer = snapshot->objects[index].retainer;
+    }
+
+    printf("...\n");
+}
+
+bool summarize_heap_snapshot(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return false;
+
+    Snapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    bool ok = read_snapshot(file, &snapshot);
+    fclose(file);
+
+    if (!ok) {
+        free_snapshot(&snapshot);
+        return false;
+    }
+
+    // the heap by type, largest first
+    uint64_t type_bytes[OBJ_TYPE_COUNT] = {0};
+    uint64_t type_objects[OBJ_TYPE_COUNT] = {0};
+    uint64_t total_bytes = 0;
+    uint64_t unreachable_objects = 0;
+    uint64_t unreachable_bytes = 0;
+
+    for (uint32_t i = 0; i < snapshot.count; i++) {
+        SnapshotObject *object = &snapshot.objects[i];
+        type_bytes[object->type] += object->size;
+        type_objects[object->type]++;
+        total_bytes += object->size;
+
+        if (object->retainer == RETAINER_NONE) {
+            unreachable_objects++;
+            unreachable_bytes += object->size;
+        }
+    }
+
+    printf("%u objects, %llu bytes, %u roots\n", snapshot.count,
+           (unsigned long long) total_bytes, snapshot.root_count);
+    printf("%llu unreachable objects (%llu bytes) awaiting collection\n\n",
+           (unsigned long long) unreachable_objects, (unsigned long long) unreachable_bytes);
+
+    printf("top types by size:\n");
+    bool printed[OBJ_TYPE_COUNT] = {false};
+    for (int rank = 0; rank < OBJ_TYPE_COUNT; rank++) {
+        int best = -1;
+        for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+            if (printed[type] || type_objects[type] == 0) continue;
+            if (best == -1 || type_bytes[type] > type_bytes[best]) best = type;
+        }
+        if (best == -1) break;
+
+        printed[best] = true;
+        printf("  %-10s %10llu objects %12llu bytes %5.1f%%\n", obj_type_name((ObjType) best),
+               (unsigned long long) type_objects[best], (unsigned long long) type_bytes[best],
+               total_bytes == 0 ? 0.0 : 100.0 * (double) type_bytes[best] / (double) total_bytes);
+    }
+
+    // retained sizes: each node's size flows into its immediate dominator,
+    // and postorder visits every node after all of the nodes it dominates.
+    uint32_t nodes = snapshot.count + 1;
+    uint32_t *idom = (uint32_t*)malloc(sizeof(uint32_t) * nodes);
+    uint32_t *postorder_index = (uint32_t*)malloc(sizeof(uint32_t) * nodes);
+    uint64_t *retained = (uint64_t*)calloc(nodes, sizeof(uint64_t));
+    uint32_t reachable = 0;
+    uint32_t *order = NULL;
+    if (idom != NULL && postorder_index != NULL && retained != NULL) {
+        order = compute_dominators(&snapshot, idom, postorder_index, &reachable);
+    }
+
+    if (order == NULL) {
+        free(idom);
+        free(postorder_index);
+        free(retained);
+        free_snapshot(&snapshot);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < reachable; i++) {
+        uint32_t node = order[i];
+        if (node == snapshot.count) continue;
+
+        retained[node] += snapshot.objects[node].size;
+        if (idom[node] != snapshot.count) retained[idom[node]] += retained[node];
+    }
+
+    printf("\ntop dominators by retained size:\n");
+    uint32_t top[SUMMARY_TOP];
+    int top_count = 0;
+    for (uint32_t i = 0; i < reachable; i++) {
+        uint32_t node = order[i];
+        if (node == snapshot.count) continue;
+
+        // insertion into the small sorted list of the largest
+        int position = top_count;
+        while (position > 0 && retained[top[position - 1]] < retained[node]) position--;
+        if (position >= SUMMARY_TOP) continue;
+
+        if (top_count < SUMMARY_TOP) top_count++;
+        memmove(&top[position + 1], &top[position], sizeof(uint32_t) * (top_count - position - 1));
+        top[position] = node;
+    }
+
+    for (int i = 0; i < top_count; i++) {
+        printf("  %12llu bytes  ", (unsigned long long) retained[top[i]]);
+        print_object_name(&snapshot, top[i]);
+        printf("\n");
+        print_retaining_path(&snapshot, top[i]);
+    }
+
+    free(order);
+    free(idom);
+    free(postorder_index);
+    free(retained);
+    free_snapshot(&snapshot);
+    return true;
+}
@@ -0,0 +1,94 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "source.h"
+
+// Read what a file that cannot be mapped, such as a pipe, holds into a buffer.
+static SourceStatus read_source(int fd, Source *source) {
+    size_t capacity = 4096;
+    size_t length = 0;
+    char *chars = (char *)malloc(capacity);
+    if (chars == NULL) return SOURCE_UNREADABLE;
+
+    for (;;) {
+        if (length + 1 == capacity) {
+            char *grown = (char *)realloc(chars, capacity * 2);
+            if (grown == NULL) {
+                free(chars);
+                return SOURCE_UNREADABLE;
+            }
+            chars = grown;
+            capacity *= 2;
+        }
+
+        ssize_t bytes_read = read(fd, chars + length, capacity - length - 1);
+        if (bytes_read < 0) {
+            free(chars);
+            return SOURCE_UNREADABLE;
+        }
+        if (bytes_read == 0) break;
+        length += (size_t) bytes_read;
+    }
+
+    chars[length] = '\0';
+    source->chars = chars;
+    source->length = length;
+    source->mapping_size = 0;
+    return SOURCE_OK;
+}
+
+// Map a regular file. The mapping is laid over a reservation of zeroed
+// pages a byte longer than the file: the last page of the file is zero past
+// its end, and when the file fills that page exactly, the reserved page
+// after it supplies the zero byte.
+static SourceStatus map_source(int fd, size_t length, Source *source) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t mapping_size = (length + 1 + page - 1) / page * page;
+
+    char *mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return SOURCE_UNREADABLE;
+
+    if (length > 0 && mmap(mapping, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(mapping, mapping_size);
+        return SOURCE_UNREADABLE;
+    }
+
+    source->chars = mapping;
+    source->length = length;
+    source->mapping_size = mapping_size;
+    return SOURCE_OK;
+}
+
+SourceStatus load_source(const char *path, Source *source) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return SOURCE_NOT_FOUND;
+
+    struct stat status;
+    SourceStatus result;
+    if (fstat(fd, &status) != 0) {
+        result = SOURCE_UNREADABLE;
+    } else if (S_ISREG(status.st_mode)) {
+        result = map_source(fd, (size_t) status.st_size, source);
+    } else {
+        result = read_source(fd, source);
+    }
+
+    // the mapping outlives the descriptor
+    close(fd);
+    return result;
+}
+
+void unload_source(Source *source) {
+    if (source->mapping_size > 0) {
+        munmap((void *) source->chars, source->mapping_size);
+    } else {
+        free((void *) source->chars);
+    }
+    source->chars = NULL;
+    source->length = 0;
+    source->mapping_size = 0;
+}
@@ -5,6 +5,7 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
 
 #define TABLE_MAX_LOAD 0.75
 
@@ -91,6 +92,10 @@ bool table_set(Table *table, ObjString *key, Value value) {
 
     Entry *entry = find_entry(table->entries, table->capacity, key);
 
+    // the table may be a root that was already scanned in this cycle
+    WRITE_BARRIER(OBJ_VAL(key));
+    WRITE_BARRIER(value);
+
     bool is_new_key = entry->key == NULL;
     if (is_new_key && IS_NIL(entry->value)) table->count++;
 
@@ -143,3 +148,22 @@ ObjString *table_find_string(Table *table, const char *chars, int length, uint32
         index = (index + 1) % table->capacity;
     }
 }
+
+void mark_table(Table *table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        mark_object((Obj*)entry->key);
+        mark_value(entry->value);
+    }
+}
+
+int table_remove_white(Table *table, int from, int count) {
+    int end = count < table->capacity - from ? from + count : table->capacity;
+    for (int i = from; i < end; i++) {
+        Entry *entry = &table->entries[i];
+        if (entry->key != NULL && entry->key->obj.mark != vm.mark_epoch) {
+            table_delete(table, entry->key);
+        }
+    }
+    return end;
+}
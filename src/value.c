@@ -3,6 +3,8 @@
 
 #include "object.h"
 #include "memory.h"
+#include "number.h"
+#include "output.h"
 #include "value.h"
 
 // Initialize a value array
@@ -17,9 +19,9 @@ void initialize_value_array(ValueArray *array) {
 void write_value_array(ValueArray *array, Value value) {
     // Calculate new capacity and reallocate if necessary
     if (array->capacity < array->count + 1) {
-        int old_capacity = array->capacity;
-        array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(array->values, Value, old_capacity, array->capacity);
+        int capacity = GROW_CAPACITY(array->capacity);
+        array->values = GROW_ARRAY(array->values, Value, array->capacity, capacity);
+        array->capacity = capacity;
     }
 
     // Write the value to the array
@@ -39,14 +41,25 @@ void free_value_array(ValueArray *array) {
 void print_value(Value value) {
     switch (value.type) {
         case TYPE_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
+            if (AS_BOOL(value)) {
+                write_output("true", 4);
+            } else {
+                write_output("false", 5);
+            }
             break;
         case TYPE_NIL:
-            printf("nil");
+            write_output("nil", 3);
             break;
-        case TYPE_NUMBER:
-            printf("%d", AS_NUMBER(value));
+        case TYPE_NUMBER: {
+            char buffer[NUMBER_BUFFER_SIZE];
+            write_output(buffer, (size_t) format_number(AS_DOUBLE(value), buffer));
             break;
+        }
+        case TYPE_INT: {
+            char buffer[NUMBER_BUFFER_SIZE];
+            write_output(buffer, (size_t) format_integer(AS_INT(value), buffer));
+            break;
+        }
         case VAL_OBJ:
             print_object(value);
             break;
@@ -54,14 +67,17 @@ void print_value(Value value) {
 }
 
 bool values_equal(Value a, Value b) {
+    // an integer equals the double with exactly the same value
+    if (IS_INT(a) && IS_INT(b)) return AS_INT(a) == AS_INT(b);
+    if (IS_DOUBLE(a) && IS_DOUBLE(b)) return AS_DOUBLE(a) == AS_DOUBLE(b);
+    if (IS_INT(a) && IS_DOUBLE(b)) return compare_integer_to_double(AS_INT(a), AS_DOUBLE(b)) == ORDER_EQUAL;
+    if (IS_DOUBLE(a) && IS_INT(b)) return compare_integer_to_double(AS_INT(b), AS_DOUBLE(a)) == ORDER_EQUAL;
     if (a.type != b.type) return false;
     switch (a.type) {
         case TYPE_BOOL:
             return AS_BOOL(a) == AS_BOOL(b);
         case TYPE_NIL:
             return true;
-        case TYPE_NUMBER:
-            return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_OBJ: {
             return AS_OBJ(a) == AS_OBJ(b);
         }
@@ -1,23 +1,38 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <math.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "array.h"
+#include "kernels.h"
 #include "value.h"
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
 #include "vm.h"
 #include "compiler.h"
+#include "snapshot.h"
+#include "number.h"
+#include "output.h"
+#include "source.h"
 
 VM vm;
 
 void reset_stack() {
     vm.stack_top = vm.stack;
+    vm.frame_count = 0;
+    vm.gc_stack_floor = vm.stack;
 }
 
 static void runtime_error(const char *format, ...) {
+    // what the script printed comes before the error
+    flush_output();
+
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
@@ -30,7 +45,12 @@ static void runtime_error(const char *format, ...) {
         ObjFunction *function = frame->function;
         // -1 because the IP is sitting on the next instruction to be executed
         size_t instruction = frame->ip - function->module.code - 1;
-        fprintf(stderr, "[line %d] in ", function->module.lines[instruction]);
+
+        // code inlined from another function is reported as a call to it
+        InlineRun *inlined = get_inlined(&function->module, (uint32_t) instruction);
+        if (inlined != NULL) fprintf(stderr, "[line %d] in %s()\n", inlined->line, inlined->name->chars);
+
+        fprintf(stderr, "[line %d] in ", get_line(&function->module, (uint32_t) instruction));
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -41,18 +61,153 @@ static void runtime_error(const char *format, ...) {
     reset_stack();
 }
 
+static void define_native(const char *name, NativeFn function) {
+    // both objects are kept on the stack while the other is allocated
+    push(OBJ_VAL(copy_string(name, (int) strlen(name))));
+    push(OBJ_VAL(new_native(function)));
+    table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    pop();
+    pop();
+}
+
+// heap_snapshot(path) writes a heap snapshot to path and returns whether it succeeded.
+static Value heap_snapshot_native(int arg_count, Value *args) {
+    if (arg_count != 1 || !IS_STRING(args[0])) return BOOL_VAL(false);
+    return BOOL_VAL(write_heap_snapshot(AS_CSTRING(args[0])));
+}
+
+// str(value) returns the text of a number, boolean or nil as a string, and
+// a string as it is. Other values have no text, it returns nil for them.
+static Value str_native(int arg_count, Value *args) {
+    if (arg_count != 1) return NIL_VAL;
+
+    Value value = args[0];
+    if (IS_STRING(value)) return value;
+    if (IS_NUMBER(value)) {
+        char buffer[NUMBER_BUFFER_SIZE];
+        int length = IS_INT(value) ? format_integer(AS_INT(value), buffer) : format_number(AS_DOUBLE(value), buffer);
+        return OBJ_VAL(copy_string(buffer, length));
+    }
+    if (IS_BOOL(value)) {
+        ObjString *text = AS_BOOL(value) ? copy_string("true", 4) : copy_string("false", 5);
+        return OBJ_VAL(text);
+    }
+    if (IS_NIL(value)) return OBJ_VAL(copy_string("nil", 3));
+    return NIL_VAL;
+}
+
+// clock() returns the processor time the program has used, in seconds.
+static Value clock_native(int arg_count, Value *args) {
+    (void) args;
+    if (arg_count != 0) return NIL_VAL;
+    return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+}
+
+// gc_max_pause() returns the longest pause of the collector so far, in microseconds.
+static Value gc_max_pause_native(int arg_count, Value *args) {
+    (void) args;
+    if (arg_count != 0) return NIL_VAL;
+    return NUMBER_VAL((double) vm.gc_stats.max_pause_ns / 1e3);
+}
+
+// gc_max_pause_cpu() returns the longest pause of the collector so far in CPU
+// time, in microseconds. It does not count time the process was preempted.
+static Value gc_max_pause_cpu_native(int arg_count, Value *args) {
+    (void) args;
+    if (arg_count != 0) return NIL_VAL;
+    return NUMBER_VAL((double) vm.gc_stats.max_pause_cpu_ns / 1e3);
+}
+
+// num(string) returns the number a string such as "-12.5e3" holds, or nil
+// if it holds something else. Digits alone are read as an integer when they
+// fit in one.
+static Value num_native(int arg_count, Value *args) {
+    if (arg_count != 1 || !IS_STRING(args[0])) return NIL_VAL;
+
+    int64_t integer;
+    double number;
+    ObjString *string = AS_STRING(args[0]);
+    if (parse_integer(string->chars, string->length, &integer)) return INT_VAL(integer);
+    if (!parse_number(string->chars, string->length, &number)) return NIL_VAL;
+    return NUMBER_VAL(number);
+}
+
 void initialize_vm() {
 //    vm->module = module;
     reset_stack();
     vm.objects = NULL;
+
+    vm.bytes_allocated = 0;
+    vm.peak_bytes_allocated = 0;
+    vm.next_gc = GC_INITIAL_THRESHOLD;
+    vm.soft_heap_limit = 0;
+    vm.hard_heap_limit = 0;
+    vm.out_of_memory_errors = 0;
+    vm.error_handler = NULL;
+    vm.gray_count = 0;
+    vm.gray_capacity = 0;
+    vm.gray_stack = NULL;
+    vm.gc_phase = GC_PHASE_IDLE;
+    vm.mark_epoch = 0;
+    vm.sweep_cursor = NULL;
+    vm.strings_cursor = 0;
+    vm.strings_entries = NULL;
+    vm.gc_debt = 0;
+    vm.gc_countdown = 0;
+    vm.gc_incremental = false;
+    vm.gc_max_pause_us = GC_DEFAULT_MAX_PAUSE_US;
+    vm.gc_threads = 1;
+    memset(&vm.gc_stats, 0, sizeof(vm.gc_stats));
+    initialize_output();
+    vm.snapshot_requested = 0;
+    vm.snapshot_sequence = 0;
+    vm.optimization_level = 1;
+#ifdef DEBUG_PRINT_CODE
+    vm.print_code = true;
+#else
+    vm.print_code = false;
+#endif
+    vm.defer_functions = true;
+    vm.prelex_tokens = false;
+
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    vm.compile_threads = processors > 0 ? (int) processors : 1;
+    vm.print_compile_time = false;
+    vm.compile_failed = false;
+
+    vm.module_paths = NULL;
+    vm.module_path_count = 0;
+
     initialize_table(&vm.globals);
     initialize_table(&vm.strings);
+    initialize_table(&vm.modules);
+
+    define_native("heap_snapshot", heap_snapshot_native);
+    define_native("str", str_native);
+    define_native("num", num_native);
+    define_native("clock", clock_native);
+    define_native("gc_max_pause", gc_max_pause_native);
+    define_native("gc_max_pause_cpu", gc_max_pause_cpu_native);
+
+    initialize_kernels();
+    define_native("array", array_native);
+    define_native("int_array", int_array_native);
+    define_native("sum", sum_native);
+    define_native("min", min_native);
+    define_native("max", max_native);
+    define_native("dot", dot_native);
+    define_native("scale", scale_native);
+    define_native("add", add_native);
+    define_native("count_less", count_less_native);
+    define_native("count_greater", count_greater_native);
 }
 
 void free_vm() {
 //    vm->module = NULL;
+    flush_output();
     free_table(&vm.globals);
     free_table(&vm.strings);
+    free_table(&vm.modules);
     free_objects();
 }
 
@@ -74,7 +229,15 @@ static bool call(ObjFunction *function, int arg_count) {
         return false;
     }
 
-    if (vm.frame_count == FRAMES_MAX) {
+    if (function->source != NULL && !compile_deferred_function(function)) {
+        vm.compile_failed = true;
+        runtime_error("Could not compile function '%s'.", function->name->chars);
+        return false;
+    }
+
+    // the function and its arguments are already on the stack
+    if (vm.frame_count == FRAMES_MAX ||
+        vm.stack_top - arg_count - 1 + function->max_slots > vm.stack + STACK_MAX) {
         runtime_error("Stack overflow.");
         return false;
     }
@@ -92,6 +255,13 @@ static bool call_value(Value callee, int arg_count) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_FUNCTION:
                 return call(AS_FUNCTION(callee), arg_count);
+            case OBJ_NATIVE: {
+                NativeFn native = AS_NATIVE(callee);
+                Value result = native(arg_count, vm.stack_top - arg_count);
+                vm.stack_top -= arg_count + 1;
+                push(result);
+                return true;
+            }
             default:
                 break; // Non-callable object type.
         }
@@ -110,27 +280,228 @@ static bool is_falsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Whether two numbers are integers, the case the arithmetic below is laid out
+// for: without the hint, gcc moves the integer paths out of line.
+#define BOTH_INTS(a, b) __builtin_expect(IS_INT(a) && IS_INT(b), 1)
+
+// Arithmetic on two numbers. Integers give an integer as long as the result
+// fits in 64 bits, and a double otherwise, as does any double operand.
+static inline Value add_numbers(Value a, Value b) {
+    int64_t result;
+    if (BOTH_INTS(a, b) && !__builtin_add_overflow(AS_INT(a), AS_INT(b), &result)) return INT_VAL(result);
+    return NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+}
+
+static inline Value subtract_numbers(Value a, Value b) {
+    int64_t result;
+    if (BOTH_INTS(a, b) && !__builtin_sub_overflow(AS_INT(a), AS_INT(b), &result)) return INT_VAL(result);
+    return NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+}
+
+static inline Value multiply_numbers(Value a, Value b) {
+    int64_t result;
+    if (BOTH_INTS(a, b) && !__builtin_mul_overflow(AS_INT(a), AS_INT(b), &result)) return INT_VAL(result);
+    return NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+}
+
+// Integers that divide evenly give an integer, and any other quotient is a
+// double, so 6 / 2 is 3 and 7 / 2 is 3.5.
+static inline Value divide_numbers(Value a, Value b) {
+    if (BOTH_INTS(a, b)) {
+        int64_t x = AS_INT(a), y = AS_INT(b);
+        // the quotient of the most negative integer by -1 overflows
+        if (y != 0 && !(y == -1 && x == INT64_MIN) && x % y == 0) return INT_VAL(x / y);
+    }
+    return NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+}
+
+// Comparisons of two numbers. An integer and a double are compared exactly,
+// so that 2^53 + 1 is greater than the double 2^53, which it rounds to.
+static inline bool less_than(Value a, Value b) {
+    if (BOTH_INTS(a, b)) return AS_INT(a) < AS_INT(b);
+    if (IS_INT(a)) return compare_integer_to_double(AS_INT(a), AS_DOUBLE(b)) == ORDER_LESS;
+    if (IS_INT(b)) return compare_integer_to_double(AS_INT(b), AS_DOUBLE(a)) == ORDER_GREATER;
+    return AS_DOUBLE(a) < AS_DOUBLE(b);
+}
+
+static inline bool greater_than(Value a, Value b) {
+    if (BOTH_INTS(a, b)) return AS_INT(a) > AS_INT(b);
+    if (IS_INT(a)) return compare_integer_to_double(AS_INT(a), AS_DOUBLE(b)) == ORDER_GREATER;
+    if (IS_INT(b)) return compare_integer_to_double(AS_INT(b), AS_DOUBLE(a)) == ORDER_LESS;
+    return AS_DOUBLE(a) > AS_DOUBLE(b);
+}
+
+// Whether a number is an integer, or a double that holds one.
+static bool as_integer(Value value, int64_t *integer) {
+    if (IS_INT(value)) {
+        *integer = AS_INT(value);
+        return true;
+    }
+    return number_to_integer(AS_DOUBLE(value), integer);
+}
+
+// The remainder of two integers, the divisor not zero. The remainder of the
+// most negative integer by -1 overflows in C.
+static inline int64_t remainder_of(int64_t a, int64_t b) {
+    return b == -1 ? 0 : a % b;
+}
+
+// The position a number indexes in a list or array of count items, or -1 if
+// it is outside. A double index is truncated.
+static inline int item_position(int count, Value index) {
+    if (IS_INT(index)) return AS_INT(index) >= 0 && AS_INT(index) < count ? (int) AS_INT(index) : -1;
+    double position = AS_DOUBLE(index);
+    return position > -1 && position < count ? (int) position : -1;
+}
+
+// Push the element of a packed array at an index, or report why it cannot.
+// Arrays are indexed out of line, so run() keeps the list paths tight.
+static __attribute__((noinline)) bool index_array(ObjArray *array, Value index) {
+    int position = item_position(array->count, index);
+    if (position < 0) {
+        runtime_error("Index out of bounds.");
+        return false;
+    }
+
+    push(read_array(array, position));
+    return true;
+}
+
+// Store a number in a packed array at an index, or report why it cannot.
+static __attribute__((noinline)) bool store_in_array(ObjArray *array, Value index, Value item) {
+    int position = item_position(array->count, index);
+    if (position < 0) {
+        runtime_error("Invalid list index.");
+        return false;
+    }
+    if (!store_array(array, position, item)) {
+        runtime_error(array->kind == ARRAY_INT ? "An integer array can only hold integers."
+                                               : "An array can only hold numbers.");
+        return false;
+    }
+
+    push(item);
+    return true;
+}
+
 static void concatenate() {
-    // Get the two strings from the stack.
+    // the two strings stay on the stack while the result is allocated
     ObjString *b = AS_STRING(peek(0));
     ObjString *a = AS_STRING(peek(1));
 
-    // determine the length of the new string
-    int length = a->length + b->length;
+    ObjString *result = concatenate_strings(a, b);
+    pop();
+    pop();
+    push(OBJ_VAL(result));
+}
+
+static bool get_global(ObjString *name) {
+    Value value;
+    if (!table_get(&vm.globals, name, &value)) {
+        runtime_error("Undefined variable '%s'.", name->chars);
+        return false;
+    }
+    push(value);
+    return true;
+}
 
-    // allocate the appropriate amount of memory for the new string
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
+static bool set_global(ObjString *name) {
+    WRITE_BARRIER(peek(0));
+    if (table_set(&vm.globals, name, peek(0))) {
+        table_delete(&vm.globals, name);
+        runtime_error("Undefined variable '%s'.", name->chars);
+        return false;
+    }
+    return true;
+}
 
-    // null-terminate the new string
-    chars[length] = '\0';
+// Find the real path of the file a module name refers to, in the first
+// directory of the search path that has it. The name is a path relative to
+// the directory, with or without the .sl extension. The path is written to
+// resolved, which holds PATH_MAX bytes, so that nothing is left to free when
+// an allocation after it raises an out-of-memory error.
+static bool resolve_module(const char *name, char *resolved) {
+    size_t length = strlen(name);
+    const char *extension = length >= 3 && strcmp(name + length - 3, ".sl") == 0 ? "" : ".sl";
 
-    // create the new string object and push it onto the stack
-    ObjString *result = take_string(chars, length);
-    pop();
+    for (int i = 0; i <= vm.module_path_count; i++) {
+        // the current directory is searched last
+        const char *directory = i < vm.module_path_count ? vm.module_paths[i] : ".";
+        if (name[0] == '/') directory = "";
+
+        size_t size = strlen(directory) + length + 5;
+        char *path = (char *)malloc(size);
+        if (path == NULL) return false;
+        snprintf(path, size, "%s%s%s%s", directory, name[0] == '/' ? "" : "/", name, extension);
+
+        bool found = realpath(path, resolved) != NULL;
+        free(path);
+        if (found) return true;
+        if (name[0] == '/') break;
+    }
+    return false;
+}
+
+// Import a module. The first import of a module compiles its script and
+// calls it in a new frame, which leaves the value the script returns; the
+// script is cached by the module's real path, and later imports from any
+// script leave nil without compiling or running it again.
+static bool import_module(ObjString *name) {
+    char path[PATH_MAX];
+    if (!resolve_module(name->chars, path)) {
+        runtime_error("Could not find module '%s'.", name->chars);
+        return false;
+    }
+
+    // the key stays on the stack while the module is compiled
+    push(OBJ_VAL(copy_string(path, (int) strlen(path))));
+    Value cached;
+    if (table_get(&vm.modules, AS_STRING(peek(0)), &cached)) {
+        pop();
+        push(NIL_VAL);
+        return true;
+    }
+
+    Source source;
+    SourceStatus status = load_source(path, &source);
+    if (status != SOURCE_OK) {
+        runtime_error("Could not read module '%s'.", name->chars);
+        return false;
+    }
+
+    // the key is cached for good, so its characters outlive the module's functions
+    ObjFunction *function = compile(source.chars, AS_STRING(peek(0))->chars);
+    unload_source(&source);
+    if (function == NULL) {
+        runtime_error("Could not compile module '%s'.", name->chars);
+        return false;
+    }
+
+    // cached before it runs, so that a module that imports itself does not run twice
+    push(OBJ_VAL(function));
+    table_set(&vm.modules, AS_STRING(peek(1)), peek(0));
+    vm.stack_top[-2] = vm.stack_top[-1];
     pop();
-    push(OBJ_VAL(result));
+    return call(function, 0);
+}
+
+static void build_list(uint32_t count) {
+    // stack before: [a, b, c, ...] and after: [list]
+    ObjList *list = allocate_list();
+
+    // keep the list reachable while it grows
+    push(OBJ_VAL(list));
+
+    // add each element to the list
+    for (uint32_t i = 0; i < count; i++) {
+        append_to_list(list, peek((int) (count - i)));
+    }
+
+    // pop the list and its items from the stack
+    vm.stack_top -= count + 1;
+
+    // push the list onto the stack
+    push(OBJ_VAL(list));
 }
 
 static InterpretResult run() {
@@ -142,51 +513,73 @@ static InterpretResult run() {
 // TODO: When the VM is ported to a wider bit system, this will need to be increased.
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 
+// the operands of an instruction after an OP_WIDE prefix: three bytes for an
+// index or count, four for a jump offset
+#define READ_WIDE() (frame->ip += 3, (uint32_t) ((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_LONG() \
+    (frame->ip += 4, ((uint32_t) frame->ip[-4] << 24) | ((uint32_t) frame->ip[-3] << 16) | \
+                     ((uint32_t) frame->ip[-2] << 8) | frame->ip[-1])
+
 #define READ_CONSTANT() (frame->function->module.constants.values[READ_BYTE()])
 
 #define READ_STRING() (AS_STRING(READ_CONSTANT()))
 
+// a point at which an incremental collection may run a slice: loop back-edges and calls,
+// so that a collection in progress keeps advancing even when the mutator stops allocating.
+// a heap snapshot requested by a signal is also written here, where the heap is consistent.
+#define GC_SAFEPOINT() \
+    do { \
+        if (vm.gc_phase != GC_PHASE_IDLE && --vm.gc_countdown <= 0) gc_step(); \
+        if (vm.snapshot_requested) write_requested_heap_snapshot(); \
+    } while (false)
+
 // TODO: Make the invalid operand runtime error more descriptive.
-#define BINARY_OP(value_type, op) \
+#define BINARY_OP(operation) \
     do { \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
             runtime_error("Invalid operands."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(value_type(a op b)); \
+        Value b = pop(); \
+        Value a = pop(); \
+        push(operation(a, b)); \
     } while (false)
 
-#define BINARY_OP_INT(value_type, op) \
+#define COMPARISON(comparison) \
     do { \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
             runtime_error("Invalid operands."); \
             return INTERPRET_RUNTIME_ERROR; \
-        }                             \
-        int b = (int) AS_NUMBER(pop()); \
-        int a = (int) AS_NUMBER(pop());                   \
-                                      \
-        int x = b, y = a;             \
-        double tmp1 = b - x, tmp2 = a - y;                \
-        if (tmp1 > 0 || tmp2 > 0) {   \
-            runtime_error("Modulus operator does not support float values."); \
-            return INTERPRET_RUNTIME_ERROR;                          \
-        }\
-        push(value_type(a op b)); \
+        } \
+        Value b = pop(); \
+        Value a = pop(); \
+        push(BOOL_VAL(comparison(a, b))); \
+    } while (false)
+
+// the operands are known to be numbers, the result replaces them in place
+#define NUMBER_OP(operation) \
+    do { \
+        vm.stack_top[-2] = operation(vm.stack_top[-2], vm.stack_top[-1]); \
+        vm.stack_top--; \
+    } while (false)
+
+#define NUMBER_COMPARISON(comparison) \
+    do { \
+        vm.stack_top[-2] = BOOL_VAL(comparison(vm.stack_top[-2], vm.stack_top[-1])); \
+        vm.stack_top--; \
     } while (false)
 
     for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
         // Print the stack.
-        printf("          ");
+        print_output("          ");
         // Loop through each value in the stack and print it.
         for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
-            printf("[ ");
+            print_output("[ ");
             print_value(*slot);
-            printf(" ]");
+            print_output(" ]");
         }
-        printf("\n");
+        print_output("\n");
         // Disassemble the current instruction.
         disassemble_instruction(&frame->function->module,
                                 (int) (frame->ip - frame->function->module.code));
@@ -212,6 +605,9 @@ static InterpretResult run() {
             case OP_POP:
                 pop();
                 break;
+            case OP_POPN:
+                vm.stack_top -= READ_BYTE();
+                break;
             case OP_GET_LOCAL: {
                 uint8_t slot = READ_BYTE();
                 push(frame->slots[slot]);
@@ -219,34 +615,24 @@ static InterpretResult run() {
             }
             case OP_SET_LOCAL: {
                 uint8_t slot = READ_BYTE();
+                // the stack is rescanned before marking ends, but shading the value
+                // now keeps that final rescan from finding new work.
+                WRITE_BARRIER(peek(0));
                 frame->slots[slot] = peek(0);
                 break;
             }
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-                if (!table_get(&vm.globals, name, &value)) {
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
+            case OP_GET_GLOBAL:
+                if (!get_global(READ_STRING())) return INTERPRET_RUNTIME_ERROR;
                 break;
-            }
             case OP_DEFINE_GLOBAL: {
                 ObjString *name = READ_STRING();
                 table_set(&vm.globals, name, peek(0));
                 pop();
                 break;
             }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if (table_set(&vm.globals, name, peek(0))) {
-                    table_delete(&vm.globals, name);
-                    runtime_error("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            case OP_SET_GLOBAL:
+                if (!set_global(READ_STRING())) return INTERPRET_RUNTIME_ERROR;
                 break;
-            }
             case OP_EQUAL: {
                 Value b = pop();
                 Value a = pop();
@@ -254,21 +640,66 @@ static InterpretResult run() {
                 break;
             }
             case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
+                COMPARISON(greater_than);
                 break;
             case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
+                COMPARISON(less_than);
                 break;
             case OP_LESS_EQUAL:
-                BINARY_OP(BOOL_VAL, <=);
+                // <= and >= are compiled as the opposite comparison and OP_NOT, and the fused
+                // opcodes keep that meaning: they differ from the IEEE comparisons for NaN.
+                COMPARISON(!greater_than);
+                break;
+            case OP_GREATER_EQUAL:
+                COMPARISON(!less_than);
+                break;
+            case OP_ADD_NN:
+                NUMBER_OP(add_numbers);
+                break;
+            case OP_SUBTRACT_NN:
+                NUMBER_OP(subtract_numbers);
+                break;
+            case OP_MULTIPLY_NN:
+                NUMBER_OP(multiply_numbers);
+                break;
+            case OP_DIVIDE_NN:
+                NUMBER_OP(divide_numbers);
+                break;
+            case OP_GREATER_NN:
+                NUMBER_COMPARISON(greater_than);
                 break;
+            case OP_LESS_NN:
+                NUMBER_COMPARISON(less_than);
+                break;
+            case OP_LESS_EQUAL_NN:
+                NUMBER_COMPARISON(!greater_than);
+                break;
+            case OP_GREATER_EQUAL_NN:
+                NUMBER_COMPARISON(!less_than);
+                break;
+            case OP_ADD_LOCAL_NN: {
+                uint8_t slot = READ_BYTE();
+                frame->slots[slot] = add_numbers(frame->slots[slot], pop());
+                break;
+            }
+            case OP_SUBTRACT_LOCAL_NN: {
+                uint8_t slot = READ_BYTE();
+                frame->slots[slot] = subtract_numbers(frame->slots[slot], pop());
+                break;
+            }
+            case OP_NOT_EQUAL: {
+                Value b = pop();
+                Value a = pop();
+                push(BOOL_VAL(!values_equal(a, b)));
+                break;
+            }
             case OP_ADD: {
                 if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
                     concatenate();
                 } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+                    Value b = pop();
+                    Value a = pop();
+                    push(add_numbers(a, b));
                 } else {
                     runtime_error("Operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
@@ -276,18 +707,33 @@ static InterpretResult run() {
                 break;
             }
             case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
+                BINARY_OP(subtract_numbers);
                 break;
             case OP_MULTIPLY:
-                BINARY_OP(NUMBER_VAL, *);
+                BINARY_OP(multiply_numbers);
                 break;
             case OP_DIVIDE:
-                BINARY_OP(NUMBER_VAL, /);
+                BINARY_OP(divide_numbers);
                 break;
-            case OP_MODULO:
-                // fail if the operands are not integers
-                BINARY_OP_INT(NUMBER_VAL, %);
+            case OP_MODULO: {
+                // fail if the operands are not integers, or doubles that hold them
+                if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+                    runtime_error("Invalid operands.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                int64_t a, b;
+                if (!as_integer(peek(1), &a) || !as_integer(peek(0), &b)) {
+                    runtime_error("Modulus operator does not support float values.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (b == 0) {
+                    runtime_error("Modulo by zero.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                vm.stack_top -= 2;
+                push(INT_VAL(remainder_of(a, b)));
                 break;
+            }
             case OP_NOT:
                 push(BOOL_VAL(is_falsey(pop())));
                 break;
@@ -297,11 +743,15 @@ static InterpretResult run() {
                     runtime_error("Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
+                if (IS_INT(peek(0)) && AS_INT(peek(0)) != INT64_MIN) {
+                    vm.stack_top[-1] = INT_VAL(-AS_INT(peek(0)));
+                } else {
+                    vm.stack_top[-1] = NUMBER_VAL(-AS_NUMBER(peek(0)));
+                }
                 break;
             case OP_PRINTLN:
                 print_value(pop());
-                printf("\n");
+                end_output_line();
                 break;
             case OP_JUMP: {
                 uint16_t offset = READ_SHORT();
@@ -322,27 +772,12 @@ static InterpretResult run() {
                 // the only difference between this and OP_JUMP is that the offset is negative
                 uint16_t offset = READ_SHORT();
                 frame->ip -= offset;
+                GC_SAFEPOINT();
                 break;
             }
-            case OP_BUILD_LIST: {
-                // stack before: [a, b, c, ...] and after: [list]
-                ObjList *list = allocate_list();
-                uint8_t count = READ_BYTE();
-
-                // add each element to the list
-                for (int i = 0; i < count; i++) {
-                    append_to_list(list, peek(count - i - 1));
-                }
-
-                // pop the list items from the stack
-                while (count--) {
-                    pop();
-                }
-
-                // push the list onto the stack
-                push(OBJ_VAL(list));
+            case OP_BUILD_LIST:
+                build_list(READ_BYTE());
                 break;
-            }
             case OP_BUILD_RANGE: {
                 // Retrieve end and start of the range from the stack
                 Value endValue = pop();
@@ -351,13 +786,11 @@ static InterpretResult run() {
                 // Ensure both values are numbers
                 if (!IS_NUMBER(startValue) || !IS_NUMBER(endValue)) {
                     runtime_error("Range boundaries must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
                 }
 
-                double start = AS_NUMBER(startValue);
-                double end = AS_NUMBER(endValue);
-
                 // Allocate and initialize the range object
-                ObjRange *range = allocate_range(start, end);
+                ObjRange *range = allocate_range(startValue, endValue);
 
                 // Push the range object onto the stack
                 push(OBJ_VAL(range));
@@ -369,20 +802,24 @@ static InterpretResult run() {
                 Value stack_list = pop();
                 Value result;
 
-                // ensure that the value is a list
-                if (!IS_LIST(stack_list)) {
+                // ensure that the value is a list, or a packed array
+                if (!IS_LIST(stack_list) && !IS_ARRAY(stack_list)) {
                     runtime_error("Index operator must be used with a list.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                ObjList *list = AS_LIST(stack_list);
-
                 if (!IS_NUMBER(stack_index)) {
                     runtime_error("Index must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                int index = AS_NUMBER(stack_index);
+                if (IS_ARRAY(stack_list)) {
+                    if (!index_array(AS_ARRAY(stack_list), stack_index)) return INTERPRET_RUNTIME_ERROR;
+                    break;
+                }
+
+                ObjList *list = AS_LIST(stack_list);
+                int index = item_position(list->count, stack_index);
 
                 if (!is_valid_index(list, index)) {
                     runtime_error("Index out of bounds.");
@@ -397,13 +834,47 @@ static InterpretResult run() {
                 // stack before: [list] and after: [length]
                 Value stack_list = pop();
 
+                if (IS_ARRAY(stack_list)) {
+                    push(INT_VAL(AS_ARRAY(stack_list)->count));
+                    break;
+                }
+
                 if (!IS_LIST(stack_list)) {
                     runtime_error("Cannot get length of a non-list.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
                 ObjList *list = AS_LIST(stack_list);
-                push(NUMBER_VAL(list->count));
+                push(INT_VAL(list->count));
+                break;
+            }
+            case OP_SLICE_LIST: {
+                // stack before: [list, first, last] and after: [view]
+                Value stack_last = pop();
+                Value stack_first = pop();
+                Value stack_list = pop();
+
+                if (!IS_LIST(stack_list)) {
+                    runtime_error("Slice operator must be used with a list.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                int64_t first, last;
+                if (!IS_NUMBER(stack_first) || !IS_NUMBER(stack_last) ||
+                    !as_integer(stack_first, &first) || !as_integer(stack_last, &last)) {
+                    runtime_error("Slice bounds must be integers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                // the bounds are inclusive like those of a range, and a last
+                // bound just before the first gives an empty slice
+                ObjList *list = AS_LIST(stack_list);
+                if (first < 0 || last >= list->count || last < first - 1) {
+                    runtime_error("Slice out of bounds.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                push(OBJ_VAL(slice_list(list, (int) first, (int) last + 1)));
                 break;
             }
             case OP_STORE_LIST: {
@@ -412,18 +883,23 @@ static InterpretResult run() {
                 Value stack_index = pop();
                 Value stack_list = pop();
 
-                if (!IS_LIST(stack_list)) {
+                if (!IS_LIST(stack_list) && !IS_ARRAY(stack_list)) {
                     runtime_error("Cannot store value in a non-list.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                ObjList *list = AS_LIST(stack_list);
 
                 if (!IS_NUMBER(stack_index)) {
                     runtime_error("List index is not a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                int index = AS_NUMBER(stack_index);
+                if (IS_ARRAY(stack_list)) {
+                    if (!store_in_array(AS_ARRAY(stack_list), stack_index, item)) return INTERPRET_RUNTIME_ERROR;
+                    break;
+                }
+
+                ObjList *list = AS_LIST(stack_list);
+                int index = item_position(list->count, stack_index);
 
                 if (!is_valid_index(list, index)) {
                     runtime_error("Invalid list index.");
@@ -437,26 +913,19 @@ static InterpretResult run() {
             case OP_INCREMENT: {
                 // Currently only supports incrementing numbers.
                 // stack before: [value] and after: [value + 1]
-                if (IS_NUMBER(peek(0))) {
-                    double incrementedValue = AS_NUMBER(pop()) + 1; // Increment the value
-                    push(NUMBER_VAL(incrementedValue)); // Push the incremented value back onto the stack
-                    break;
-                }
-
-                double incrementedValue = AS_NUMBER(pop()) + 1; // Increment the value
-                push(NUMBER_VAL(incrementedValue)); // Push the incremented value back onto the stack
+                vm.stack_top[-1] = add_numbers(peek(0), INT_VAL(1));
                 break;
             }
             case OP_RANGE_START: {
                 // stack before: [range] and after: [range, start]
                 ObjRange *range = AS_RANGE(peek(0));
-                push(NUMBER_VAL(range->start));
+                push(range->start);
                 break;
             }
             case OP_RANGE_END: {
                 // stack before: [range] and after: [range, end]
                 ObjRange *range = AS_RANGE(peek(0));
-                push(NUMBER_VAL(range->end));
+                push(range->end);
                 break;
             }
             case OP_INCREMENT_RANGE: {
@@ -470,13 +939,12 @@ static InterpretResult run() {
                 }
 
                 // ensure the value is within the range
-                if (AS_NUMBER(value) < range->start || AS_NUMBER(value) > range->end) {
+                if (less_than(value, range->start) || greater_than(value, range->end)) {
                     runtime_error("Increment value is out of range.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
 
-                double incrementedValue = AS_NUMBER(value) + 1; // Increment the value
-                push(NUMBER_VAL(incrementedValue)); // Push the incremented value back onto the stack
+                push(add_numbers(value, INT_VAL(1))); // Push the incremented value back onto the stack
                 break;
             }
             case OP_GET_REGISTER: {
@@ -495,6 +963,7 @@ static InterpretResult run() {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 frame = &vm.frames[vm.frame_count - 1];
+                GC_SAFEPOINT();
                 break;
             }
             case OP_RETURN: {
@@ -502,37 +971,222 @@ static InterpretResult run() {
                 vm.frame_count--;
                 if (vm.frame_count == 0) {
                     pop();
+                    vm.gc_stack_floor = vm.stack;
                     return INTERPRET_OK;
                 }
 
                 vm.stack_top = frame->slots;
                 push(result);
                 frame = &vm.frames[vm.frame_count - 1];
+                // the caller's locals may be written from here on
+                if (frame->slots < vm.gc_stack_floor) vm.gc_stack_floor = frame->slots;
                 break;
                 // exit interpreter
 //                return INTERPRET_OK;
             }
+            case OP_IMPORT:
+                if (!import_module(READ_STRING())) return INTERPRET_RUNTIME_ERROR;
+                frame = &vm.frames[vm.frame_count - 1];
+                GC_SAFEPOINT();
+                break;
             case OP_DUPLICATE: {
                 // stack before: [value] and after: [value, value]
                 push(peek(0));
                 break;
             }
+            case OP_JUMP_IF_CALLEE: {
+                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+                uint16_t offset = READ_SHORT();
+                // run the inlined body while the function's global still holds
+                // it, otherwise leave the value it holds to be called
+                if (!get_global(function->name)) return INTERPRET_RUNTIME_ERROR;
+                if (IS_OBJ(peek(0)) && AS_OBJ(peek(0)) == (Obj *) function) {
+                    pop();
+                    frame->ip += offset;
+                }
+                break;
+            }
+            case OP_PEEK: {
+                // stack before: [value, ...] and after: [value, ..., value]
+                uint8_t distance = READ_BYTE();
+                push(peek(distance));
+                break;
+            }
+            case OP_POP_UNDER: {
+                // stack before: [a, b, ..., result] and after: [result]
+                Value result = pop();
+                vm.stack_top -= READ_BYTE();
+                push(result);
+                break;
+            }
+            case OP_WIDE: {
+                // the same instructions as above, with wider operands
+                Module *module = &frame->function->module;
+                switch (READ_BYTE()) {
+                    case OP_CONSTANT:
+                        push(module->constants.values[READ_WIDE()]);
+                        break;
+                    case OP_GET_LOCAL:
+                        push(frame->slots[READ_WIDE()]);
+                        break;
+                    case OP_SET_LOCAL: {
+                        uint32_t slot = READ_WIDE();
+                        WRITE_BARRIER(peek(0));
+                        frame->slots[slot] = peek(0);
+                        break;
+                    }
+                    case OP_ADD_LOCAL_NN: {
+                        uint32_t slot = READ_WIDE();
+                        frame->slots[slot] = add_numbers(frame->slots[slot], pop());
+                        break;
+                    }
+                    case OP_SUBTRACT_LOCAL_NN: {
+                        uint32_t slot = READ_WIDE();
+                        frame->slots[slot] = subtract_numbers(frame->slots[slot], pop());
+                        break;
+                    }
+                    case OP_GET_GLOBAL:
+                        if (!get_global(AS_STRING(module->constants.values[READ_WIDE()]))) {
+                            return INTERPRET_RUNTIME_ERROR;
+                        }
+                        break;
+                    case OP_DEFINE_GLOBAL:
+                        table_set(&vm.globals, AS_STRING(module->constants.values[READ_WIDE()]), peek(0));
+                        pop();
+                        break;
+                    case OP_IMPORT:
+                        if (!import_module(AS_STRING(module->constants.values[READ_WIDE()]))) {
+                            return INTERPRET_RUNTIME_ERROR;
+                        }
+                        frame = &vm.frames[vm.frame_count - 1];
+                        GC_SAFEPOINT();
+                        break;
+                    case OP_SET_GLOBAL:
+                        if (!set_global(AS_STRING(module->constants.values[READ_WIDE()]))) {
+                            return INTERPRET_RUNTIME_ERROR;
+                        }
+                        break;
+                    case OP_POPN:
+                        vm.stack_top -= READ_WIDE();
+                        break;
+                    case OP_BUILD_LIST:
+                        build_list(READ_WIDE());
+                        break;
+                    case OP_JUMP_IF_CALLEE: {
+                        ObjFunction *function = AS_FUNCTION(module->constants.values[READ_WIDE()]);
+                        uint32_t offset = READ_LONG();
+                        if (!get_global(function->name)) return INTERPRET_RUNTIME_ERROR;
+                        if (IS_OBJ(peek(0)) && AS_OBJ(peek(0)) == (Obj *) function) {
+                            pop();
+                            frame->ip += offset;
+                        }
+                        break;
+                    }
+                    case OP_PEEK: {
+                        uint32_t distance = READ_WIDE();
+                        push(peek((int) distance));
+                        break;
+                    }
+                    case OP_POP_UNDER: {
+                        Value result = pop();
+                        vm.stack_top -= READ_WIDE();
+                        push(result);
+                        break;
+                    }
+                    case OP_CALL: {
+                        int arg_count = (int) READ_WIDE();
+                        if (!call_value(peek(arg_count), arg_count)) {
+                            return INTERPRET_RUNTIME_ERROR;
+                        }
+                        frame = &vm.frames[vm.frame_count - 1];
+                        GC_SAFEPOINT();
+                        break;
+                    }
+                    case OP_JUMP: {
+                        uint32_t offset = READ_LONG();
+                        frame->ip += offset;
+                        break;
+                    }
+                    case OP_JUMP_IF_FALSE: {
+                        uint32_t offset = READ_LONG();
+                        if (is_falsey(peek(0))) frame->ip += offset;
+                        break;
+                    }
+                    case OP_JUMP_IF_TRUE: {
+                        uint32_t offset = READ_LONG();
+                        if (!is_falsey(peek(0))) frame->ip += offset;
+                        break;
+                    }
+                    case OP_LOOP: {
+                        uint32_t offset = READ_LONG();
+                        frame->ip -= offset;
+                        GC_SAFEPOINT();
+                        break;
+                    }
+                }
+                break;
+            }
         }
     }
 
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_WIDE
+#undef READ_LONG
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef GC_SAFEPOINT
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef COMPARISON
+#undef NUMBER_COMPARISON
 }
 
 InterpretResult interpret(const char *source) {
-    ObjFunction *function = compile(source);
+    return interpret_program(&source, NULL, 1);
+}
+
+static uint64_t now_ns() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000u + (uint64_t) time.tv_nsec;
+}
+
+// Compile the scripts of a program and run them. Kept apart from the setjmp
+// in interpret_program, so that no local of it can be clobbered by the longjmp.
+static InterpretResult compile_and_run(const char **sources, const char **paths, int count) {
+    vm.compile_failed = false;
+    int threads = vm.compile_threads < count ? vm.compile_threads : count;
+    uint64_t start = now_ns();
+    ObjFunction *function = compile_program(sources, paths, count, threads);
+    if (vm.print_compile_time) {
+        fprintf(stderr, "compiled %d script%s in %.3f ms on %d thread%s\n", count, count == 1 ? "" : "s",
+                (double) (now_ns() - start) / 1e6, threads, threads == 1 ? "" : "s");
+    }
+
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
     push(OBJ_VAL(function));
-    call(function, 0);
+    if (!call(function, 0)) return INTERPRET_RUNTIME_ERROR;
+
+    InterpretResult result = run();
+    if (result == INTERPRET_RUNTIME_ERROR && vm.compile_failed) result = INTERPRET_COMPILE_ERROR;
+    return result;
+}
+
+InterpretResult interpret_program(const char **sources, const char **paths, int count) {
+    // an out-of-memory error anywhere below unwinds to here, the VM stays usable afterwards
+    jmp_buf handler;
+    jmp_buf *enclosing = vm.error_handler;
+    vm.error_handler = &handler;
+
+    if (setjmp(handler) != 0) {
+        vm.error_handler = enclosing;
+        runtime_error("Out of memory.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
 
-    return run();
+    InterpretResult result = compile_and_run(sources, paths, count);
+    vm.error_handler = enclosing;
+    return result;
 }
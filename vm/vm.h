@@ -1,16 +1,24 @@
 #ifndef PROTOSLANG_VM_H
 #define PROTOSLANG_VM_H
 
+#include <setjmp.h>
+#include <signal.h>
+
 #include "module.h"
 #include "value.h"
 #include "table.h"
 #include "object.h"
+#include "memory.h"
+#include "output.h"
 
 // The maximum number of values that the VM can store on the stack.
 // For now, we shall allocate a fixed amount of memory for the stack.
 // However, future implementations may use a dynamic array to store values.
+// Locals, arguments and list items are not limited to a byte's worth per
+// frame, so the stack is sized for large frames, and a call that would not
+// fit is a stack overflow. Pages of it that are never reached are never touched.
 #define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define STACK_MAX (1024 * 1024)
 
 typedef struct {
     ObjFunction *function;
@@ -43,11 +51,94 @@ typedef struct {
     // The table of strings that the VM will use to store strings.
     Table strings;
 
+    // The scripts of the modules imported so far, by real path, and the
+    // directories searched for modules before the current directory.
+    Table modules;
+    const char **module_paths;
+    int module_path_count;
+
     // The linked list of objects in the heap.
     Obj* objects;
 
     // A temporary register for storing values.
     Value reg_0;
+
+    // The number of bytes currently allocated, the most ever allocated at
+    // once, and the threshold at which the next collection cycle starts.
+    size_t bytes_allocated;
+    size_t peak_bytes_allocated;
+    size_t next_gc;
+
+    // The heap limits, zero when unlimited. Allocating past the soft limit
+    // forces a collection, allocating past the hard limit is a runtime error.
+    size_t soft_heap_limit;
+    size_t hard_heap_limit;
+    uint64_t out_of_memory_errors;
+
+    // Where an out-of-memory error unwinds to, NULL outside of interpret().
+    jmp_buf* error_handler;
+
+    // The worklist of gray objects: marked, but with unmarked children.
+    int gray_count;
+    int gray_capacity;
+    Obj** gray_stack;
+
+    // The current collector phase and mark epoch. The epoch flips at the
+    // start of every cycle, which turns every surviving object white without
+    // walking the heap.
+    GCPhase gc_phase;
+    uint8_t mark_epoch;
+
+    // The link in the object list at which an incremental sweep resumes, and
+    // the entry of the string table at which dropping unreached strings
+    // resumes. The entries are walked again if the table is resized.
+    Obj** sweep_cursor;
+    int strings_cursor;
+    Entry* strings_entries;
+
+    // The lowest stack slot the mutator may have written since the stack was
+    // last scanned. Only the slots of the current frame and those above it
+    // are written, so it falls only when a frame returns, and the slots under
+    // it need not be scanned again before marking finishes.
+    Value* gc_stack_floor;
+
+    // The bytes allocated since the last incremental slice, and the number of
+    // safepoints the mutator passes before it performs the next slice.
+    size_t gc_debt;
+    int gc_countdown;
+
+    // Collector configuration: incremental mode and its per-slice pause budget,
+    // and the number of threads that mark and sweep in a full collection.
+    bool gc_incremental;
+    uint64_t gc_max_pause_us;
+    int gc_threads;
+
+    GCStats gc_stats;
+
+    // Compiler configuration: the optimization level, 0 to compile the tree
+    // as parsed, whether compiled functions are disassembled to stdout, and
+    // whether function bodies are only compiled when first called, and
+    // whether a script is split into tokens before it is parsed.
+    int optimization_level;
+    bool print_code;
+    bool defer_functions;
+    bool prelex_tokens;
+
+    // The number of threads the scripts of a program are parsed on, and
+    // whether the time compiling takes is printed to stderr.
+    int compile_threads;
+    bool print_compile_time;
+
+    // Set when a function compiled on its first call has errors, which are
+    // then what stops the script.
+    bool compile_failed;
+
+    // What the script prints, on its way to stdout.
+    OutputBuffer output;
+
+    // Set by the SIGUSR1 handler, a heap snapshot is written at the next safepoint.
+    volatile sig_atomic_t snapshot_requested;
+    unsigned int snapshot_sequence;
 } VM;
 
 typedef enum {
@@ -67,6 +158,10 @@ void free_vm();
 // Interpret a module.
 InterpretResult interpret(const char *source);
 
+// Interpret the scripts of a program, compiled together and run in order.
+// Compile errors name the path of their script. paths may be NULL.
+InterpretResult interpret_program(const char **sources, const char **paths, int count);
+
 // push a value onto the stack
 void push(Value value);
 